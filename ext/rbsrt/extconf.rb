@@ -49,6 +49,15 @@ unless find_library('srt', 'srt_create_socket')
   abort "libsrt is missing no sock.  please install libsrt: https://github.com/Haivision/srt"
 end
 
+# batched udp io, linux only
+
+have_func('sendmmsg', ['sys/types.h', 'sys/socket.h'])
+have_func('recvmmsg', ['sys/types.h', 'sys/socket.h'])
+
+# file descriptors of io arguments, ruby 3.1 and later
+
+have_func('rb_io_descriptor', 'ruby/io.h')
+
 dir_config(extension_name)
 
 create_makefile(extension_name)
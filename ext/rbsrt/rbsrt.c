@@ -18,6 +18,10 @@
 
 // MARK: - System
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 // sendmmsg and recvmmsg
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -25,12 +29,19 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include <stdatomic.h>
 
@@ -43,6 +54,7 @@
 #include <ruby/thread.h>
 #include <ruby/thread_native.h>
 #include <ruby/io.h>
+#include <ruby/encoding.h>
 #include <ruby/vm.h>
 
 // MARK: SRT
@@ -78,6 +90,86 @@ int resolve_address(struct addrinfo *res, char host[], char port[])
     return RBSRT_SUCCESS;
 }
 
+// Binds to the first usable address the host resolves to. IPv6 addresses are 
+// bound dual-stack unless ipv6only is 1.
+int rbsrt_bind_host(SRTSOCKET socket, const char *host, const char *port, int ipv6only, const char **error)
+{
+    struct addrinfo hints;
+    struct addrinfo *servinfo;
+    struct addrinfo *p;
+    int status;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((status = getaddrinfo(host, port, &hints, &servinfo)) != 0)
+    {
+        *error = gai_strerror(status);
+
+        return RBSRT_FAILURE;
+    }
+
+    status = SRT_ERROR;
+
+    for (p = servinfo; p != NULL; p = p->ai_next)
+    {
+        if (p->ai_family == AF_INET6)
+        {
+            srt_setsockflag(socket, SRTO_IPV6ONLY, &ipv6only, sizeof(ipv6only));
+        }
+
+        if ((status = srt_bind(socket, p->ai_addr, p->ai_addrlen)) != SRT_ERROR)
+        {
+            break;
+        }
+
+        RBSRT_DEBUG_PRINT("failed to bind socket: %s", srt_getlasterror_str());
+    }
+
+    freeaddrinfo(servinfo);
+
+    if (status == SRT_ERROR)
+    {
+        *error = srt_getlasterror_str();
+
+        return RBSRT_FAILURE;
+    }
+
+    return RBSRT_SUCCESS;
+}
+
+// Binds to a host name, IPv4 or IPv6 literal. An empty host binds dual-stack to
+// every interface, or to every IPv4 interface when IPv6 is not available and 
+// ipv6only is 0.
+int rbsrt_bind_address(SRTSOCKET socket, const char *host, const char *port, int ipv6only, const char **error)
+{
+    if (host[0])
+    {
+        return rbsrt_bind_host(socket, host, port, ipv6only, error);
+    }
+
+    int status = rbsrt_bind_host(socket, "::", port, ipv6only, error);
+
+    if (status == RBSRT_SUCCESS || ipv6only)
+    {
+        return status;
+    }
+
+    RBSRT_DEBUG_PRINT("failed to bind to ::, falling back to 0.0.0.0: %s", *error);
+
+    return rbsrt_bind_host(socket, "0.0.0.0", port, ipv6only, error);
+}
+
+// Maps the ipv6only: option to the value expected by rbsrt_bind_address
+int rbsrt_ipv6only_option(VALUE opts)
+{
+    VALUE ipv6only = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("ipv6only")));
+
+    return RTEST(ipv6only) ? 1 : 0;
+}
+
 void *get_in_addr(struct sockaddr *sa)
 {
     if (sa->sa_family == AF_INET) 
@@ -339,6 +431,13 @@ _Noreturn void rbsrt_raise_last_srt_error()
     rb_raise(last_error, "%s", srt_getlasterror_str());
 }
 
+_Noreturn void rbsrt_raise_srt_error(int error_code)
+{
+    VALUE error = rbstr_error_with_srt_error_code(error_code);
+
+    rb_raise(error, "%s", srt_strerror(error_code, 0));
+}
+
 void rbsrt_init_errors()
 {
     rbsrt_eStandardError                = rb_define_class_under(mSRTModule, "Error", rb_eStandardError);
@@ -608,8 +707,314 @@ void rbsrt_define_socket_state_api(VALUE klass)
 }
 
 
+// MARK: Blocking IO
+
+#ifndef RBSRT_IO_WAIT_SLICE
+#define RBSRT_IO_WAIT_SLICE 50 // ms between checks for pending ruby interrupts
+#endif
+
+rbsrt_socket_io_t *rbsrt_socket_io(rbsrt_socket_base_t *socket)
+{
+    if (!socket->io)
+    {
+        socket->io = malloc(sizeof(rbsrt_socket_io_t));
+
+        memset(socket->io, 0, sizeof(rbsrt_socket_io_t));
+
+        socket->io->read_epollid = SRT_ERROR;
+        socket->io->write_epollid = SRT_ERROR;
+    }
+
+    return socket->io;
+}
+
+void rbsrt_coalescer_detach(rbsrt_coalescer_t *coalescer);
+void rbsrt_coalescer_stop(rbsrt_coalescer_t *coalescer);
+
+void rbsrt_socket_io_release(rbsrt_socket_io_t *io)
+{
+    if (!io)
+    {
+        return;
+    }
+
+    if (io->coalescer)
+    {
+        rbsrt_coalescer_detach(io->coalescer);
+    }
+
+    if (io->recv_buf)
+    {
+        free(io->recv_buf);
+    }
+
+    if (io->read_epollid != SRT_ERROR)
+    {
+        srt_epoll_release(io->read_epollid);
+    }
+
+    if (io->write_epollid != SRT_ERROR)
+    {
+        srt_epoll_release(io->write_epollid);
+    }
+
+    free(io);
+}
+
+int rbsrt_socket_is_blocking(SRTSOCKET socket, SRT_SOCKOPT sync_option)
+{
+    int is_syn = 0;
+    int is_syn_size = sizeof(is_syn);
+
+    if (srt_getsockflag(socket, sync_option, &is_syn, &is_syn_size) == SRT_ERROR)
+    {
+        return 0;
+    }
+
+    return is_syn ? 1 : 0;
+}
+
+// Returns an epoll watching the socket for the given event, or SRT_ERROR when 
+// the socket does not block in that direction. The epoll is created on first use
+// and owned by the socket.
+SRT_EPOLL_T rbsrt_socket_io_wait_epoll(rbsrt_socket_base_t *socket, int event)
+{
+    SRT_SOCKOPT sync_option = event == SRT_EPOLL_IN ? SRTO_RCVSYN : SRTO_SNDSYN;
+
+    if (!rbsrt_socket_is_blocking(socket->socket, sync_option))
+    {
+        return SRT_ERROR;
+    }
+
+    rbsrt_socket_io_t *io = rbsrt_socket_io(socket);
+    SRT_EPOLL_T *epollid = event == SRT_EPOLL_IN ? &io->read_epollid : &io->write_epollid;
+
+    if (*epollid == SRT_ERROR)
+    {
+        int events = event | SRT_EPOLL_ERR;
+
+        *epollid = srt_epoll_create();
+
+        if (*epollid == SRT_ERROR)
+        {
+            rbsrt_raise_last_srt_error();
+        }
+
+        if (srt_epoll_add_usock(*epollid, socket->socket, &events) == SRT_ERROR)
+        {
+            srt_epoll_release(*epollid);
+
+            *epollid = SRT_ERROR;
+
+            rbsrt_raise_last_srt_error();
+        }
+    }
+
+    return *epollid;
+}
+
+// Waits without the gvl until the socket is ready. Returns RBSRT_FAILURE when 
+// ruby interrupted the wait, RBSRT_SUCCESS otherwise. A socket which is not 
+// connected is reported as ready so the following srt call can report the error.
+int rbsrt_io_wait(SRTSOCKET socket, SRT_EPOLL_T epollid, atomic_int *interrupted)
+{
+    SRT_EPOLL_EVENT event;
+
+    while (!atomic_load(interrupted))
+    {
+        if (srt_getsockstate(socket) != SRTS_CONNECTED)
+        {
+            return RBSRT_SUCCESS;
+        }
+
+        if (srt_epoll_uwait(epollid, &event, 1, RBSRT_IO_WAIT_SLICE) != 0)
+        {
+            return RBSRT_SUCCESS;
+        }
+    }
+
+    return RBSRT_FAILURE;
+}
+
+// Checks whether the socket is ready without waiting. Like rbsrt_io_wait a 
+// socket which is not connected is reported as ready.
+int rbsrt_io_ready(SRTSOCKET socket, SRT_EPOLL_T epollid)
+{
+    SRT_EPOLL_EVENT event;
+
+    if (srt_getsockstate(socket) != SRTS_CONNECTED)
+    {
+        return 1;
+    }
+
+    return srt_epoll_uwait(epollid, &event, 1, 0) != 0;
+}
+
+void rbsrt_io_interrupt(void *context)
+{
+    atomic_int *interrupted = (atomic_int *)context;
+
+    atomic_store(interrupted, 1);
+}
+
+
+// MARK: Payloads
+
+SRT_TRANSTYPE rbsrt_socket_transtype(rbsrt_socket_base_t *socket)
+{
+    // NOTE: srt does not allow reading SRTO_TRANSTYPE, sockets are live unless
+    //       set otherwise with #transmission_mode=
+
+    return socket->io ? socket->io->transtype : SRTT_LIVE;
+}
+
+int rbsrt_socket_payload_size(SRTSOCKET socket)
+{
+    int payload_size = 0;
+    int payload_size_size = sizeof(payload_size);
+
+    if (srt_getsockflag(socket, SRTO_PAYLOADSIZE, &payload_size, &payload_size_size) == SRT_ERROR || payload_size <= 0)
+    {
+        return RBSRT_PAYLOAD_SIZE;
+    }
+
+    return payload_size > RBSRT_MAX_PAYLOAD_SIZE ? RBSRT_MAX_PAYLOAD_SIZE : payload_size;
+}
+
+// Returns the number of bytes a single send may carry. Live mode sockets send 
+// payload sized packets and pack small buffers together (*packed is set), file 
+// mode sockets send every buffer as a single message or hand it to srt as a 
+// whole when using the stream api.
+int rbsrt_socket_send_size(rbsrt_socket_base_t *socket, int *packed)
+{
+    if (rbsrt_socket_transtype(socket) == SRTT_LIVE)
+    {
+        *packed = 1;
+
+        return rbsrt_socket_payload_size(socket->socket);
+    }
+
+    *packed = 0;
+
+    return INT_MAX;
+}
+
+int rbsrt_socket_message_api(SRTSOCKET socket)
+{
+    int message_api = 0;
+    int message_api_size = sizeof(message_api);
+
+    if (srt_getsockflag(socket, SRTO_MESSAGEAPI, &message_api, &message_api_size) == SRT_ERROR)
+    {
+        return 0;
+    }
+
+    return message_api ? 1 : 0;
+}
+
+// Returns the size of the buffer needed to receive a single message. Messages 
+// of a file mode socket using the message api can be larger, they are read with
+// a buffer grown by rbsrt_socket_queued_size right before reading.
+//
+// SRTO_PAYLOADSIZE only limits what the socket sends and is not negotiated, a 
+// live mode peer may send payloads of up to RBSRT_MAX_PAYLOAD_SIZE bytes.
+int rbsrt_socket_recv_size(rbsrt_socket_base_t *socket)
+{
+    if (rbsrt_socket_transtype(socket) == SRTT_LIVE)
+    {
+        return RBSRT_MAX_PAYLOAD_SIZE;
+    }
+
+    return RBSRT_FILE_RECV_SIZE;
+}
+
+// Returns whether messages of the socket can be larger than rbsrt_socket_recv_size.
+int rbsrt_socket_large_messages(rbsrt_socket_base_t *socket)
+{
+    return rbsrt_socket_transtype(socket) != SRTT_LIVE && rbsrt_socket_message_api(socket->socket);
+}
+
+// Returns the most bytes the next message of a message api socket can have. srt 
+// drops whatever part of a message does not fit in the read buffer and does not 
+// report the size of the next message, but every packet it holds could belong to
+// it. Safe to call without the gvl.
+int rbsrt_socket_queued_size(SRTSOCKET socket)
+{
+    int rcvdata = 0;
+    int rcvdata_size = sizeof(rcvdata);
+
+    if (srt_getsockflag(socket, SRTO_RCVDATA, &rcvdata, &rcvdata_size) == SRT_ERROR || rcvdata <= 0)
+    {
+        return 0;
+    }
+
+    if (rcvdata > INT_MAX / RBSRT_MAX_PAYLOAD_SIZE)
+    {
+        return INT_MAX;
+    }
+
+    return rcvdata * RBSRT_MAX_PAYLOAD_SIZE;
+}
+
+// Returns the socket's receive buffer grown to at least size bytes, or NULL when 
+// another thread is using it.
+char *rbsrt_socket_io_acquire_recv_buf(rbsrt_socket_io_t *io, size_t size)
+{
+    if (atomic_exchange(&io->recv_buf_busy, 1))
+    {
+        return NULL;
+    }
+
+    if (io->recv_buf_size < size)
+    {
+        char *recv_buf = realloc(io->recv_buf, size);
+
+        if (!recv_buf)
+        {
+            atomic_store(&io->recv_buf_busy, 0);
+
+            return NULL;
+        }
+
+        io->recv_buf = recv_buf;
+        io->recv_buf_size = size;
+    }
+
+    return io->recv_buf;
+}
+
+VALUE rbsrt_socket_io_release_recv_buf(VALUE context)
+{
+    rbsrt_socket_io_t *io = (rbsrt_socket_io_t *)context;
+
+    atomic_store(&io->recv_buf_busy, 0);
+
+    return Qnil;
+}
+
+
 // MARK: Connecting
 
+typedef struct RBSRTConnectArg
+{
+    SRTSOCKET socket;
+    const struct sockaddr *address;
+    int address_len;
+    int status;
+} rbsrt_connect_arg_t;
+
+// NOTE: srt_connect waits for the listener to decide, a server in the same 
+//       process needs the gvl to run its on_handshake block meanwhile.
+
+void *rbsrt_socket_connect_without_gvl(void *context)
+{
+    rbsrt_connect_arg_t *arg = (rbsrt_connect_arg_t *)context;
+
+    arg->status = srt_connect(arg->socket, arg->address, arg->address_len);
+
+    return arg;
+}
+
 VALUE rbsrt_socket_connect(VALUE self, VALUE host, VALUE port)
 {
     Check_Type(host, T_STRING);
@@ -649,7 +1054,11 @@ VALUE rbsrt_socket_connect(VALUE self, VALUE host, VALUE port)
             continue;
         }
 
-        if (srt_connect(socket->socket, p->ai_addr, p->ai_addrlen) == SRT_ERROR)
+        rbsrt_connect_arg_t arg = { .socket = socket->socket, .address = p->ai_addr, .address_len = (int)p->ai_addrlen, .status = SRT_ERROR };
+
+        rb_thread_call_without_gvl(rbsrt_socket_connect_without_gvl, &arg, NULL, NULL);
+
+        if (arg.status == SRT_ERROR)
         {
             RBSRT_DEBUG_PRINT("failed to connect socket: %s", srt_getlasterror_str());
 
@@ -709,43 +1118,33 @@ VALUE rbsrt_socket_accept(VALUE self)
     RBSRT_SOCKET_UNWRAP(rbclient, client);
 
     client->socket = accepted_socket;
+
+    if (socket->io)
+    {
+        rbsrt_socket_io((rbsrt_socket_base_t *)client)->transtype = socket->io->transtype;
+    }
     
     return rbclient;
 }
 
-VALUE rbsrt_socket_bind(VALUE self, VALUE address, VALUE port)
+VALUE rbsrt_socket_bind(int argc, VALUE* argv, VALUE self)
 {
-    int status;
-    struct sockaddr_in sa;
-    // int livemode = SRTT_LIVE;
+    VALUE address, port, opts;
+    const char *error = NULL;
+
+    rb_scan_args(argc, argv, "2:", &address, &port, &opts);
 
     Check_Type(address, T_STRING);
     Check_Type(port, T_STRING);
 
     RBSRT_SOCKET_BASE_UNWRAP(self, socket);
 
-    // get address info
-    // TODO: Handle domain names
-
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(atoi(StringValuePtr(port)));
-    
-    if (inet_pton(AF_INET, StringValuePtr(address), &sa.sin_addr) != 1)
-    {
-        rb_raise(rb_eArgError, "bad adddress: %s", strerror(errno));
-        
-        return Qfalse;
-    }
-
-    
     // bind socket
 
-    status = srt_bind(socket->socket, (struct sockaddr *)&sa, sizeof(sa));
-    
-    if (status == SRT_ERROR)
+    if (rbsrt_bind_address(socket->socket, StringValueCStr(address), StringValueCStr(port), rbsrt_ipv6only_option(opts), &error) == RBSRT_FAILURE)
     {
-        rbsrt_raise_last_srt_error();
-        
+        rb_raise(rbsrt_eStandardError, "failed to bind socket: %s", error);
+
         return Qfalse;
     }
 
@@ -779,6 +1178,15 @@ VALUE rbsrt_socket_close(VALUE self)
 
     RBSRT_SOCKET_BASE_UNWRAP(self, socket)
 
+    if (socket->io && socket->io->coalescer)
+    {
+        rbsrt_coalescer_t *coalescer = socket->io->coalescer;
+
+        socket->io->coalescer = NULL;
+
+        rbsrt_coalescer_stop(coalescer);
+    }
+
     if (srt_close(socket->socket) == SRT_ERROR)
     {
         rbsrt_raise_last_srt_error();
@@ -790,635 +1198,7021 @@ VALUE rbsrt_socket_close(VALUE self)
 }
 
 
-// MARK: Transmission
+// MARK: Write Coalescing
 
-VALUE rbsrt_socket_sendmsg(VALUE self, VALUE message)
+// NOTE: A coalescer collects writes to a live mode socket and only sends full, 
+//       mpeg-ts aligned, payloads. A flusher thread sends the whole ts packets 
+//       in a partially filled payload once it has been held back for longer 
+//       than the configured delay, and everything left when it stops. The 
+//       coalescer is reference counted, a write in progress keeps it alive 
+//       when another thread turns coalescing off or closes the socket. The 
+//       flusher waits for the socket to become writable before sending, 
+//       without holding the lock, so an interrupted #close or #flush does not
+//       hang in srt on a peer which stopped reading.
+
+int rbsrt_coalescer_send_locked(rbsrt_coalescer_t *coalescer, int len)
 {
-    RBSRT_DEBUG_PRINT("socket sendmsg");
+    int nbytes = srt_sendmsg2(coalescer->socket, coalescer->buf, len, NULL);
 
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket)
+    if (nbytes == SRT_ERROR)
+    {
+        coalescer->error_code = srt_getlasterror(NULL);
 
-    int message_type = rb_type(message);
-    const char *buf = NULL;
-    int buf_len = 0;
+        // drop the data, the error is reported on the next write
 
-    switch (message_type)
-    {
-    case T_STRING:
-        buf = StringValuePtr(message);
-        buf_len = (int)RSTRING_LEN(message);
-        RBSRT_DEBUG_PRINT("sendmsg: %d", buf_len);
-        break;
+        coalescer->len = 0;
 
-    case T_OBJECT:
-    case T_DATA:
-        RBSRT_DEBUG_PRINT("sendmsg DATA");
-        // TODO: Support binary 
-        rb_raise(rb_eArgError, "message must be a string");
-        // rdata
-        return FIX2INT(SRT_ERROR);
-        break;
-    
-    default:
-        rb_raise(rb_eArgError, "message must a string");
-
-        return FIX2INT(SRT_ERROR);
-        break;
+        return SRT_ERROR;
     }
 
+    memmove(coalescer->buf, coalescer->buf + nbytes, coalescer->len - nbytes);
 
-    // send data
+    coalescer->len -= nbytes;
 
-    int packet_size;
-    int nbytes;
-    int total_nbytes = 0;
-    char const *buf_p = buf; 
+    return nbytes;
+}
 
-    do
+// Waits until the socket can take data. Called while holding the lock, which 
+// is released during the wait. Fails when interrupted is set.
+int rbsrt_coalescer_wait_writable(rbsrt_coalescer_t *coalescer, atomic_int *interrupted)
+{
+    if (rbsrt_io_ready(coalescer->socket, coalescer->epollid))
     {
-        packet_size = (buf_len - total_nbytes) > RBSRT_PAYLOAD_SIZE ? RBSRT_PAYLOAD_SIZE : (buf_len - total_nbytes);
-
-        nbytes = srt_sendmsg2(socket->socket, (buf_p + total_nbytes), packet_size, NULL);
+        return RBSRT_SUCCESS;
+    }
 
-        if (nbytes == SRT_ERROR)
-        {
-            DEBUG_ERROR_PRINT("sendmsg error. %s", srt_getlasterror_str());
+    pthread_mutex_unlock(&coalescer->lock);
 
-            rbsrt_raise_last_srt_error();
+    int status = rbsrt_io_wait(coalescer->socket, coalescer->epollid, interrupted);
 
-            break;
-        }
+    pthread_mutex_lock(&coalescer->lock);
 
-        RBSRT_DEBUG_PRINT("send bytes %d", nbytes);
-    } 
-    while ((total_nbytes += nbytes) < buf_len);
+    return status;
+}
 
-    return INT2FIX(total_nbytes);
+void rbsrt_coalescer_retain(rbsrt_coalescer_t *coalescer)
+{
+    atomic_fetch_add(&coalescer->refs, 1);
 }
 
-VALUE rbsrt_socket_recvmsg(VALUE self)
+void rbsrt_coalescer_release(rbsrt_coalescer_t *coalescer)
 {
-    RBSRT_DEBUG_PRINT("socket recvmsg");
+    if (atomic_fetch_sub(&coalescer->refs, 1) != 1)
+    {
+        return;
+    }
 
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket)
+    srt_epoll_release(coalescer->epollid);
 
-    int nbuf = RBSRT_PAYLOAD_SIZE * 2;
-    char buf[nbuf];
+    pthread_cond_destroy(&coalescer->cond);
+    pthread_mutex_destroy(&coalescer->lock);
 
-    int nbytes = srt_recvmsg2(socket->socket, buf, nbuf, NULL);
+    free(coalescer);
+}
 
-    if (nbytes == SRT_ERROR)
-    {
-        rbsrt_raise_last_srt_error();
+void *rbsrt_coalescer_run(void *context)
+{
+    rbsrt_coalescer_t *coalescer = (rbsrt_coalescer_t *)context;
 
-        return Qnil;
-    }
+    struct timespec now;
+    struct timespec deadline;
+    int aligned_len;
 
-    else if (nbytes == 0)
-    {
-        // TODO: Close socket
-        return Qnil;
-    }
+    pthread_mutex_lock(&coalescer->lock);
 
-    VALUE data = rb_str_buf_new((long)nbytes);
-    rb_str_buf_cat(data, buf, (long)nbytes);
+    while (!coalescer->stopping)
+    {
+        aligned_len = coalescer->len - (coalescer->len % RBSRT_TS_PACKET_SIZE);
 
-    return data;
-}
+        if (aligned_len == 0)
+        {
+            pthread_cond_wait(&coalescer->cond, &coalescer->lock);
 
+            continue;
+        }
 
-// MARK: Socket Options
+        deadline = coalescer->since;
+        deadline.tv_sec += coalescer->delay / 1000;
+        deadline.tv_nsec += (long)(coalescer->delay % 1000) * 1000000L;
 
-VALUE rbsrt_socket_get_id(VALUE self)
-{
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
 
-    return INT2FIX(socket->socket);
-}
+        clock_gettime(CLOCK_REALTIME, &now);
 
-VALUE rbsrt_socket_set_rcvsyn(VALUE self, VALUE syn)
-{
-    int is_syn = RTEST(syn) ? 1 : 0;
-    
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        {
+            if (rbsrt_coalescer_wait_writable(coalescer, &coalescer->interrupted) == RBSRT_FAILURE)
+            {
+                continue; // stopping
+            }
 
-    if (srt_setsockflag(socket->socket, SRTO_RCVSYN, &is_syn, sizeof(is_syn)) == SRT_ERROR)
-    {
-        rbsrt_raise_last_srt_error();
+            // writes may have sent or added data while waiting
 
-        return Qfalse;
-    }
+            aligned_len = coalescer->len - (coalescer->len % RBSRT_TS_PACKET_SIZE);
 
-    return Qtrue;
-}
+            if (aligned_len > 0)
+            {
+                RBSRT_DEBUG_PRINT("coalescer flush %d bytes after deadline", aligned_len);
 
-VALUE rbsrt_socket_get_rcvsyn(VALUE self)
-{
-    int is_syn = 0;
-    int is_syn_size = 0;
+                rbsrt_coalescer_send_locked(coalescer, aligned_len);
+            }
 
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+            clock_gettime(CLOCK_REALTIME, &coalescer->since);
 
-    if (srt_getsockflag(socket->socket, SRTO_RCVSYN, &is_syn, &is_syn_size) == SRT_ERROR)
-    {
-        rbsrt_raise_last_srt_error();
+            continue;
+        }
 
-        return Qnil;
+        pthread_cond_timedwait(&coalescer->cond, &coalescer->lock, &deadline);
     }
 
-    return is_syn ? Qtrue : Qfalse;
-}
+    while (coalescer->len > 0 && srt_getsockstate(coalescer->socket) == SRTS_CONNECTED)
+    {
+        if (rbsrt_coalescer_wait_writable(coalescer, &coalescer->interrupted) == RBSRT_FAILURE)
+        {
+            RBSRT_DEBUG_PRINT("coalescer dropping %d bytes, interrupted while stopping", coalescer->len);
 
-VALUE rbsrt_socket_set_sndsyn(VALUE self, VALUE syn)
-{
-    int is_syn = RTEST(syn) ? 1 : 0;
-    
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+            coalescer->len = 0;
 
-    if (srt_setsockflag(socket->socket, SRTO_SNDSYN, &is_syn, sizeof(is_syn)) == SRT_ERROR)
-    {
-        rbsrt_raise_last_srt_error();
+            break;
+        }
 
-        return Qfalse;
+        if (coalescer->len > 0 && rbsrt_coalescer_send_locked(coalescer, coalescer->len) == SRT_ERROR)
+        {
+            break;
+        }
     }
 
-    return Qtrue;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    rbsrt_coalescer_release(coalescer);
+
+    return NULL;
 }
 
-VALUE rbsrt_socket_get_sndsyn(VALUE self)
+rbsrt_coalescer_t *rbsrt_coalescer_create(SRTSOCKET socket, int payload_size, int delay)
 {
-    int is_syn = 0;
-    int is_syn_size = 0;
+    rbsrt_coalescer_t *coalescer = malloc(sizeof(rbsrt_coalescer_t));
 
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+    memset(coalescer, 0, sizeof(rbsrt_coalescer_t));
 
-    if (srt_getsockflag(socket->socket, SRTO_SNDSYN, &is_syn, &is_syn_size) == SRT_ERROR)
-    {
-        rbsrt_raise_last_srt_error();
+    coalescer->socket = socket;
+    coalescer->payload_size = payload_size - (payload_size % RBSRT_TS_PACKET_SIZE);
+    coalescer->delay = delay;
+    coalescer->error_code = SRT_SUCCESS;
+    coalescer->epollid = srt_epoll_create();
 
-        return Qnil;
-    }
+    atomic_init(&coalescer->interrupted, 0);
+    atomic_init(&coalescer->refs, 2);
 
-    return is_syn ? Qtrue : Qfalse;
-}
+    int events = SRT_EPOLL_OUT | SRT_EPOLL_ERR;
 
-VALUE rbsrt_socket_set_streamid(VALUE self, VALUE streamid)
-{
-    Check_Type(streamid, T_STRING);
+    if (coalescer->epollid == SRT_ERROR || srt_epoll_add_usock(coalescer->epollid, socket, &events) == SRT_ERROR)
+    {
+        if (coalescer->epollid != SRT_ERROR)
+        {
+            srt_epoll_release(coalescer->epollid);
+        }
 
-    long streamid_llen = rb_str_strlen(streamid);
+        free(coalescer);
 
-    if (streamid_llen > 512)
-    {
-        rb_raise(rbsrt_eStandardError, "streamid must be 512 characters or less");
+        errno = ENOMEM;
 
-        return Qfalse;
+        return NULL;
     }
 
-    int streamid_len = (int)streamid_llen;
-    char *streamid_p = StringValuePtr(streamid);
-    
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+    pthread_mutex_init(&coalescer->lock, NULL);
+    pthread_cond_init(&coalescer->cond, NULL);
 
-    if (srt_setsockflag(socket->socket, SRTO_STREAMID, streamid_p, streamid_len + 1) == SRT_ERROR)
+    if (pthread_create(&coalescer->thread, NULL, rbsrt_coalescer_run, coalescer) != 0)
     {
-        rbsrt_raise_last_srt_error();
+        srt_epoll_release(coalescer->epollid);
 
-        return Qfalse;
+        pthread_cond_destroy(&coalescer->cond);
+        pthread_mutex_destroy(&coalescer->lock);
+
+        free(coalescer);
+
+        return NULL;
     }
 
-    return Qtrue; 
+    return coalescer;
 }
 
-VALUE rbsrt_socket_get_streamid(VALUE self)
+typedef struct RBSRTCoalescerFlushArg
 {
-    char streamid[1024];
-    int streamid_len = sizeof(streamid);
+    rbsrt_coalescer_t *coalescer;
+    int completed;
+    int error_code;
+    atomic_int interrupted;
+} rbsrt_coalescer_flush_arg_t;
+
+// Sends everything still buffered, including a trailing partial ts packet. 
+// When interrupted the data stays buffered.
+void *rbsrt_coalescer_flush_without_gvl(void *context)
+{
+    rbsrt_coalescer_flush_arg_t *arg = (rbsrt_coalescer_flush_arg_t *)context;
+    rbsrt_coalescer_t *coalescer = arg->coalescer;
 
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+    pthread_mutex_lock(&coalescer->lock);
 
-    if (srt_getsockflag(socket->socket, SRTO_STREAMID, &streamid, &streamid_len) == SRT_ERROR)
+    while (coalescer->len > 0)
     {
-        rbsrt_raise_last_srt_error();
+        if (rbsrt_coalescer_wait_writable(coalescer, &arg->interrupted) == RBSRT_FAILURE)
+        {
+            pthread_mutex_unlock(&coalescer->lock);
 
-        return Qfalse;
-    }
+            return arg;
+        }
 
-    if (streamid_len <= 0)
-    {
-        return Qnil;
+        if (coalescer->len > 0 && rbsrt_coalescer_send_locked(coalescer, coalescer->len) == SRT_ERROR)
+        {
+            break;
+        }
     }
 
-    VALUE result = rb_str_buf_new((long)streamid_len);
-    rb_str_buf_cat(result, streamid, (long)streamid_len);
+    arg->completed = 1;
 
-    return result;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    return arg;
 }
 
-VALUE rbsrt_socket_set_transtype(VALUE self, VALUE type)
+void rbsrt_coalescer_signal_stop(rbsrt_coalescer_t *coalescer)
 {
-    RBSRT_DEBUG_PRINT("socket set transmission type");
+    pthread_mutex_lock(&coalescer->lock);
 
-    // unwrap type argument
-
-    int type_arg_type = rb_type(type);
-    int srt_transtype;
-    const char *type_name = NULL;
+    coalescer->stopping = 1;
 
-    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+    pthread_cond_signal(&coalescer->cond);
 
-    switch (type_arg_type)
-    {
-        case T_STRING:
-            type_name = StringValuePtr(type);
-            break;
+    pthread_mutex_unlock(&coalescer->lock);
+}
 
-        case T_SYMBOL:
-            type_name = rb_id2name(SYM2ID(type));
-            break;
+// Stops the flusher thread, which sends what is left, and waits for it.
+void *rbsrt_coalescer_stop_without_gvl(void *context)
+{
+    rbsrt_coalescer_t *coalescer = (rbsrt_coalescer_t *)context;
 
-        case T_FIXNUM:
-            if (FIX2INT(type) == SRTT_LIVE || FIX2INT(type) == SRTT_FILE)
-            {
-                srt_transtype = FIX2INT(type);
+    rbsrt_coalescer_signal_stop(coalescer);
 
-                goto set_flag;
-            }
+    pthread_join(coalescer->thread, NULL);
 
-            else
-            {
-                goto invalid_argument;
-            }
+    rbsrt_coalescer_release(coalescer);
 
-            break;
+    return context;
+}
 
-        default:
-            goto invalid_argument;
-            break;
-    }
+void rbsrt_coalescer_interrupt(void *context)
+{
+    rbsrt_coalescer_t *coalescer = (rbsrt_coalescer_t *)context;
 
-    // set option
+    atomic_store(&coalescer->interrupted, 1);
+}
 
-    if (strncmp(type_name, "live", 5) == 0)
+// Stops the coalescer without holding the gvl. An interrupt makes the flusher 
+// drop what it could not send yet, the interrupt is handled once the socket is 
+// closed or coalescing is turned off.
+void rbsrt_coalescer_stop(rbsrt_coalescer_t *coalescer)
+{
+    if (!rb_thread_call_without_gvl2(rbsrt_coalescer_stop_without_gvl, coalescer, rbsrt_coalescer_interrupt, coalescer))
     {
-        srt_transtype = SRTT_LIVE;
-    }
+        // an interrupt was already pending, stop right away
 
-    else if (strncmp(type_name, "file", 5) == 0)
-    {
-        srt_transtype = SRTT_FILE;
+        rbsrt_coalescer_interrupt(coalescer);
+        rbsrt_coalescer_stop_without_gvl(coalescer);
     }
+}
 
-    else
-    {
-        goto invalid_argument;
-    }
+// Stops the flusher thread without waiting for it, used by the gc.
+void rbsrt_coalescer_detach(rbsrt_coalescer_t *coalescer)
+{
+    rbsrt_coalescer_signal_stop(coalescer);
 
-    set_flag:
+    pthread_detach(coalescer->thread);
 
-        if (srt_setsockflag(socket->socket, SRTO_TRANSTYPE, &srt_transtype, sizeof(srt_transtype)) == SRT_ERROR)
-        {
-            rbsrt_raise_last_srt_error();
+    rbsrt_coalescer_release(coalescer);
+}
 
-            return Qfalse;
-        }
+int rbsrt_coalescer_take_error(rbsrt_coalescer_t *coalescer)
+{
+    pthread_mutex_lock(&coalescer->lock);
 
-        return Qtrue;
+    int error_code = coalescer->error_code;
 
-    invalid_argument:
-        rb_raise(rb_eArgError, "transmission type must be live (:live, \"live\", %d), or file (:file, \"file\", %d)", SRTT_LIVE, SRTT_FILE);
+    coalescer->error_code = SRT_SUCCESS;
+
+    pthread_mutex_unlock(&coalescer->lock);
+
+    return error_code;
 }
 
+void rbsrt_coalescer_check_error(rbsrt_coalescer_t *coalescer)
+{
+    int error_code = rbsrt_coalescer_take_error(coalescer);
 
-VALUE rbsrt_socket_set_tsbpdmode(VALUE self, VALUE val)
+    if (error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(error_code);
+    }
+}
+
+VALUE rbsrt_socket_set_coalesce_writes(VALUE self, VALUE val)
 {
-    // timestamp-based Packet Delivery mode
-    
     RBSRT_SOCKET_BASE_UNWRAP(self, socket);
 
-    int32_t tsbpdmode = RTEST(val) ? 1 : 0;
-    int tsbpdmode_size = sizeof(tsbpdmode);
+    rbsrt_socket_io_t *io = rbsrt_socket_io(socket);
 
-    if (srt_setsockflag(socket->socket, SRTO_TSBPDMODE, &tsbpdmode, tsbpdmode_size) == SRT_ERROR)
+    if (RTEST(val) && !io->coalescer)
     {
-        rbsrt_raise_last_srt_error();
+        if (io->transtype != SRTT_LIVE)
+        {
+            rb_raise(rbsrt_eStandardError, "write coalescing requires live transmission mode");
+        }
 
-        return Qnil;
+        io->coalescer = rbsrt_coalescer_create(socket->socket, 
+                                               rbsrt_socket_payload_size(socket->socket), 
+                                               io->coalesce_delay > 0 ? io->coalesce_delay : RBSRT_COALESCE_DELAY);
+
+        if (!io->coalescer)
+        {
+            rb_raise(rbsrt_eStandardError, "failed to start write coalescing: %s", strerror(errno));
+        }
+    }
+
+    else if (!RTEST(val) && io->coalescer)
+    {
+        rbsrt_coalescer_t *coalescer = io->coalescer;
+
+        io->coalescer = NULL;
+
+        rbsrt_coalescer_stop(coalescer);
     }
 
     return val;
 }
 
-VALUE rbsrt_socket_get_tsbpdmode(VALUE self)
+VALUE rbsrt_socket_get_coalesce_writes(VALUE self)
 {
-    // timestamp-based Packet Delivery mode
-    
     RBSRT_SOCKET_BASE_UNWRAP(self, socket);
 
-    int32_t tsbpdmode;
-    int tsbpdmode_size;
+    return socket->io && socket->io->coalescer ? Qtrue : Qfalse;
+}
 
-    if (srt_getsockflag(socket->socket, SRTO_TSBPDMODE, &tsbpdmode, &tsbpdmode_size) == SRT_ERROR)
-    {
-        rbsrt_raise_last_srt_error();
+VALUE rbsrt_socket_set_coalesce_delay(VALUE self, VALUE val)
+{
+    Check_Type(val, T_FIXNUM);
 
-        return Qnil;
+    if (FIX2INT(val) <= 0)
+    {
+        rb_raise(rb_eArgError, "coalesce delay must be a positive number of milliseconds");
     }
 
-    return tsbpdmode ? Qtrue : Qfalse;
-}
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
 
+    rbsrt_socket_io_t *io = rbsrt_socket_io(socket);
 
+    io->coalesce_delay = FIX2INT(val);
 
-#ifndef RBSRT_PASSPHRASE_MIN
-#define RBSRT_PASSPHRASE_MIN 10
-#endif
+    if (io->coalescer)
+    {
+        pthread_mutex_lock(&io->coalescer->lock);
 
-#ifndef RBSRT_PASSPHRASE_MAX
-#define RBSRT_PASSPHRASE_MAX 79
-#endif
+        io->coalescer->delay = io->coalesce_delay;
 
-VALUE rbsrt_socket_set_passphrase(VALUE self, VALUE passphrase)
+        pthread_cond_signal(&io->coalescer->cond);
+
+        pthread_mutex_unlock(&io->coalescer->lock);
+    }
+
+    return val;
+}
+
+VALUE rbsrt_socket_get_coalesce_delay(VALUE self)
 {
-    int passphrase_type = rb_type(passphrase);
-    char const *passphrase_buf;
-    int passphrase_size;
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
 
-    switch (passphrase_type)
-    {
-        case T_NIL:
-        passphrase_buf = NULL;
-        passphrase_size = 0;
-        break;
+    return INT2FIX(socket->io && socket->io->coalesce_delay > 0 ? socket->io->coalesce_delay : RBSRT_COALESCE_DELAY);
+}
 
-        case T_STRING:
-        passphrase_buf = StringValuePtr(passphrase);
+VALUE rbsrt_coalescer_flush_wait(VALUE context)
+{
+    rbsrt_coalescer_flush_arg_t *arg = (rbsrt_coalescer_flush_arg_t *)context;
 
-        // long passphrase_length = rb_str_length(passphrase);
-        long passphrase_length = strnlen(passphrase_buf, RBSRT_PASSPHRASE_MAX * 2);
-        passphrase_size = (int)passphrase_length + 1;
+    while (1)
+    {
+        rb_thread_call_without_gvl(rbsrt_coalescer_flush_without_gvl, arg, rbsrt_io_interrupt, &arg->interrupted);
 
-        if (passphrase_buf == 0)
+        if (arg->completed)
         {
-            passphrase_buf = NULL;
-            passphrase_size = 0;
+            break;
         }
 
-        else if (passphrase_length != 0 && (passphrase_length < RBSRT_PASSPHRASE_MIN || passphrase_length > RBSRT_PASSPHRASE_MAX))
-        {
-            printf("PASSPHASE: %s", passphrase_buf);
-            rb_raise(rb_eArgError, "passphrase must be between %d and %d characters or empty (got %ld)", RBSRT_PASSPHRASE_MIN, RBSRT_PASSPHRASE_MAX, passphrase_length);
-
-            return Qfalse;
-        }
+        // interrupted, let ruby handle it and continue when it did not raise
 
-        
-        break;
+        atomic_store(&arg->interrupted, 0);
 
-        default:
-        Check_Type(passphrase, T_STRING);
-        return Qfalse;
-        break;
+        rb_thread_check_ints();
     }
 
+    arg->error_code = rbsrt_coalescer_take_error(arg->coalescer);
+
+    return Qnil;
+}
+
+VALUE rbsrt_coalescer_flush_done(VALUE context)
+{
+    rbsrt_coalescer_release((rbsrt_coalescer_t *)context);
+
+    return Qnil;
+}
+
+VALUE rbsrt_socket_flush(VALUE self)
+{
     RBSRT_SOCKET_BASE_UNWRAP(self, socket);
 
-    if (srt_setsockflag(socket->socket, SRTO_PASSPHRASE, passphrase_buf, passphrase_size) == SRT_ERROR)
+    if (!socket->io || !socket->io->coalescer)
     {
-        rbsrt_raise_last_srt_error();
-
-        return Qfalse;
+        return self;
     }
 
-    return Qtrue;
-}
+    rbsrt_coalescer_t *coalescer = socket->io->coalescer;
 
+    rbsrt_coalescer_flush_arg_t arg = { .coalescer = coalescer, .completed = 0, .error_code = SRT_SUCCESS };
 
-// MARK: Base Socket API
+    atomic_init(&arg.interrupted, 0);
 
-void rbsrt_socket_base_define_base_api(VALUE klass)
-{
-    rb_define_method(klass, "id", rbsrt_socket_get_id, 0);
+    rbsrt_coalescer_retain(coalescer);
 
-    rb_define_method(klass, "read_sync=", rbsrt_socket_set_rcvsyn, 1);
-    rb_define_method(klass, "read_sync?", rbsrt_socket_get_rcvsyn, 0);
-    rb_alias(klass, rb_intern("rcvsyn="), rb_intern("read_sync="));
-    rb_alias(klass, rb_intern("rcvsyn?"), rb_intern("read_sync?"));
+    rb_ensure(rbsrt_coalescer_flush_wait, (VALUE)&arg, rbsrt_coalescer_flush_done, (VALUE)coalescer);
 
-    rb_define_method(klass, "passphrase=", rbsrt_socket_set_passphrase, 1);
-    rb_alias(klass, rb_intern("password="), rb_intern("passphrase="));
+    if (arg.error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(arg.error_code);
+    }
+
+    return self;
 }
 
-void rbsrt_socket_base_define_option_api(VALUE klass)
+
+// MARK: Transmission
+
+typedef struct RBSRTSendArg
 {
-    rb_define_method(klass, "write_sync=", rbsrt_socket_set_sndsyn, 1);
-    rb_define_method(klass, "write_sync?", rbsrt_socket_get_sndsyn, 0);
-    rb_alias(klass, rb_intern("sndsyn="), rb_intern("write_sync="));
-    rb_alias(klass, rb_intern("sndsyn?"), rb_intern("write_sync?"));
-    
-    rb_define_method(klass, "streamid=", rbsrt_socket_set_streamid, 1);
-    rb_define_method(klass, "streamid", rbsrt_socket_get_streamid, 0);
-    
-    rb_define_method(klass, "transmission_mode=", rbsrt_socket_set_transtype, 1);
-    rb_alias(klass, rb_intern("trans_mode="), rb_intern("transmission_mode="));
-    rb_alias(klass, rb_intern("transtype="), rb_intern("transmission_mode="));
+    SRTSOCKET socket;
+    SRT_EPOLL_T epollid;
+    struct iovec *iov;
+    int iovcnt;
+    int iov_index;
+    long iov_offset;
+    char *packet;
+    int packet_len;
+    int payload_size;
+    rbsrt_coalescer_t *coalescer;
+    int nonblock;
+    long nbytes;
+    int error_code;
+    int completed;
+    atomic_int interrupted;
+} rbsrt_send_arg_t;
+
+// Returns the number of bytes the send buffer of the socket can take right away, 
+// LONG_MAX when srt does not report it.
+long rbsrt_socket_send_space(SRTSOCKET socket)
+{
+    int mss = 0;
+    int mss_size = sizeof(mss);
+    int sndbuf = 0;
+    int sndbuf_size = sizeof(sndbuf);
+    int snddata = 0;
+    int snddata_size = sizeof(snddata);
+
+    if (srt_getsockflag(socket, SRTO_MSS, &mss, &mss_size) == SRT_ERROR ||
+        srt_getsockflag(socket, SRTO_SNDBUF, &sndbuf, &sndbuf_size) == SRT_ERROR ||
+        srt_getsockflag(socket, SRTO_SNDDATA, &snddata, &snddata_size) == SRT_ERROR ||
+        mss <= RBSRT_PACKET_OVERHEAD)
+    {
+        return LONG_MAX;
+    }
 
+    // srt reports the buffer in bytes of udp payload and the data in packets
 
-    rb_define_method(klass, "timestamp_based_packet_delivery_mode=", rbsrt_socket_set_tsbpdmode, 1);
-    rb_define_method(klass, "timestamp_based_packet_delivery_mode?", rbsrt_socket_get_tsbpdmode, 0);
-    rb_alias(klass, rb_intern("tsbpdmode="), rb_intern("timestamp_based_packet_delivery_mode="));
-    rb_alias(klass, rb_intern("tsbpdmode?"), rb_intern("timestamp_based_packet_delivery_mode?"));    
-}
+    long free_packets = (long)sndbuf / (mss - RBSRT_UDP_HEADER_SIZE) - snddata;
 
-void rbsrt_socket_base_define_basic_api(VALUE klass)
-{
-    rb_define_method(klass, "close", rbsrt_socket_close, 0);
+    return free_packets > 0 ? free_packets * (mss - RBSRT_PACKET_OVERHEAD) : 0;
 }
 
-void rbsrt_socket_base_define_connection_api(VALUE klass)
+int rbsrt_socket_send_packet(rbsrt_send_arg_t *arg, const char *buf, int len)
 {
-    rb_define_method(klass, "connect", rbsrt_socket_connect, 2);
-}
+    if (arg->epollid != SRT_ERROR && arg->nonblock && !rbsrt_io_ready(arg->socket, arg->epollid))
+    {
+        arg->error_code = SRT_EASYNCSND;
 
-void rbsrt_socket_base_define_io_api(VALUE klass)
-{
-    rb_define_method(klass, "recvmsg", rbsrt_socket_recvmsg, 0);
-    rb_alias(klass, rb_intern("read"), rb_intern("recvmsg"));
+        return SRT_ERROR;
+    }
 
-    rb_define_method(klass, "sendmsg", rbsrt_socket_sendmsg, 1);
-    rb_alias(klass, rb_intern("write"), rb_intern("sendmsg"));
-}
+    else if (arg->epollid != SRT_ERROR && arg->nonblock)
+    {
+        // NOTE: srt makes a blocking socket wait until the whole message is 
+        //       buffered, even when it was reported writable. The stream api 
+        //       takes what fits, messages are only sent when they fit.
 
+        long space = rbsrt_socket_send_space(arg->socket);
 
+        if (space < len && space > 0 && !rbsrt_socket_message_api(arg->socket))
+        {
+            len = (int)space;
+        }
 
-// MARK: - SRT::Socket Class
+        else if (space < len)
+        {
+            arg->error_code = SRT_EASYNCSND;
 
-size_t rbsrt_socket_dsize(const void *socket)
-{
-    RBSRT_DEBUG_PRINT("dsize srt socket");
+            return SRT_ERROR;
+        }
+    }
 
-    return sizeof(rbsrt_client_t);
-}
+    else if (arg->epollid != SRT_ERROR && !arg->nonblock && rbsrt_io_wait(arg->socket, arg->epollid, &arg->interrupted) == RBSRT_FAILURE)
+    {
+        return SRT_ERROR;
+    }
 
-void rbsrt_socket_dmark(void *socket)
-{
-    RBSRT_DEBUG_PRINT("dmark srt socket");
-}
+    int nbytes = srt_sendmsg2(arg->socket, buf, len, NULL);
 
+    if (nbytes == SRT_ERROR)
+    {
+        DEBUG_ERROR_PRINT("sendmsg error. %s", srt_getlasterror_str());
 
-// MARK: Initializers
+        arg->error_code = srt_getlasterror(NULL);
 
-void rbsrt_socket_deallocate(rbsrt_socket_t *socket)
-{
-    RBSRT_DEBUG_PRINT("deallocate srt socket");
+        return SRT_ERROR;
+    }
 
-    srt_close(socket->socket); // TODO: Check socket state before closing
+    RBSRT_DEBUG_PRINT("send bytes %d", nbytes);
 
-    free(socket);
+    arg->nbytes += nbytes;
+
+    return nbytes;
 }
 
-VALUE rbsrt_socket_allocate(VALUE klass)
+int rbsrt_socket_flush_packet(rbsrt_send_arg_t *arg)
 {
-    RBSRT_DEBUG_PRINT("allocate socket");
+    int nbytes = rbsrt_socket_send_packet(arg, arg->packet, arg->packet_len);
 
-    rbsrt_socket_t *socket = malloc(sizeof(rbsrt_socket_t));
+    if (nbytes == SRT_ERROR)
+    {
+        return SRT_ERROR;
+    }
 
-    memset(socket, 0, sizeof(rbsrt_socket_t));
-    
-    return TypedData_Wrap_Struct(klass, &rbsrt_socket_rbtype, socket);
+    if (nbytes < arg->packet_len)
+    {
+        memmove(arg->packet, arg->packet + nbytes, arg->packet_len - nbytes);
+    }
+
+    arg->packet_len -= nbytes;
+
+    return nbytes;
 }
 
-VALUE rbsrt_socket_initialize(VALUE self)
+// Sends the buffers in arg->iov as payload sized messages. When arg->packet is 
+// set bytes of small buffers are packed together in it, everything else is sent 
+// straight from the source buffer. With a coalescer a partially filled packet is 
+// kept for the next write. Progress is kept in arg, so an interrupted call can be 
+// resumed.
+void *rbsrt_socket_sendmsg_without_gvl(void *context)
 {
-    RBSRT_DEBUG_PRINT("initialize socket");
+    rbsrt_send_arg_t *arg = (rbsrt_send_arg_t *)context;
 
-    RBSRT_SOCKET_UNWRAP(self, socket);
+    int nbytes;
+    int hold_partial = arg->coalescer != NULL;
 
-    socket->socket = srt_create_socket();
+    while (arg->iov_index < arg->iovcnt)
+    {
+        struct iovec *iov = &arg->iov[arg->iov_index];
+        const char *buf = (const char *)iov->iov_base + arg->iov_offset;
+        long buf_len = (long)iov->iov_len - arg->iov_offset;
+        int is_last = arg->iov_index == arg->iovcnt - 1;
 
-    int livemode = SRTT_LIVE;
+        if (buf_len == 0)
+        {
+            arg->iov_index++;
+            arg->iov_offset = 0;
 
-    srt_setsockflag(socket->socket, SRTO_TRANSTYPE, &livemode, sizeof(livemode)); // set live mode
+            continue;
+        }
 
-    return self;
-}
+        if (!arg->packet || (arg->packet_len == 0 && (buf_len >= arg->payload_size || (is_last && !hold_partial))))
+        {
+            nbytes = rbsrt_socket_send_packet(arg, buf, buf_len > arg->payload_size ? arg->payload_size : (int)buf_len);
+
+            if (nbytes == SRT_ERROR)
+            {
+                return arg;
+            }
 
+            arg->iov_offset += nbytes;
+        }
 
+        else
+        {
+            nbytes = (arg->payload_size - arg->packet_len) < buf_len ? (arg->payload_size - arg->packet_len) : (int)buf_len;
 
-// MARK: - SRT::Connection Class
+            memcpy(arg->packet + arg->packet_len, buf, nbytes);
 
-// MARK: Ruby Type Helpers
+            arg->packet_len += nbytes;
+            arg->iov_offset += nbytes;
 
-size_t rbsrt_connection_dsize(const void *server)
-{
-    RBSRT_DEBUG_PRINT("connection dsize");
-    
-    return sizeof(rbsrt_connection_t);
+            if (arg->packet_len == arg->payload_size && rbsrt_socket_flush_packet(arg) == SRT_ERROR)
+            {
+                return arg;
+            }
+        }
+    }
+
+    while (arg->packet_len > 0 && !hold_partial)
+    {
+        if (rbsrt_socket_flush_packet(arg) == SRT_ERROR)
+        {
+            return arg;
+        }
+    }
+
+    arg->completed = 1;
+
+    return arg;
 }
 
-void rbsrt_connection_dmark(void *data)
+void *rbsrt_socket_coalesce_without_gvl(void *context)
 {
-    RBSRT_DEBUG_PRINT("connection mark");
+    rbsrt_send_arg_t *arg = (rbsrt_send_arg_t *)context;
+    rbsrt_coalescer_t *coalescer = arg->coalescer;
 
-    rbsrt_connection_t *connection = (rbsrt_connection_t *)data;
+    pthread_mutex_lock(&coalescer->lock);
 
-    if (connection->at_data_block)
-    {
-        rb_gc_mark(connection->at_data_block);
-    }
+    long nbytes = arg->nbytes;
+    int was_empty = coalescer->len == 0;
 
-    if (connection->at_close_block)
+    arg->packet = coalescer->buf;
+    arg->packet_len = coalescer->len;
+
+    rbsrt_socket_sendmsg_without_gvl(arg);
+
+    if (coalescer->stopping)
     {
-        rb_gc_mark(connection->at_close_block);
+        // the flusher thread is gone, send the partial payload right away
+
+        while (arg->packet_len > 0 && rbsrt_socket_flush_packet(arg) != SRT_ERROR);
     }
-}
 
+    coalescer->len = arg->packet_len;
 
-// MARK: Initializers
+    if (coalescer->len > 0 && (was_empty || arg->nbytes != nbytes))
+    {
+        // the oldest byte in the buffer is new, restart the deadline
 
-VALUE rbsrt_connection_allocate(VALUE klass)
-{
-    RBSRT_DEBUG_PRINT("connection allocate");
+        clock_gettime(CLOCK_REALTIME, &coalescer->since);
 
-    rbsrt_connection_t *connection = malloc(sizeof(rbsrt_connection_t));
+        pthread_cond_signal(&coalescer->cond);
+    }
 
-    memset(connection, 0, sizeof(rbsrt_connection_t));
+    pthread_mutex_unlock(&coalescer->lock);
 
-    return TypedData_Wrap_Struct(klass, &rbsrt_connection_rbtype, connection);
+    return arg;
 }
 
-void rbsrt_connection_deallocate(rbsrt_connection_t *connection)
+VALUE rbsrt_socket_send_wait(VALUE context)
 {
-    RBSRT_DEBUG_PRINT("connection deallocate");
+    rbsrt_send_arg_t *arg = (rbsrt_send_arg_t *)context;
 
-    free(connection);
-}
+    void *(*send_without_gvl)(void *) = arg->coalescer ? rbsrt_socket_coalesce_without_gvl : rbsrt_socket_sendmsg_without_gvl;
 
+    while (1)
+    {
+        rb_thread_call_without_gvl(send_without_gvl, arg, rbsrt_io_interrupt, &arg->interrupted);
 
-// MARK: API
-
-VALUE rbsrt_connection_set_at_data_block(VALUE self)
-{
-    RBSRT_DEBUG_PRINT("connection set data block");
+        if (arg->error_code != SRT_SUCCESS || arg->completed)
+        {
+            break;
+        }
 
-    rb_need_block();
+        // interrupted, let ruby handle it and continue when it did not raise
 
-    RBSRT_CONNECTION_UNWRAP(self, connection);
+        atomic_store(&arg->interrupted, 0);
 
-    connection->at_data_block = rb_block_proc();
+        rb_thread_check_ints();
+    }
 
-    return Qtrue;
+    return Qnil;
 }
 
-VALUE rbsrt_connection_set_at_close_block(VALUE self)
+VALUE rbsrt_socket_send_done(VALUE context)
 {
-    RBSRT_DEBUG_PRINT("connection set close block");
-
-    rb_need_block();
+    rbsrt_send_arg_t *arg = (rbsrt_send_arg_t *)context;
 
-    RBSRT_CONNECTION_UNWRAP(self, connection);
+    if (arg->coalescer)
+    {
+        rbsrt_coalescer_release(arg->coalescer);
+    }
 
-    connection->at_close_block = rb_block_proc();
-    
-    return Qtrue;
+    return Qnil;
 }
 
-// MARK: - SRT::Server Class
+// Sends a string or an array of strings. In nonblock mode the call never waits, 
+// when the socket can not take more data it returns the number of bytes sent so 
+// far, or raises SRT::Error::ASYNCSND (returns :wait_writable without exception) 
+// when nothing was sent.
+VALUE rbsrt_socket_send_message(VALUE self, VALUE message, int nonblock, int exception)
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket)
 
-// MARK: Ruby Type Helpers
+    int message_type = rb_type(message);
+    long num_messages;
+
+    switch (message_type)
+    {
+    case T_STRING:
+        RBSRT_DEBUG_PRINT("sendmsg: %ld", RSTRING_LEN(message));
+        num_messages = 1;
+        break;
+
+    case T_ARRAY:
+        RBSRT_DEBUG_PRINT("sendmsg ARRAY: %ld", RARRAY_LEN(message));
+        num_messages = RARRAY_LEN(message);
+        break;
+
+    case T_OBJECT:
+    case T_DATA:
+        RBSRT_DEBUG_PRINT("sendmsg DATA");
+        // TODO: Support binary 
+        rb_raise(rb_eArgError, "message must be a string or an array of strings");
+        // rdata
+        return FIX2INT(SRT_ERROR);
+        break;
+    
+    default:
+        rb_raise(rb_eArgError, "message must be a string or an array of strings");
+
+        return FIX2INT(SRT_ERROR);
+        break;
+    }
+
+    // NOTE: Other threads may modify the messages while we are sending, the 
+    //       frozen copies share the bytes and keep them stable.
+
+    VALUE frozen_messages = rb_ary_new_capa(num_messages);
+    long total_nbytes = 0;
+
+    for (long i = 0; i < num_messages; i++)
+    {
+        VALUE part = message_type == T_ARRAY ? rb_ary_entry(message, i) : message;
+
+        if (!RB_TYPE_P(part, T_STRING))
+        {
+            rb_raise(rb_eArgError, "message must be a string or an array of strings");
+        }
+
+        VALUE frozen_part = rb_str_new_frozen(part);
+
+        rb_ary_push(frozen_messages, frozen_part);
+
+        total_nbytes += RSTRING_LEN(frozen_part);
+    }
+
+    VALUE iov_buf;
+    struct iovec *iov = ALLOCV_N(struct iovec, iov_buf, num_messages);
+
+    for (long i = 0; i < num_messages; i++)
+    {
+        VALUE part = RARRAY_AREF(frozen_messages, i);
+
+        iov[i].iov_base = RSTRING_PTR(part);
+        iov[i].iov_len = (size_t)RSTRING_LEN(part);
+    }
+
+    int packed = 0;
+    int payload_size = rbsrt_socket_send_size(socket, &packed);
+    char packet[RBSRT_MAX_PAYLOAD_SIZE];
+    rbsrt_coalescer_t *coalescer = socket->io ? socket->io->coalescer : NULL;
+    void *(*send_without_gvl)(void *) = rbsrt_socket_sendmsg_without_gvl;
+
+    if (coalescer)
+    {
+        rbsrt_coalescer_check_error(coalescer);
+
+        payload_size = coalescer->payload_size;
+        send_without_gvl = rbsrt_socket_coalesce_without_gvl;
+    }
+
+    rbsrt_send_arg_t arg = {
+        .socket = socket->socket,
+        .epollid = rbsrt_socket_io_wait_epoll(socket, SRT_EPOLL_OUT),
+        .iov = iov,
+        .iovcnt = (int)num_messages,
+        .iov_index = 0,
+        .iov_offset = 0,
+        .packet = packed ? packet : NULL,
+        .packet_len = 0,
+        .payload_size = payload_size,
+        .coalescer = coalescer,
+        .nonblock = nonblock,
+        .nbytes = 0,
+        .error_code = SRT_SUCCESS,
+        .completed = 0
+    };
+
+    atomic_init(&arg.interrupted, 0);
+
+
+    // send data
+
+    if (coalescer)
+    {
+        rbsrt_coalescer_retain(coalescer);
+    }
+
+    if (nonblock || (arg.epollid == SRT_ERROR && total_nbytes <= RBSRT_MAX_PAYLOAD_SIZE))
+    {
+        // nothing will wait, not worth releasing the gvl
+
+        send_without_gvl(&arg);
+
+        rbsrt_socket_send_done((VALUE)&arg);
+    }
+
+    else
+    {
+        rb_ensure(rbsrt_socket_send_wait, (VALUE)&arg, rbsrt_socket_send_done, (VALUE)&arg);
+    }
+
+    // with a coalescer bytes count as sent once they are taken from the message
+
+    long nbytes = arg.nbytes;
+
+    if (coalescer)
+    {
+        nbytes = arg.iov_offset;
+
+        for (int i = 0; i < arg.iov_index && i < arg.iovcnt; i++)
+        {
+            nbytes += (long)iov[i].iov_len;
+        }
+    }
+
+    ALLOCV_END(iov_buf);
+
+    RB_GC_GUARD(frozen_messages);
+
+    if (arg.error_code == SRT_EASYNCSND && nonblock)
+    {
+        if (nbytes > 0)
+        {
+            return LONG2NUM(nbytes);
+        }
+
+        else if (!exception)
+        {
+            return ID2SYM(rb_intern("wait_writable"));
+        }
+    }
+
+    if (arg.error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(arg.error_code);
+    }
+
+    return LONG2NUM(total_nbytes);
+}
+
+VALUE rbsrt_socket_sendmsg(VALUE self, VALUE message)
+{
+    RBSRT_DEBUG_PRINT("socket sendmsg");
+
+    return rbsrt_socket_send_message(self, message, 0, 1);
+}
+
+int rbsrt_nonblock_exception(VALUE opts)
+{
+    return NIL_P(opts) || rb_hash_aref(opts, ID2SYM(rb_intern("exception"))) != Qfalse;
+}
+
+VALUE rbsrt_socket_sendmsg_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("socket sendmsg_nonblock");
+
+    VALUE message, opts;
+
+    rb_scan_args(argc, argv, "1:", &message, &opts);
+
+    return rbsrt_socket_send_message(self, message, 1, rbsrt_nonblock_exception(opts));
+}
+
+typedef struct RBSRTRecvArg
+{
+    SRTSOCKET socket;
+    SRT_EPOLL_T epollid;
+    char *buf;
+    int buf_len;
+    int growable;
+    rbsrt_socket_io_t *io;
+    int nonblock;
+    int nbytes;
+    int error_code;
+    int completed;
+    atomic_int interrupted;
+    VALUE data;
+} rbsrt_recv_arg_t;
+
+void *rbsrt_socket_recvmsg_without_gvl(void *context)
+{
+    rbsrt_recv_arg_t *arg = (rbsrt_recv_arg_t *)context;
+
+    if (arg->epollid != SRT_ERROR && arg->nonblock && !rbsrt_io_ready(arg->socket, arg->epollid))
+    {
+        arg->error_code = SRT_EASYNCRCV;
+        arg->completed = 1;
+
+        return arg;
+    }
+
+    else if (arg->epollid != SRT_ERROR && !arg->nonblock && rbsrt_io_wait(arg->socket, arg->epollid, &arg->interrupted) == RBSRT_FAILURE)
+    {
+        return arg;
+    }
+
+    if (arg->growable)
+    {
+        // the heap buffer grows to the data srt holds, which fits the next message
+
+        int queued_size = rbsrt_socket_queued_size(arg->socket);
+
+        if (queued_size > arg->buf_len)
+        {
+            char *buf = realloc(arg->buf, (size_t)queued_size);
+
+            if (!buf)
+            {
+                arg->error_code = SRT_ENOBUF;
+                arg->completed = 1;
+
+                return arg;
+            }
+
+            arg->buf = buf;
+            arg->buf_len = queued_size;
+        }
+    }
+
+    arg->nbytes = srt_recvmsg2(arg->socket, arg->buf, arg->buf_len, NULL);
+
+    if (arg->nbytes == SRT_ERROR)
+    {
+        arg->error_code = srt_getlasterror(NULL);
+    }
+
+    arg->completed = 1;
+
+    return arg;
+}
+
+// Receives a single message. In nonblock mode the call never waits and raises 
+// SRT::Error::ASYNCRCV (returns :wait_readable without exception) when no 
+// message is available.
+VALUE rbsrt_socket_recvmsg_wait(VALUE context)
+{
+    rbsrt_recv_arg_t *arg = (rbsrt_recv_arg_t *)context;
+
+    while (1)
+    {
+        rb_thread_call_without_gvl(rbsrt_socket_recvmsg_without_gvl, arg, rbsrt_io_interrupt, &arg->interrupted);
+
+        if (arg->completed)
+        {
+            break;
+        }
+
+        // interrupted, let ruby handle it and wait again when it did not raise
+
+        atomic_store(&arg->interrupted, 0);
+
+        rb_thread_check_ints();
+    }
+
+    return Qnil;
+}
+
+// Receives into a heap buffer and copies the message into arg->data, a new 
+// string when it is nil.
+VALUE rbsrt_socket_recvmsg_copy(VALUE context)
+{
+    rbsrt_recv_arg_t *arg = (rbsrt_recv_arg_t *)context;
+
+    if (arg->nonblock || arg->epollid == SRT_ERROR)
+    {
+        rbsrt_socket_recvmsg_without_gvl(arg);
+    }
+
+    else
+    {
+        rbsrt_socket_recvmsg_wait(context);
+    }
+
+    if (arg->error_code != SRT_SUCCESS || arg->nbytes <= 0)
+    {
+        return Qnil;
+    }
+
+    if (NIL_P(arg->data))
+    {
+        arg->data = rb_str_new(arg->buf, arg->nbytes);
+
+        return Qnil;
+    }
+
+    if (rb_str_capacity(arg->data) < (size_t)arg->nbytes)
+    {
+        rb_str_modify_expand(arg->data, (long)arg->nbytes - RSTRING_LEN(arg->data));
+    }
+
+    else
+    {
+        rb_str_modify(arg->data);
+    }
+
+    memcpy(RSTRING_PTR(arg->data), arg->buf, (size_t)arg->nbytes);
+
+    rb_str_set_len(arg->data, (long)arg->nbytes);
+    rb_enc_associate(arg->data, rb_ascii8bit_encoding());
+
+    return Qnil;
+}
+
+// Hands a grown buffer back to the socket, or frees a private one.
+VALUE rbsrt_socket_recvmsg_release(VALUE context)
+{
+    rbsrt_recv_arg_t *arg = (rbsrt_recv_arg_t *)context;
+
+    if (!arg->io)
+    {
+        free(arg->buf);
+
+        return Qnil;
+    }
+
+    arg->io->recv_buf = arg->buf;
+    arg->io->recv_buf_size = (size_t)arg->buf_len;
+
+    return rbsrt_socket_io_release_recv_buf((VALUE)arg->io);
+}
+
+// Receives a single message, into buffer when it is not nil. In nonblock mode 
+// the call never waits and raises SRT::Error::ASYNCRCV (returns :wait_readable 
+// without exception) when no message is available.
+VALUE rbsrt_socket_receive_message(VALUE self, VALUE buffer, int nonblock, int exception)
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket)
+
+    int nbuf = rbsrt_socket_recv_size(socket);
+    int large_messages = rbsrt_socket_large_messages(socket);
+    VALUE data = Qnil;
+
+    if (!NIL_P(buffer))
+    {
+        StringValue(buffer);
+    }
+
+    rbsrt_recv_arg_t arg = {
+        .socket = socket->socket,
+        .epollid = rbsrt_socket_io_wait_epoll(socket, SRT_EPOLL_IN),
+        .buf = NULL,
+        .buf_len = nbuf,
+        .growable = large_messages,
+        .io = NULL,
+        .nonblock = nonblock,
+        .nbytes = 0,
+        .error_code = SRT_SUCCESS,
+        .completed = 0,
+        .data = buffer
+    };
+
+    atomic_init(&arg.interrupted, 0);
+
+    if (large_messages)
+    {
+        // NOTE: Messages of a message api socket can be as large as the receive 
+        //       buffer. They are read into the socket's reusable heap buffer, 
+        //       grown only when srt holds more than fits, and copied into the 
+        //       string afterwards. A private buffer is used while another thread
+        //       receives into the socket's buffer.
+
+        arg.io = rbsrt_socket_io(socket);
+        arg.buf = rbsrt_socket_io_acquire_recv_buf(arg.io, (size_t)nbuf);
+
+        if (!arg.buf)
+        {
+            arg.io = NULL;
+            arg.buf = malloc((size_t)nbuf);
+        }
+
+        if (!arg.buf)
+        {
+            rb_raise(rb_eNoMemError, "failed to allocate receive buffer");
+        }
+
+        // the socket's buffer may be larger than asked for, use all of it
+
+        if (arg.io)
+        {
+            arg.buf_len = (int)arg.io->recv_buf_size;
+        }
+
+        rb_ensure(rbsrt_socket_recvmsg_copy, (VALUE)&arg, rbsrt_socket_recvmsg_release, (VALUE)&arg);
+
+        data = arg.data;
+    }
+
+    else if (NIL_P(buffer))
+    {
+        // NOTE: The string is not visible to other threads yet, so it is safe to 
+        //       fill it without the gvl.
+
+        data = rb_str_buf_new((long)nbuf);
+    }
+
+    else
+    {
+        // NOTE: The caller's string is locked while it is filled without the gvl, 
+        //       other threads can not resize it until the read completes. It is 
+        //       only reallocated when its capacity is too small, so a buffer 
+        //       reused across calls keeps its memory.
+
+        data = buffer;
+
+        if (rb_str_capacity(data) < (size_t)nbuf)
+        {
+            rb_str_modify_expand(data, (long)nbuf - RSTRING_LEN(data));
+        }
+
+        else
+        {
+            rb_str_modify(data);
+        }
+
+        rb_enc_associate(data, rb_ascii8bit_encoding());
+    }
+
+    if (!large_messages)
+    {
+        arg.buf = RSTRING_PTR(data);
+
+        if (nonblock || arg.epollid == SRT_ERROR)
+        {
+            // non-blocking, srt returns right away
+
+            rbsrt_socket_recvmsg_without_gvl(&arg);
+        }
+
+        else if (NIL_P(buffer))
+        {
+            rbsrt_socket_recvmsg_wait((VALUE)&arg);
+        }
+
+        else
+        {
+            rb_str_locktmp(data);
+
+            rb_ensure(rbsrt_socket_recvmsg_wait, (VALUE)&arg, rb_str_unlocktmp, data);
+        }
+    }
+
+    if (arg.error_code != SRT_SUCCESS || arg.nbytes <= 0)
+    {
+        if (!NIL_P(buffer))
+        {
+            rb_str_modify(buffer);
+            rb_str_set_len(buffer, 0);
+        }
+    }
+
+    if (arg.error_code == SRT_EASYNCRCV && nonblock && !exception)
+    {
+        return ID2SYM(rb_intern("wait_readable"));
+    }
+
+    else if (arg.error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(arg.error_code);
+
+        return Qnil;
+    }
+
+    else if (arg.nbytes == 0)
+    {
+        // TODO: Close socket
+        return Qnil;
+    }
+
+    // large messages were copied with the size of the message
+
+    if (!large_messages && NIL_P(buffer))
+    {
+        rb_str_resize(data, (long)arg.nbytes);
+    }
+
+    else if (!large_messages)
+    {
+        rb_str_set_len(data, (long)arg.nbytes);
+    }
+
+    return data;
+}
+
+VALUE rbsrt_socket_recvmsg(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("socket recvmsg");
+
+    VALUE buffer;
+
+    rb_scan_args(argc, argv, "01", &buffer);
+
+    return rbsrt_socket_receive_message(self, buffer, 0, 1);
+}
+
+VALUE rbsrt_socket_read_into(VALUE self, VALUE buffer)
+{
+    RBSRT_DEBUG_PRINT("socket read_into");
+
+    return rbsrt_socket_receive_message(self, buffer, 0, 1);
+}
+
+VALUE rbsrt_socket_recvmsg_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("socket recvmsg_nonblock");
+
+    VALUE buffer, opts;
+
+    rb_scan_args(argc, argv, "01:", &buffer, &opts);
+
+    return rbsrt_socket_receive_message(self, buffer, 1, rbsrt_nonblock_exception(opts));
+}
+
+
+// MARK: Batch Receiving
+
+typedef struct RBSRTRecvBatchArg
+{
+    SRTSOCKET socket;
+    SRT_EPOLL_T epollid;
+    char *buf;
+    long buf_len;
+    long max_bytes;
+    int message_size;
+    int large_messages;
+    int *message_lens;
+    int max_messages;
+    int num_messages;
+    long nbytes;
+    int error_code;
+    int completed;
+    atomic_int interrupted;
+} rbsrt_recv_batch_arg_t;
+
+// Grows the batch buffer so a message of message_size bytes fits, doubling it 
+// to keep the number of reallocations low. Returns RBSRT_FAILURE when out of 
+// memory.
+int rbsrt_socket_recvmsg_batch_reserve(rbsrt_recv_batch_arg_t *arg, int message_size)
+{
+    long needed = arg->nbytes + message_size;
+
+    if (arg->buf_len >= needed)
+    {
+        return RBSRT_SUCCESS;
+    }
+
+    long buf_len = arg->buf_len * 2;
+
+    if (buf_len < needed)
+    {
+        buf_len = needed;
+    }
+
+    char *buf = realloc(arg->buf, (size_t)buf_len);
+
+    if (!buf)
+    {
+        return RBSRT_FAILURE;
+    }
+
+    arg->buf = buf;
+    arg->buf_len = buf_len;
+
+    return RBSRT_SUCCESS;
+}
+
+// Waits for the first message, then reads queued messages until the batch is 
+// full or nothing is left to read. The buffer grows with the batch, so only 
+// what was received is allocated.
+void *rbsrt_socket_recvmsg_batch_without_gvl(void *context)
+{
+    rbsrt_recv_batch_arg_t *arg = (rbsrt_recv_batch_arg_t *)context;
+
+    if (arg->epollid != SRT_ERROR && rbsrt_io_wait(arg->socket, arg->epollid, &arg->interrupted) == RBSRT_FAILURE)
+    {
+        return arg;
+    }
+
+    while (arg->num_messages < arg->max_messages && arg->nbytes < arg->max_bytes)
+    {
+        if (arg->num_messages > 0 && arg->epollid != SRT_ERROR && !rbsrt_io_ready(arg->socket, arg->epollid))
+        {
+            break;
+        }
+
+        int queued_size = arg->large_messages ? rbsrt_socket_queued_size(arg->socket) : 0;
+        int message_size = queued_size > arg->message_size ? queued_size : arg->message_size;
+
+        if (rbsrt_socket_recvmsg_batch_reserve(arg, message_size) == RBSRT_FAILURE)
+        {
+            if (arg->num_messages == 0)
+            {
+                arg->error_code = SRT_ENOBUF;
+            }
+
+            break;
+        }
+
+        int nbytes = srt_recvmsg2(arg->socket, arg->buf + arg->nbytes, message_size, NULL);
+
+        if (nbytes == SRT_ERROR)
+        {
+            // errors after the first message end the batch, the next call 
+            // reports them
+
+            if (arg->num_messages == 0)
+            {
+                arg->error_code = srt_getlasterror(NULL);
+            }
+
+            break;
+        }
+
+        if (nbytes == 0)
+        {
+            break;
+        }
+
+        arg->message_lens[arg->num_messages++] = nbytes;
+        arg->nbytes += nbytes;
+    }
+
+    arg->completed = 1;
+
+    return arg;
+}
+
+VALUE rbsrt_socket_recvmsg_batch_wait(VALUE context)
+{
+    rbsrt_recv_batch_arg_t *arg = (rbsrt_recv_batch_arg_t *)context;
+
+    while (1)
+    {
+        rb_thread_call_without_gvl(rbsrt_socket_recvmsg_batch_without_gvl, arg, rbsrt_io_interrupt, &arg->interrupted);
+
+        if (arg->completed)
+        {
+            break;
+        }
+
+        // interrupted, let ruby handle it and wait again when it did not raise
+
+        atomic_store(&arg->interrupted, 0);
+
+        rb_thread_check_ints();
+    }
+
+    return Qnil;
+}
+
+VALUE rbsrt_socket_recvmsg_batch_done(VALUE context)
+{
+    rbsrt_recv_batch_arg_t *arg = (rbsrt_recv_batch_arg_t *)context;
+
+    free(arg->buf);
+
+    arg->buf = NULL;
+
+    return Qnil;
+}
+
+VALUE rbsrt_socket_recvmsg_batch_collect(VALUE context)
+{
+    rbsrt_recv_batch_arg_t *arg = (rbsrt_recv_batch_arg_t *)context;
+
+    rbsrt_socket_recvmsg_batch_wait(context);
+
+    if (arg->error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(arg->error_code);
+    }
+
+    if (arg->num_messages == 0)
+    {
+        return Qnil;
+    }
+
+    VALUE messages = rb_ary_new_capa(arg->num_messages);
+    long offset = 0;
+
+    for (int i = 0; i < arg->num_messages; i++)
+    {
+        rb_ary_push(messages, rb_str_new(arg->buf + offset, arg->message_lens[i]));
+
+        offset += arg->message_lens[i];
+    }
+
+    return messages;
+}
+
+VALUE rbsrt_socket_recvmsg_batch_join(VALUE context)
+{
+    rbsrt_recv_batch_arg_t *arg = (rbsrt_recv_batch_arg_t *)context;
+
+    rbsrt_socket_recvmsg_batch_wait(context);
+
+    if (arg->error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(arg->error_code);
+    }
+
+    if (arg->num_messages == 0)
+    {
+        return Qnil;
+    }
+
+    return rb_str_new(arg->buf, arg->nbytes);
+}
+
+VALUE rbsrt_socket_recvmsg_batch(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("socket recvmsg_batch");
+
+    VALUE max_messages_val, max_bytes_val, opts;
+
+    rb_scan_args(argc, argv, "11:", &max_messages_val, &max_bytes_val, &opts);
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket)
+
+    int join = !NIL_P(opts) && RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("join"))));
+    int max_messages = NUM2INT(max_messages_val);
+    long max_bytes = NIL_P(max_bytes_val) ? LONG_MAX : NUM2LONG(max_bytes_val);
+
+    if (max_messages <= 0)
+    {
+        rb_raise(rb_eArgError, "max_messages must be positive");
+    }
+
+    if (max_bytes <= 0)
+    {
+        rb_raise(rb_eArgError, "max_bytes must be positive");
+    }
+
+    VALUE message_lens_buf;
+    int *message_lens = ALLOCV_N(int, message_lens_buf, max_messages);
+
+    rbsrt_recv_batch_arg_t arg = {
+        .socket = socket->socket,
+        .epollid = rbsrt_socket_io_wait_epoll(socket, SRT_EPOLL_IN),
+        .buf = NULL,
+        .buf_len = 0,
+        .max_bytes = max_bytes,
+        .message_size = rbsrt_socket_recv_size(socket),
+        .large_messages = rbsrt_socket_large_messages(socket),
+        .message_lens = message_lens,
+        .max_messages = max_messages,
+        .num_messages = 0,
+        .nbytes = 0,
+        .error_code = SRT_SUCCESS,
+        .completed = 0
+    };
+
+    atomic_init(&arg.interrupted, 0);
+
+    VALUE result = rb_ensure(join ? rbsrt_socket_recvmsg_batch_join : rbsrt_socket_recvmsg_batch_collect, (VALUE)&arg, rbsrt_socket_recvmsg_batch_done, (VALUE)&arg);
+
+    ALLOCV_END(message_lens_buf);
+
+    return result;
+}
+
+
+// MARK: File Transmission
+
+// NOTE: sendfile and recvfile move the file through a heap buffer in bounded 
+//       chunks instead of calling srt_sendfile and srt_recvfile. Those block 
+//       until the whole transfer is done and never look at ruby interrupts, so
+//       a Timeout or Thread#kill could not stop a large transfer. They only 
+//       work on file mode sockets without the message api. Paths are opened 
+//       for the transfer, IOs are used through their file descriptor starting 
+//       at their current position.
+
+#ifndef RBSRT_FILE_CHUNK_SIZE
+#define RBSRT_FILE_CHUNK_SIZE (1024 * 1024) // bytes moved between checks for pending ruby interrupts
+#endif
+
+typedef struct RBSRTFileArg
+{
+    SRTSOCKET socket;
+    SRT_EPOLL_T epollid;
+    int fd;
+    int close_fd; // opened from a path for the transfer
+    int seekable; // read with pread from offset, or with read from the current position
+    char *buf;
+    int64_t offset;
+    int64_t size;
+    int64_t nbytes;
+    int error_code;
+    int sys_error;
+    int completed;
+    atomic_int interrupted;
+    void *(*transfer_without_gvl)(void *);
+} rbsrt_file_arg_t;
+
+void *rbsrt_socket_sendfile_without_gvl(void *context)
+{
+    rbsrt_file_arg_t *arg = (rbsrt_file_arg_t *)context;
+
+    while (arg->nbytes < arg->size)
+    {
+        if (rbsrt_io_wait(arg->socket, arg->epollid, &arg->interrupted) == RBSRT_FAILURE)
+        {
+            return arg;
+        }
+
+        int64_t chunk_size = arg->size - arg->nbytes;
+        long space = rbsrt_socket_send_space(arg->socket);
+
+        if (chunk_size > RBSRT_FILE_CHUNK_SIZE)
+        {
+            chunk_size = RBSRT_FILE_CHUNK_SIZE;
+        }
+
+        // NOTE: a blocking socket waits in srt until the whole chunk is queued,
+        //       keep the chunk within the free send buffer so it returns quickly.
+
+        if (space > 0 && space < chunk_size)
+        {
+            chunk_size = space;
+        }
+
+        ssize_t nread = arg->seekable ? pread(arg->fd, arg->buf, (size_t)chunk_size, (off_t)(arg->offset + arg->nbytes)) : read(arg->fd, arg->buf, (size_t)chunk_size);
+
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            arg->sys_error = errno;
+
+            return arg;
+        }
+
+        if (nread == 0)
+        {
+            // the file is shorter than size
+            break;
+        }
+
+        int nbytes = srt_sendmsg2(arg->socket, arg->buf, (int)nread, NULL);
+
+        if (nbytes == SRT_ERROR)
+        {
+            int error_code = srt_getlasterror(NULL);
+
+            if (error_code == SRT_EASYNCSND)
+            {
+                continue;
+            }
+
+            arg->error_code = error_code;
+
+            return arg;
+        }
+
+        RBSRT_DEBUG_PRINT("sendfile bytes %d", nbytes);
+
+        arg->nbytes += nbytes;
+    }
+
+    arg->completed = 1;
+
+    return arg;
+}
+
+void *rbsrt_socket_recvfile_without_gvl(void *context)
+{
+    rbsrt_file_arg_t *arg = (rbsrt_file_arg_t *)context;
+
+    while (arg->nbytes < arg->size)
+    {
+        if (rbsrt_io_wait(arg->socket, arg->epollid, &arg->interrupted) == RBSRT_FAILURE)
+        {
+            return arg;
+        }
+
+        int64_t chunk_size = arg->size - arg->nbytes;
+
+        if (chunk_size > RBSRT_FILE_CHUNK_SIZE)
+        {
+            chunk_size = RBSRT_FILE_CHUNK_SIZE;
+        }
+
+        int nbytes = srt_recvmsg2(arg->socket, arg->buf, (int)chunk_size, NULL);
+
+        if (nbytes == SRT_ERROR)
+        {
+            int error_code = srt_getlasterror(NULL);
+
+            if (error_code == SRT_EASYNCRCV)
+            {
+                continue;
+            }
+
+            arg->error_code = error_code;
+
+            return arg;
+        }
+
+        if (nbytes == 0)
+        {
+            break;
+        }
+
+        for (int written = 0; written < nbytes;)
+        {
+            ssize_t nwritten = write(arg->fd, arg->buf + written, (size_t)(nbytes - written));
+
+            if (nwritten < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                arg->sys_error = errno;
+
+                return arg;
+            }
+
+            written += (int)nwritten;
+        }
+
+        RBSRT_DEBUG_PRINT("recvfile bytes %d", nbytes);
+
+        arg->nbytes += nbytes;
+    }
+
+    arg->completed = 1;
+
+    return arg;
+}
+
+VALUE rbsrt_socket_transfer_file_wait(VALUE context)
+{
+    rbsrt_file_arg_t *arg = (rbsrt_file_arg_t *)context;
+
+    while (1)
+    {
+        rb_thread_call_without_gvl(arg->transfer_without_gvl, arg, rbsrt_io_interrupt, &arg->interrupted);
+
+        if (arg->error_code != SRT_SUCCESS || arg->sys_error != 0 || arg->completed)
+        {
+            break;
+        }
+
+        // interrupted, let ruby handle it and continue when it did not raise
+
+        atomic_store(&arg->interrupted, 0);
+
+        rb_thread_check_ints();
+    }
+
+    return Qnil;
+}
+
+VALUE rbsrt_socket_transfer_file_done(VALUE context)
+{
+    rbsrt_file_arg_t *arg = (rbsrt_file_arg_t *)context;
+
+    if (arg->epollid != SRT_ERROR)
+    {
+        srt_epoll_release(arg->epollid);
+    }
+
+    if (arg->fd != -1 && arg->close_fd)
+    {
+        close(arg->fd);
+    }
+
+    free(arg->buf);
+
+    return Qnil;
+}
+
+int rbsrt_io_fd(VALUE io)
+{
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    return rb_io_descriptor(io);
+#else
+    return NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+#endif
+}
+
+// Moves size bytes between the socket and a file, size is -1 to send up to 
+// the end of the file and offset is -1 to start at the position of an IO.
+VALUE rbsrt_socket_transfer_file(VALUE self, VALUE path_or_io, int64_t offset, int64_t size, void *(*transfer_without_gvl)(void *))
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket)
+
+    if (rbsrt_socket_transtype(socket) == SRTT_LIVE || rbsrt_socket_message_api(socket->socket))
+    {
+        rb_raise(rb_eArgError, "files can only be transferred by file mode sockets without the message api");
+    }
+
+    VALUE io = rb_io_check_io(path_or_io);
+    VALUE path = NIL_P(io) ? rb_str_new_frozen(rb_get_path(path_or_io)) : Qnil;
+    int sending = transfer_without_gvl == rbsrt_socket_sendfile_without_gvl;
+    int events = (sending ? SRT_EPOLL_OUT : SRT_EPOLL_IN) | SRT_EPOLL_ERR;
+    const char *path_cstr = NIL_P(path) ? NULL : StringValueCStr(path);
+    off_t io_position = -1;
+
+    rbsrt_file_arg_t arg = {
+        .socket = socket->socket,
+        .epollid = SRT_ERROR,
+        .fd = -1,
+        .close_fd = NIL_P(io),
+        .seekable = 1,
+        .buf = NULL,
+        .offset = offset,
+        .size = size,
+        .nbytes = 0,
+        .error_code = SRT_SUCCESS,
+        .sys_error = 0,
+        .completed = 0,
+        .transfer_without_gvl = transfer_without_gvl
+    };
+
+    atomic_init(&arg.interrupted, 0);
+
+    if (!NIL_P(io))
+    {
+        // NOTE: flushing writes out what ruby buffered and, for files, moves 
+        //       the descriptor back over data ruby read ahead.
+
+        rb_io_flush(io);
+
+        arg.fd = rbsrt_io_fd(io);
+
+        io_position = lseek(arg.fd, 0, SEEK_CUR);
+
+        if (sending && offset < 0)
+        {
+            arg.offset = io_position;
+            arg.seekable = io_position != -1; // pipes and sockets are read as they come
+        }
+    }
+
+    // NOTE: the epoll lets the transfer wait in short slices on blocking and 
+    //       non-blocking sockets alike, it only lives as long as the transfer.
+
+    arg.epollid = srt_epoll_create();
+
+    if (arg.epollid == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+    }
+
+    if (srt_epoll_add_usock(arg.epollid, arg.socket, &events) == SRT_ERROR)
+    {
+        int error_code = srt_getlasterror(NULL);
+
+        rbsrt_socket_transfer_file_done((VALUE)&arg);
+        rbsrt_raise_srt_error(error_code);
+    }
+
+    if (NIL_P(io))
+    {
+        arg.fd = sending ? open(path_cstr, O_RDONLY | O_CLOEXEC) : open(path_cstr, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+
+    if (arg.fd == -1)
+    {
+        int sys_error = errno;
+
+        rbsrt_socket_transfer_file_done((VALUE)&arg);
+        rb_syserr_fail_str(sys_error, path);
+    }
+
+    if (arg.offset < 0)
+    {
+        arg.offset = 0;
+    }
+
+    if (size < 0)
+    {
+        // up to the end of a file, or of the stream
+
+        struct stat file_stat;
+
+        if (fstat(arg.fd, &file_stat) != 0)
+        {
+            int sys_error = errno;
+
+            rbsrt_socket_transfer_file_done((VALUE)&arg);
+            rb_syserr_fail_str(sys_error, path);
+        }
+
+        arg.size = S_ISREG(file_stat.st_mode) && arg.seekable ? (int64_t)file_stat.st_size - arg.offset : INT64_MAX;
+    }
+
+    if (arg.size <= 0)
+    {
+        rbsrt_socket_transfer_file_done((VALUE)&arg);
+
+        return INT2FIX(0);
+    }
+
+    arg.buf = malloc(arg.size < RBSRT_FILE_CHUNK_SIZE ? (size_t)arg.size : RBSRT_FILE_CHUNK_SIZE);
+
+    if (!arg.buf)
+    {
+        rbsrt_socket_transfer_file_done((VALUE)&arg);
+        rb_raise(rb_eNoMemError, "failed to allocate file transfer buffer");
+    }
+
+    rb_ensure(rbsrt_socket_transfer_file_wait, (VALUE)&arg, rbsrt_socket_transfer_file_done, (VALUE)&arg);
+
+    if (sending && !NIL_P(io) && offset < 0 && arg.seekable)
+    {
+        // pread leaves the position alone, move the io past what was sent
+
+        lseek(arg.fd, io_position + (off_t)arg.nbytes, SEEK_SET);
+    }
+
+    RB_GC_GUARD(io);
+    RB_GC_GUARD(path);
+
+    if (arg.sys_error != 0)
+    {
+        rb_syserr_fail_str(arg.sys_error, path);
+    }
+
+    if (arg.error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(arg.error_code);
+    }
+
+    return LL2NUM(arg.nbytes);
+}
+
+VALUE rbsrt_socket_sendfile(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("socket sendfile");
+
+    VALUE path_or_io, opts;
+
+    rb_scan_args(argc, argv, "1:", &path_or_io, &opts);
+
+    VALUE offset_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("offset")));
+    VALUE size_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("size")));
+
+    int64_t offset = NIL_P(offset_val) ? -1 : NUM2LL(offset_val);
+    int64_t size = NIL_P(size_val) ? -1 : NUM2LL(size_val);
+
+    if (!NIL_P(offset_val) && offset < 0)
+    {
+        rb_raise(rb_eArgError, "offset must not be negative");
+    }
+
+    if (!NIL_P(size_val) && size <= 0)
+    {
+        return INT2FIX(0);
+    }
+
+    return rbsrt_socket_transfer_file(self, path_or_io, offset, size, rbsrt_socket_sendfile_without_gvl);
+}
+
+VALUE rbsrt_socket_recvfile(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("socket recvfile");
+
+    VALUE path_or_io, opts;
+
+    rb_scan_args(argc, argv, "1:", &path_or_io, &opts);
+
+    VALUE size_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("size")));
+
+    if (NIL_P(size_val))
+    {
+        rb_raise(rb_eArgError, "missing keyword: size");
+    }
+
+    int64_t size = NUM2LL(size_val);
+
+    if (size <= 0)
+    {
+        return INT2FIX(0);
+    }
+
+    return rbsrt_socket_transfer_file(self, path_or_io, -1, size, rbsrt_socket_recvfile_without_gvl);
+}
+
+
+// MARK: UDP Forwarding
+
+// NOTE: A udp forwarder sends the messages of an srt socket as datagrams to a 
+//       udp (multicast) destination, batched with sendmmsg where available. 
+//       Server connections push the messages their worker reads into the 
+//       forwarder's ring of slots, a forwarder thread sends them. For clients 
+//       the forwarder thread reads the messages itself.
+
+// Sends n slots starting at first. Datagrams the destination refused are 
+// dropped. Returns the number of datagrams sent.
+int rbsrt_udp_forwarder_send(rbsrt_udp_forwarder_t *forwarder, int first, int n)
+{
+    int sent = 0;
+    int done = 0;
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[RBSRT_UDP_FORWARD_BATCH];
+    struct iovec iov[RBSRT_UDP_FORWARD_BATCH];
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * n);
+
+    for (int i = 0; i < n; i++)
+    {
+        iov[i].iov_base = forwarder->slots + (size_t)(first + i) * RBSRT_MAX_PAYLOAD_SIZE;
+        iov[i].iov_len = (size_t)forwarder->lens[first + i];
+
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (done < n)
+    {
+        int nmsgs = sendmmsg(forwarder->fd, msgs + done, (unsigned int)(n - done), 0);
+
+        if (nmsgs == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // skip the datagram which failed
+
+            forwarder->error_code = errno;
+
+            done++;
+
+            continue;
+        }
+
+        sent += nmsgs;
+        done += nmsgs;
+    }
+#else
+    for (; done < n; done++)
+    {
+        const char *buf = forwarder->slots + (size_t)(first + done) * RBSRT_MAX_PAYLOAD_SIZE;
+
+        if (send(forwarder->fd, buf, (size_t)forwarder->lens[first + done], 0) == -1)
+        {
+            forwarder->error_code = errno;
+
+            continue;
+        }
+
+        sent++;
+    }
+#endif
+
+    return sent;
+}
+
+// Sends the pushed messages until the forwarder stops and its ring is empty.
+void *rbsrt_udp_forwarder_run(void *context)
+{
+    rbsrt_udp_forwarder_t *forwarder = (rbsrt_udp_forwarder_t *)context;
+
+    pthread_mutex_lock(&forwarder->lock);
+
+    while (1)
+    {
+        if (forwarder->count == 0)
+        {
+            if (forwarder->stopping)
+            {
+                break;
+            }
+
+            pthread_cond_wait(&forwarder->cond, &forwarder->lock);
+
+            continue;
+        }
+
+        // the pusher only writes slots after the counted ones
+
+        int first = forwarder->head;
+        int n = forwarder->count;
+
+        if (n > RBSRT_UDP_FORWARD_SLOTS - first)
+        {
+            n = RBSRT_UDP_FORWARD_SLOTS - first;
+        }
+
+        if (n > RBSRT_UDP_FORWARD_BATCH)
+        {
+            n = RBSRT_UDP_FORWARD_BATCH;
+        }
+
+        pthread_mutex_unlock(&forwarder->lock);
+
+        int sent = rbsrt_udp_forwarder_send(forwarder, first, n);
+
+        pthread_mutex_lock(&forwarder->lock);
+
+        forwarder->head = (first + n) % RBSRT_UDP_FORWARD_SLOTS;
+        forwarder->count -= n;
+        forwarder->sent_datagrams += sent;
+        forwarder->dropped_datagrams += n - sent;
+    }
+
+    pthread_mutex_unlock(&forwarder->lock);
+
+    return NULL;
+}
+
+// Reads messages from the source socket and sends them in batches, until the 
+// forwarder stops or the source can no longer be read.
+void *rbsrt_udp_forwarder_read_run(void *context)
+{
+    rbsrt_udp_forwarder_t *forwarder = (rbsrt_udp_forwarder_t *)context;
+
+    SRT_EPOLL_EVENT event;
+
+    while (1)
+    {
+        pthread_mutex_lock(&forwarder->lock);
+
+        int stopping = forwarder->stopping;
+
+        pthread_mutex_unlock(&forwarder->lock);
+
+        if (stopping)
+        {
+            break;
+        }
+
+        if (srt_epoll_uwait(forwarder->epollid, &event, 1, RBSRT_UDP_FORWARD_WAIT) <= 0)
+        {
+            continue;
+        }
+
+        int n = 0;
+        int readable = 1;
+
+        while (n < RBSRT_UDP_FORWARD_BATCH && (n == 0 || rbsrt_io_ready(forwarder->source, forwarder->epollid)))
+        {
+            int nbytes = srt_recvmsg2(forwarder->source, forwarder->slots + (size_t)n * RBSRT_MAX_PAYLOAD_SIZE, RBSRT_MAX_PAYLOAD_SIZE, NULL);
+
+            if (nbytes == SRT_ERROR || nbytes == 0)
+            {
+                RBSRT_DEBUG_PRINT("udp forwarder stops reading: %s", srt_getlasterror_str());
+
+                readable = 0;
+
+                break;
+            }
+
+            forwarder->lens[n++] = nbytes;
+        }
+
+        int sent = n > 0 ? rbsrt_udp_forwarder_send(forwarder, 0, n) : 0;
+
+        pthread_mutex_lock(&forwarder->lock);
+
+        forwarder->sent_datagrams += sent;
+        forwarder->dropped_datagrams += n - sent;
+
+        pthread_mutex_unlock(&forwarder->lock);
+
+        if (!readable)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Copies a message into the forwarder's ring, splitting messages which do not 
+// fit a datagram in mpeg-ts aligned parts. Never waits, when the ring is full 
+// the rest of the message is dropped and counted.
+void rbsrt_udp_forwarder_push(rbsrt_udp_forwarder_t *forwarder, const char *buf, int len)
+{
+    pthread_mutex_lock(&forwarder->lock);
+
+    while (len > 0)
+    {
+        int nbytes = len > RBSRT_MAX_PAYLOAD_SIZE ? RBSRT_PAYLOAD_SIZE : len;
+
+        if (forwarder->count == RBSRT_UDP_FORWARD_SLOTS)
+        {
+            forwarder->dropped_datagrams += (len + RBSRT_PAYLOAD_SIZE - 1) / RBSRT_PAYLOAD_SIZE;
+
+            break;
+        }
+
+        int slot = (forwarder->head + forwarder->count) % RBSRT_UDP_FORWARD_SLOTS;
+
+        memcpy(forwarder->slots + (size_t)slot * RBSRT_MAX_PAYLOAD_SIZE, buf, (size_t)nbytes);
+
+        forwarder->lens[slot] = nbytes;
+        forwarder->count++;
+
+        buf += nbytes;
+        len -= nbytes;
+    }
+
+    pthread_cond_signal(&forwarder->cond);
+
+    pthread_mutex_unlock(&forwarder->lock);
+}
+
+// Lets the forwarder thread send what is left and stop, without waiting for it.
+void rbsrt_udp_forwarder_signal_stop(rbsrt_udp_forwarder_t *forwarder)
+{
+    pthread_mutex_lock(&forwarder->lock);
+
+    forwarder->stopping = 1;
+
+    pthread_cond_signal(&forwarder->cond);
+
+    pthread_mutex_unlock(&forwarder->lock);
+}
+
+// Sends what is left and stops the forwarder thread.
+void *rbsrt_udp_forwarder_stop_without_gvl(void *context)
+{
+    rbsrt_udp_forwarder_t *forwarder = (rbsrt_udp_forwarder_t *)context;
+
+    rbsrt_udp_forwarder_signal_stop(forwarder);
+
+    pthread_join(forwarder->thread, NULL);
+
+    forwarder->running = 0;
+
+    return forwarder;
+}
+
+void rbsrt_udp_forwarder_release(rbsrt_udp_forwarder_t *forwarder)
+{
+    if (!forwarder)
+    {
+        return;
+    }
+
+    if (forwarder->running)
+    {
+        rbsrt_udp_forwarder_stop_without_gvl(forwarder);
+    }
+
+    if (forwarder->epollid != SRT_ERROR)
+    {
+        srt_epoll_release(forwarder->epollid);
+    }
+
+    if (forwarder->fd != -1)
+    {
+        close(forwarder->fd);
+    }
+
+    pthread_cond_destroy(&forwarder->cond);
+    pthread_mutex_destroy(&forwarder->lock);
+
+    free(forwarder->slots);
+    free(forwarder);
+}
+
+// Finds the ipv4 address of a network interface by name.
+int rbsrt_interface_address(const char *name, struct in_addr *addr)
+{
+    struct ifaddrs *ifaddrs;
+    int status = RBSRT_FAILURE;
+
+    if (getifaddrs(&ifaddrs) != 0)
+    {
+        return RBSRT_FAILURE;
+    }
+
+    for (struct ifaddrs *ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET && strcmp(ifa->ifa_name, name) == 0)
+        {
+            *addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+
+            status = RBSRT_SUCCESS;
+
+            break;
+        }
+    }
+
+    freeifaddrs(ifaddrs);
+
+    return status;
+}
+
+// Opens a udp socket connected to host and port. ttl sets the unicast and 
+// multicast ttl (hops), iface the interface multicast datagrams leave from, an 
+// interface name or, for ipv4, a local address.
+int rbsrt_udp_socket_open(const char *host, const char *port, int ttl, const char *iface)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    int status = getaddrinfo(host, port, &hints, &res);
+
+    if (status != 0)
+    {
+        rb_raise(rbsrt_eStandardError, "failed to get address info: %s", gai_strerror(status));
+    }
+
+    if ((fd = socket(res->ai_family, SOCK_DGRAM, 0)) == -1)
+    {
+        freeaddrinfo(res);
+
+        rb_sys_fail("socket");
+    }
+
+    int sndbuf = RBSRT_UDP_FORWARD_SLOTS * RBSRT_MAX_PAYLOAD_SIZE;
+    int ok = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    if (res->ai_family == AF_INET)
+    {
+        if (ttl > 0)
+        {
+            unsigned char multicast_ttl = (unsigned char)(ttl > 255 ? 255 : ttl);
+
+            ok = setsockopt(fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)) == 0 &&
+                 setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &multicast_ttl, sizeof(multicast_ttl)) == 0;
+        }
+
+        if (ok && iface)
+        {
+            struct in_addr addr;
+
+            if (inet_pton(AF_INET, iface, &addr) != 1 && rbsrt_interface_address(iface, &addr) == RBSRT_FAILURE)
+            {
+                errno = ENXIO;
+
+                ok = 0;
+            }
+
+            ok = ok && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr)) == 0;
+        }
+    }
+
+    else
+    {
+        if (ttl > 0)
+        {
+            ok = setsockopt(fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl, sizeof(ttl)) == 0 &&
+                 setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) == 0;
+        }
+
+        if (ok && iface)
+        {
+            unsigned int index = if_nametoindex(iface);
+
+            ok = index != 0 && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index)) == 0;
+        }
+    }
+
+    ok = ok && connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+
+    freeaddrinfo(res);
+
+    if (!ok)
+    {
+        int error_code = errno;
+
+        close(fd);
+
+        rb_syserr_fail(error_code, "failed to set up udp socket");
+    }
+
+    return fd;
+}
+
+// Creates a forwarder to host and port. Reads source itself unless it is 
+// SRT_INVALID_SOCK.
+rbsrt_udp_forwarder_t *rbsrt_udp_forwarder_create(VALUE host, VALUE port, VALUE opts, SRTSOCKET source)
+{
+    VALUE ttl = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("ttl")));
+    VALUE iface = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("iface")));
+
+    host = rb_obj_as_string(host);
+    port = rb_obj_as_string(port);
+
+    if (!NIL_P(iface))
+    {
+        iface = rb_obj_as_string(iface);
+    }
+
+    if (!NIL_P(ttl) && NUM2INT(ttl) <= 0)
+    {
+        rb_raise(rb_eArgError, "ttl must be positive");
+    }
+
+    int fd = rbsrt_udp_socket_open(StringValueCStr(host), 
+                                   StringValueCStr(port), 
+                                   NIL_P(ttl) ? 0 : NUM2INT(ttl), 
+                                   NIL_P(iface) ? NULL : StringValueCStr(iface));
+
+    rbsrt_udp_forwarder_t *forwarder = malloc(sizeof(rbsrt_udp_forwarder_t));
+
+    if (!forwarder)
+    {
+        close(fd);
+
+        rb_raise(rb_eNoMemError, "failed to allocate udp forwarder");
+    }
+
+    memset(forwarder, 0, sizeof(rbsrt_udp_forwarder_t));
+
+    forwarder->fd = fd;
+    forwarder->source = source;
+    forwarder->epollid = SRT_ERROR;
+    forwarder->slots = malloc((size_t)RBSRT_UDP_FORWARD_SLOTS * RBSRT_MAX_PAYLOAD_SIZE);
+
+    pthread_mutex_init(&forwarder->lock, NULL);
+    pthread_cond_init(&forwarder->cond, NULL);
+
+    if (!forwarder->slots)
+    {
+        rbsrt_udp_forwarder_release(forwarder);
+
+        rb_raise(rb_eNoMemError, "failed to allocate udp forwarder");
+    }
+
+    if (source != SRT_INVALID_SOCK)
+    {
+        int events = SRT_EPOLL_IN | SRT_EPOLL_ERR;
+
+        if ((forwarder->epollid = srt_epoll_create()) == SRT_ERROR || srt_epoll_add_usock(forwarder->epollid, source, &events) == SRT_ERROR)
+        {
+            int error_code = srt_getlasterror(NULL);
+
+            rbsrt_udp_forwarder_release(forwarder);
+
+            rbsrt_raise_srt_error(error_code);
+        }
+    }
+
+    if (pthread_create(&forwarder->thread, NULL, source != SRT_INVALID_SOCK ? rbsrt_udp_forwarder_read_run : rbsrt_udp_forwarder_run, forwarder) != 0)
+    {
+        rbsrt_udp_forwarder_release(forwarder);
+
+        rb_raise(rbsrt_eStandardError, "failed to start udp forwarder thread");
+    }
+
+    forwarder->running = 1;
+
+    return forwarder;
+}
+
+// Stops a forwarder and returns its totals.
+VALUE rbsrt_udp_forwarder_finish(rbsrt_udp_forwarder_t *forwarder)
+{
+    if (forwarder->running)
+    {
+        rb_thread_call_without_gvl(rbsrt_udp_forwarder_stop_without_gvl, forwarder, NULL, NULL);
+    }
+
+    VALUE stats = rb_hash_new();
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("datagrams")), LONG2NUM(forwarder->sent_datagrams));
+    rb_hash_aset(stats, ID2SYM(rb_intern("dropped_datagrams")), LONG2NUM(forwarder->dropped_datagrams));
+
+    rbsrt_udp_forwarder_release(forwarder);
+
+    return stats;
+}
+
+
+// MARK: UDP Ingest
+
+// NOTE: A udp ingest receives mpeg-ts datagrams on a native thread, batched 
+//       with recvmmsg where available, and repacks them into payload sized 
+//       messages for a client, sent with srt_sendmsg2. Datagrams the kernel 
+//       dropped because the receive buffer overflowed are counted with 
+//       SO_RXQ_OVFL where available.
+
+int rbsrt_udp_ingest_send_packet(rbsrt_udp_ingest_t *ingest)
+{
+    int status = RBSRT_SUCCESS;
+
+    // NOTE: The client may be blocking, srt would then wait until there is 
+    //       room in the send buffer. A packet which does not fit is dropped 
+    //       and counted like one a non-blocking client refuses.
+
+    if (rbsrt_socket_send_space(ingest->target) < ingest->packet_len)
+    {
+        pthread_mutex_lock(&ingest->lock);
+
+        ingest->dropped_messages++;
+
+        pthread_mutex_unlock(&ingest->lock);
+    }
+
+    else if (srt_sendmsg2(ingest->target, ingest->packet, ingest->packet_len, NULL) == SRT_ERROR)
+    {
+        int error_code = srt_getlasterror(NULL);
+
+        pthread_mutex_lock(&ingest->lock);
+
+        ingest->dropped_messages++;
+
+        if (error_code != SRT_EASYNCSND)
+        {
+            // the client can no longer send
+
+            ingest->error_code = error_code;
+
+            status = RBSRT_FAILURE;
+        }
+
+        pthread_mutex_unlock(&ingest->lock);
+    }
+
+    else
+    {
+        pthread_mutex_lock(&ingest->lock);
+
+        ingest->sent_messages++;
+
+        pthread_mutex_unlock(&ingest->lock);
+    }
+
+    ingest->packet_len = 0;
+
+    return status;
+}
+
+// Appends a datagram to the packet, sending every full payload.
+int rbsrt_udp_ingest_append(rbsrt_udp_ingest_t *ingest, const char *buf, int len)
+{
+    while (len > 0)
+    {
+        int nbytes = ingest->payload_size - ingest->packet_len < len ? ingest->payload_size - ingest->packet_len : len;
+
+        memcpy(ingest->packet + ingest->packet_len, buf, (size_t)nbytes);
+
+        ingest->packet_len += nbytes;
+
+        buf += nbytes;
+        len -= nbytes;
+
+        if (ingest->packet_len == ingest->payload_size && rbsrt_udp_ingest_send_packet(ingest) == RBSRT_FAILURE)
+        {
+            return RBSRT_FAILURE;
+        }
+    }
+
+    return RBSRT_SUCCESS;
+}
+
+// Receives up to a batch of datagrams. Returns the number of datagrams in the 
+// slots, with their lengths in lens, 0 when there was nothing to read or -1 on 
+// error. Truncated datagrams get a length of -1.
+int rbsrt_udp_ingest_receive(rbsrt_udp_ingest_t *ingest, int *lens)
+{
+    int n = 0;
+
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[RBSRT_UDP_FORWARD_BATCH];
+    struct iovec iov[RBSRT_UDP_FORWARD_BATCH];
+    char control[RBSRT_UDP_FORWARD_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < RBSRT_UDP_FORWARD_BATCH; i++)
+    {
+        iov[i].iov_base = ingest->slots + (size_t)i * RBSRT_UDP_DATAGRAM_SIZE;
+        iov[i].iov_len = RBSRT_UDP_DATAGRAM_SIZE;
+
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    if ((n = recvmmsg(ingest->fd, msgs, RBSRT_UDP_FORWARD_BATCH, MSG_DONTWAIT, NULL)) == -1)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        lens[i] = msgs[i].msg_hdr.msg_flags & MSG_TRUNC ? -1 : (int)msgs[i].msg_len;
+
+#ifdef SO_RXQ_OVFL
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+            {
+                memcpy(&ingest->kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+            }
+        }
+#endif
+    }
+#else
+    for (; n < RBSRT_UDP_FORWARD_BATCH; n++)
+    {
+        ssize_t nbytes = recv(ingest->fd, ingest->slots + (size_t)n * RBSRT_UDP_DATAGRAM_SIZE, RBSRT_UDP_DATAGRAM_SIZE, MSG_DONTWAIT | MSG_TRUNC);
+
+        if (nbytes == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                break;
+            }
+
+            return n > 0 ? n : -1;
+        }
+
+        lens[n] = nbytes > RBSRT_UDP_DATAGRAM_SIZE ? -1 : (int)nbytes;
+    }
+#endif
+
+    return n;
+}
+
+void *rbsrt_udp_ingest_run(void *context)
+{
+    rbsrt_udp_ingest_t *ingest = (rbsrt_udp_ingest_t *)context;
+
+    int lens[RBSRT_UDP_FORWARD_BATCH];
+    uint32_t kernel_drops = 0;
+
+    while (1)
+    {
+        pthread_mutex_lock(&ingest->lock);
+
+        int stopping = ingest->stopping;
+
+        pthread_mutex_unlock(&ingest->lock);
+
+        if (stopping)
+        {
+            break;
+        }
+
+        // a partial payload waits at most RBSRT_COALESCE_DELAY for more data
+
+        struct pollfd pfd = { .fd = ingest->fd, .events = POLLIN, .revents = 0 };
+        int ready = poll(&pfd, 1, ingest->packet_len > 0 ? RBSRT_COALESCE_DELAY : RBSRT_UDP_FORWARD_WAIT);
+
+        if (ready == 0 && ingest->packet_len > 0 && rbsrt_udp_ingest_send_packet(ingest) == RBSRT_FAILURE)
+        {
+            break;
+        }
+
+        if (ready == -1 && errno != EINTR)
+        {
+            DEBUG_ERROR_PRINT("udp ingest failed to wait: %s", strerror(errno));
+
+            break;
+        }
+
+        if (ready <= 0)
+        {
+            continue;
+        }
+
+        int n = rbsrt_udp_ingest_receive(ingest, lens);
+
+        if (n == -1)
+        {
+            DEBUG_ERROR_PRINT("udp ingest failed to receive: %s", strerror(errno));
+
+            break;
+        }
+
+        int num_truncated = 0;
+        int status = RBSRT_SUCCESS;
+
+        for (int i = 0; i < n && status == RBSRT_SUCCESS; i++)
+        {
+            if (lens[i] < 0)
+            {
+                num_truncated++;
+
+                continue;
+            }
+
+            status = rbsrt_udp_ingest_append(ingest, ingest->slots + (size_t)i * RBSRT_UDP_DATAGRAM_SIZE, lens[i]);
+        }
+
+        pthread_mutex_lock(&ingest->lock);
+
+        ingest->received_datagrams += n - num_truncated;
+        ingest->dropped_datagrams += num_truncated + (long)(uint32_t)(ingest->kernel_drops - kernel_drops);
+
+        pthread_mutex_unlock(&ingest->lock);
+
+        kernel_drops = ingest->kernel_drops;
+
+        if (status == RBSRT_FAILURE)
+        {
+            break;
+        }
+    }
+
+    if (ingest->packet_len > 0)
+    {
+        rbsrt_udp_ingest_send_packet(ingest);
+    }
+
+    return NULL;
+}
+
+void *rbsrt_udp_ingest_stop_without_gvl(void *context)
+{
+    rbsrt_udp_ingest_t *ingest = (rbsrt_udp_ingest_t *)context;
+
+    pthread_mutex_lock(&ingest->lock);
+
+    ingest->stopping = 1;
+
+    pthread_mutex_unlock(&ingest->lock);
+
+    pthread_join(ingest->thread, NULL);
+
+    return ingest;
+}
+
+void rbsrt_udp_ingest_release(rbsrt_udp_ingest_t *ingest)
+{
+    if (!ingest)
+    {
+        return;
+    }
+
+    if (!ingest->stopping)
+    {
+        rbsrt_udp_ingest_stop_without_gvl(ingest);
+    }
+
+    if (ingest->fd != -1)
+    {
+        close(ingest->fd);
+    }
+
+    pthread_mutex_destroy(&ingest->lock);
+
+    free(ingest->slots);
+    free(ingest);
+}
+
+// Opens a udp socket bound to address and port, joining the group when the 
+// address is a multicast address. iface selects the interface to join on.
+int rbsrt_udp_ingest_socket_open(const char *address, const char *port, const char *iface)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    int fd;
+    int yes = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int status = getaddrinfo(address[0] ? address : NULL, port, &hints, &res);
+
+    if (status != 0)
+    {
+        rb_raise(rbsrt_eStandardError, "failed to get address info: %s", gai_strerror(status));
+    }
+
+    if ((fd = socket(res->ai_family, SOCK_DGRAM, 0)) == -1)
+    {
+        freeaddrinfo(res);
+
+        rb_sys_fail("socket");
+    }
+
+    int rcvbuf = RBSRT_UDP_FORWARD_SLOTS * RBSRT_UDP_DATAGRAM_SIZE;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+#ifdef SO_RXQ_OVFL
+    setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof(yes));
+#endif
+
+    int ok = bind(fd, res->ai_addr, res->ai_addrlen) == 0;
+
+    if (ok && res->ai_family == AF_INET && IN_MULTICAST(ntohl(((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr)))
+    {
+        struct ip_mreq mreq;
+
+        mreq.imr_multiaddr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+        if (iface && inet_pton(AF_INET, iface, &mreq.imr_interface) != 1 && rbsrt_interface_address(iface, &mreq.imr_interface) == RBSRT_FAILURE)
+        {
+            errno = ENXIO;
+
+            ok = 0;
+        }
+
+        ok = ok && setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+    }
+
+    else if (ok && res->ai_family == AF_INET6 && IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr))
+    {
+        struct ipv6_mreq mreq;
+
+        mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+        mreq.ipv6mr_interface = iface ? if_nametoindex(iface) : 0;
+
+        ok = (!iface || mreq.ipv6mr_interface != 0) && setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) == 0;
+    }
+
+    freeaddrinfo(res);
+
+    if (!ok)
+    {
+        int error_code = errno;
+
+        close(fd);
+
+        rb_syserr_fail(error_code, "failed to set up udp socket");
+    }
+
+    return fd;
+}
+
+rbsrt_udp_ingest_t *rbsrt_udp_ingest_create(VALUE address, VALUE port, VALUE opts, SRTSOCKET target)
+{
+    VALUE iface = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("iface")));
+
+    address = rb_obj_as_string(address);
+    port = rb_obj_as_string(port);
+
+    if (!NIL_P(iface))
+    {
+        iface = rb_obj_as_string(iface);
+    }
+
+    int payload_size = rbsrt_socket_payload_size(target);
+
+    payload_size -= payload_size % RBSRT_TS_PACKET_SIZE;
+
+    int fd = rbsrt_udp_ingest_socket_open(StringValueCStr(address), StringValueCStr(port), NIL_P(iface) ? NULL : StringValueCStr(iface));
+
+    rbsrt_udp_ingest_t *ingest = malloc(sizeof(rbsrt_udp_ingest_t));
+
+    if (!ingest)
+    {
+        close(fd);
+
+        rb_raise(rb_eNoMemError, "failed to allocate udp ingest");
+    }
+
+    memset(ingest, 0, sizeof(rbsrt_udp_ingest_t));
+
+    ingest->fd = fd;
+    ingest->target = target;
+    ingest->payload_size = payload_size > 0 ? payload_size : RBSRT_PAYLOAD_SIZE;
+    ingest->stopping = 1; // until the thread runs
+    ingest->slots = malloc((size_t)RBSRT_UDP_FORWARD_BATCH * RBSRT_UDP_DATAGRAM_SIZE);
+
+    pthread_mutex_init(&ingest->lock, NULL);
+
+    if (!ingest->slots)
+    {
+        rbsrt_udp_ingest_release(ingest);
+
+        rb_raise(rb_eNoMemError, "failed to allocate udp ingest");
+    }
+
+    ingest->stopping = 0;
+
+    if (pthread_create(&ingest->thread, NULL, rbsrt_udp_ingest_run, ingest) != 0)
+    {
+        ingest->stopping = 1;
+
+        rbsrt_udp_ingest_release(ingest);
+
+        rb_raise(rbsrt_eStandardError, "failed to start udp ingest thread");
+    }
+
+    return ingest;
+}
+
+VALUE rbsrt_udp_ingest_stats(rbsrt_udp_ingest_t *ingest)
+{
+    VALUE stats = rb_hash_new();
+
+    pthread_mutex_lock(&ingest->lock);
+
+    long received_datagrams = ingest->received_datagrams;
+    long dropped_datagrams = ingest->dropped_datagrams;
+    long sent_messages = ingest->sent_messages;
+    long dropped_messages = ingest->dropped_messages;
+
+    pthread_mutex_unlock(&ingest->lock);
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("datagrams")), LONG2NUM(received_datagrams));
+    rb_hash_aset(stats, ID2SYM(rb_intern("dropped_datagrams")), LONG2NUM(dropped_datagrams));
+    rb_hash_aset(stats, ID2SYM(rb_intern("messages")), LONG2NUM(sent_messages));
+    rb_hash_aset(stats, ID2SYM(rb_intern("dropped_messages")), LONG2NUM(dropped_messages));
+
+    return stats;
+}
+
+// Stops an ingest and returns its totals. Raises when the client could no 
+// longer send.
+VALUE rbsrt_udp_ingest_finish(rbsrt_udp_ingest_t *ingest)
+{
+    if (!ingest->stopping)
+    {
+        rb_thread_call_without_gvl(rbsrt_udp_ingest_stop_without_gvl, ingest, NULL, NULL);
+    }
+
+    VALUE stats = rbsrt_udp_ingest_stats(ingest);
+    int error_code = ingest->error_code;
+
+    rbsrt_udp_ingest_release(ingest);
+
+    if (error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(error_code);
+    }
+
+    return stats;
+}
+
+
+// MARK: Socket Options
+
+VALUE rbsrt_socket_get_id(VALUE self)
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    return INT2FIX(socket->socket);
+}
+
+VALUE rbsrt_socket_set_rcvsyn(VALUE self, VALUE syn)
+{
+    int is_syn = RTEST(syn) ? 1 : 0;
+    
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_setsockflag(socket->socket, SRTO_RCVSYN, &is_syn, sizeof(is_syn)) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qfalse;
+    }
+
+    return Qtrue;
+}
+
+VALUE rbsrt_socket_get_rcvsyn(VALUE self)
+{
+    int is_syn = 0;
+    int is_syn_size = 0;
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_getsockflag(socket->socket, SRTO_RCVSYN, &is_syn, &is_syn_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return is_syn ? Qtrue : Qfalse;
+}
+
+VALUE rbsrt_socket_set_sndsyn(VALUE self, VALUE syn)
+{
+    int is_syn = RTEST(syn) ? 1 : 0;
+    
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_setsockflag(socket->socket, SRTO_SNDSYN, &is_syn, sizeof(is_syn)) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qfalse;
+    }
+
+    return Qtrue;
+}
+
+VALUE rbsrt_socket_get_sndsyn(VALUE self)
+{
+    int is_syn = 0;
+    int is_syn_size = 0;
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_getsockflag(socket->socket, SRTO_SNDSYN, &is_syn, &is_syn_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return is_syn ? Qtrue : Qfalse;
+}
+
+VALUE rbsrt_socket_set_streamid(VALUE self, VALUE streamid)
+{
+    Check_Type(streamid, T_STRING);
+
+    long streamid_llen = rb_str_strlen(streamid);
+
+    if (streamid_llen > 512)
+    {
+        rb_raise(rbsrt_eStandardError, "streamid must be 512 characters or less");
+
+        return Qfalse;
+    }
+
+    int streamid_len = (int)streamid_llen;
+    char *streamid_p = StringValuePtr(streamid);
+    
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_setsockflag(socket->socket, SRTO_STREAMID, streamid_p, streamid_len + 1) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qfalse;
+    }
+
+    return Qtrue; 
+}
+
+VALUE rbsrt_socket_get_streamid(VALUE self)
+{
+    char streamid[1024];
+    int streamid_len = sizeof(streamid);
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_getsockflag(socket->socket, SRTO_STREAMID, &streamid, &streamid_len) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qfalse;
+    }
+
+    if (streamid_len <= 0)
+    {
+        return Qnil;
+    }
+
+    VALUE result = rb_str_buf_new((long)streamid_len);
+    rb_str_buf_cat(result, streamid, (long)streamid_len);
+
+    return result;
+}
+
+VALUE rbsrt_socket_set_transtype(VALUE self, VALUE type)
+{
+    RBSRT_DEBUG_PRINT("socket set transmission type");
+
+    // unwrap type argument
+
+    int type_arg_type = rb_type(type);
+    int srt_transtype;
+    const char *type_name = NULL;
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    switch (type_arg_type)
+    {
+        case T_STRING:
+            type_name = StringValuePtr(type);
+            break;
+
+        case T_SYMBOL:
+            type_name = rb_id2name(SYM2ID(type));
+            break;
+
+        case T_FIXNUM:
+            if (FIX2INT(type) == SRTT_LIVE || FIX2INT(type) == SRTT_FILE)
+            {
+                srt_transtype = FIX2INT(type);
+
+                goto set_flag;
+            }
+
+            else
+            {
+                goto invalid_argument;
+            }
+
+            break;
+
+        default:
+            goto invalid_argument;
+            break;
+    }
+
+    // set option
+
+    if (strncmp(type_name, "live", 5) == 0)
+    {
+        srt_transtype = SRTT_LIVE;
+    }
+
+    else if (strncmp(type_name, "file", 5) == 0)
+    {
+        srt_transtype = SRTT_FILE;
+    }
+
+    else
+    {
+        goto invalid_argument;
+    }
+
+    set_flag:
+
+        if (srt_setsockflag(socket->socket, SRTO_TRANSTYPE, &srt_transtype, sizeof(srt_transtype)) == SRT_ERROR)
+        {
+            rbsrt_raise_last_srt_error();
+
+            return Qfalse;
+        }
+
+        rbsrt_socket_io(socket)->transtype = srt_transtype;
+
+        return Qtrue;
+
+    invalid_argument:
+        rb_raise(rb_eArgError, "transmission type must be live (:live, \"live\", %d), or file (:file, \"file\", %d)", SRTT_LIVE, SRTT_FILE);
+}
+
+
+VALUE rbsrt_socket_set_tsbpdmode(VALUE self, VALUE val)
+{
+    // timestamp-based Packet Delivery mode
+    
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    int32_t tsbpdmode = RTEST(val) ? 1 : 0;
+    int tsbpdmode_size = sizeof(tsbpdmode);
+
+    if (srt_setsockflag(socket->socket, SRTO_TSBPDMODE, &tsbpdmode, tsbpdmode_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return val;
+}
+
+VALUE rbsrt_socket_get_tsbpdmode(VALUE self)
+{
+    // timestamp-based Packet Delivery mode
+    
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    int32_t tsbpdmode;
+    int tsbpdmode_size;
+
+    if (srt_getsockflag(socket->socket, SRTO_TSBPDMODE, &tsbpdmode, &tsbpdmode_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return tsbpdmode ? Qtrue : Qfalse;
+}
+
+
+VALUE rbsrt_socket_set_payload_size(VALUE self, VALUE val)
+{
+    Check_Type(val, T_FIXNUM);
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    int payload_size = FIX2INT(val);
+
+    if (srt_setsockflag(socket->socket, SRTO_PAYLOADSIZE, &payload_size, sizeof(payload_size)) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return val;
+}
+
+VALUE rbsrt_socket_get_payload_size(VALUE self)
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    int payload_size = 0;
+    int payload_size_size = sizeof(payload_size);
+
+    if (srt_getsockflag(socket->socket, SRTO_PAYLOADSIZE, &payload_size, &payload_size_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return INT2FIX(payload_size);
+}
+
+VALUE rbsrt_socket_set_message_api(VALUE self, VALUE val)
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    int message_api = RTEST(val) ? 1 : 0;
+
+    if (srt_setsockflag(socket->socket, SRTO_MESSAGEAPI, &message_api, sizeof(message_api)) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return val;
+}
+
+VALUE rbsrt_socket_get_message_api(VALUE self)
+{
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    int message_api = 0;
+    int message_api_size = sizeof(message_api);
+
+    if (srt_getsockflag(socket->socket, SRTO_MESSAGEAPI, &message_api, &message_api_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qnil;
+    }
+
+    return message_api ? Qtrue : Qfalse;
+}
+
+
+
+#ifndef RBSRT_PASSPHRASE_MIN
+#define RBSRT_PASSPHRASE_MIN 10
+#endif
+
+#ifndef RBSRT_PASSPHRASE_MAX
+#define RBSRT_PASSPHRASE_MAX 79
+#endif
+
+VALUE rbsrt_socket_set_passphrase(VALUE self, VALUE passphrase)
+{
+    int passphrase_type = rb_type(passphrase);
+    char const *passphrase_buf;
+    int passphrase_size;
+
+    switch (passphrase_type)
+    {
+        case T_NIL:
+        passphrase_buf = NULL;
+        passphrase_size = 0;
+        break;
+
+        case T_STRING:
+        passphrase_buf = StringValuePtr(passphrase);
+
+        // long passphrase_length = rb_str_length(passphrase);
+        long passphrase_length = strnlen(passphrase_buf, RBSRT_PASSPHRASE_MAX * 2);
+        passphrase_size = (int)passphrase_length + 1;
+
+        if (passphrase_buf == 0)
+        {
+            passphrase_buf = NULL;
+            passphrase_size = 0;
+        }
+
+        else if (passphrase_length != 0 && (passphrase_length < RBSRT_PASSPHRASE_MIN || passphrase_length > RBSRT_PASSPHRASE_MAX))
+        {
+            printf("PASSPHASE: %s", passphrase_buf);
+            rb_raise(rb_eArgError, "passphrase must be between %d and %d characters or empty (got %ld)", RBSRT_PASSPHRASE_MIN, RBSRT_PASSPHRASE_MAX, passphrase_length);
+
+            return Qfalse;
+        }
+
+        
+        break;
+
+        default:
+        Check_Type(passphrase, T_STRING);
+        return Qfalse;
+        break;
+    }
+
+    RBSRT_SOCKET_BASE_UNWRAP(self, socket);
+
+    if (srt_setsockflag(socket->socket, SRTO_PASSPHRASE, passphrase_buf, passphrase_size) == SRT_ERROR)
+    {
+        rbsrt_raise_last_srt_error();
+
+        return Qfalse;
+    }
+
+    return Qtrue;
+}
+
+
+// MARK: Base Socket API
+
+void rbsrt_socket_base_define_base_api(VALUE klass)
+{
+    rb_define_method(klass, "id", rbsrt_socket_get_id, 0);
+
+    rb_define_method(klass, "read_sync=", rbsrt_socket_set_rcvsyn, 1);
+    rb_define_method(klass, "read_sync?", rbsrt_socket_get_rcvsyn, 0);
+    rb_alias(klass, rb_intern("rcvsyn="), rb_intern("read_sync="));
+    rb_alias(klass, rb_intern("rcvsyn?"), rb_intern("read_sync?"));
+
+    rb_define_method(klass, "passphrase=", rbsrt_socket_set_passphrase, 1);
+    rb_alias(klass, rb_intern("password="), rb_intern("passphrase="));
+}
+
+void rbsrt_socket_base_define_option_api(VALUE klass)
+{
+    rb_define_method(klass, "write_sync=", rbsrt_socket_set_sndsyn, 1);
+    rb_define_method(klass, "write_sync?", rbsrt_socket_get_sndsyn, 0);
+    rb_alias(klass, rb_intern("sndsyn="), rb_intern("write_sync="));
+    rb_alias(klass, rb_intern("sndsyn?"), rb_intern("write_sync?"));
+    
+    rb_define_method(klass, "streamid=", rbsrt_socket_set_streamid, 1);
+    rb_define_method(klass, "streamid", rbsrt_socket_get_streamid, 0);
+    
+    rb_define_method(klass, "transmission_mode=", rbsrt_socket_set_transtype, 1);
+    rb_alias(klass, rb_intern("trans_mode="), rb_intern("transmission_mode="));
+    rb_alias(klass, rb_intern("transtype="), rb_intern("transmission_mode="));
+
+
+    rb_define_method(klass, "timestamp_based_packet_delivery_mode=", rbsrt_socket_set_tsbpdmode, 1);
+    rb_define_method(klass, "timestamp_based_packet_delivery_mode?", rbsrt_socket_get_tsbpdmode, 0);
+    rb_alias(klass, rb_intern("tsbpdmode="), rb_intern("timestamp_based_packet_delivery_mode="));
+    rb_alias(klass, rb_intern("tsbpdmode?"), rb_intern("timestamp_based_packet_delivery_mode?"));    
+
+    rb_define_method(klass, "payload_size=", rbsrt_socket_set_payload_size, 1);
+    rb_define_method(klass, "payload_size", rbsrt_socket_get_payload_size, 0);
+    rb_alias(klass, rb_intern("payloadsize="), rb_intern("payload_size="));
+    rb_alias(klass, rb_intern("payloadsize"), rb_intern("payload_size"));
+
+    rb_define_method(klass, "message_api=", rbsrt_socket_set_message_api, 1);
+    rb_define_method(klass, "message_api?", rbsrt_socket_get_message_api, 0);
+    rb_alias(klass, rb_intern("messageapi="), rb_intern("message_api="));
+    rb_alias(klass, rb_intern("messageapi?"), rb_intern("message_api?"));
+}
+
+void rbsrt_socket_base_define_basic_api(VALUE klass)
+{
+    rb_define_method(klass, "close", rbsrt_socket_close, 0);
+}
+
+void rbsrt_socket_base_define_connection_api(VALUE klass)
+{
+    rb_define_method(klass, "connect", rbsrt_socket_connect, 2);
+}
+
+void rbsrt_socket_base_define_coalescing_api(VALUE klass)
+{
+    rb_define_method(klass, "coalesce_writes=", rbsrt_socket_set_coalesce_writes, 1);
+    rb_define_method(klass, "coalesce_writes?", rbsrt_socket_get_coalesce_writes, 0);
+    rb_define_method(klass, "coalesce_delay=", rbsrt_socket_set_coalesce_delay, 1);
+    rb_define_method(klass, "coalesce_delay", rbsrt_socket_get_coalesce_delay, 0);
+    rb_define_method(klass, "flush", rbsrt_socket_flush, 0);
+}
+
+void rbsrt_socket_base_define_io_api(VALUE klass)
+{
+    rb_define_method(klass, "recvmsg", rbsrt_socket_recvmsg, -1);
+    rb_alias(klass, rb_intern("read"), rb_intern("recvmsg"));
+    rb_define_method(klass, "read_into", rbsrt_socket_read_into, 1);
+    rb_define_method(klass, "recvmsg_batch", rbsrt_socket_recvmsg_batch, -1);
+    rb_define_method(klass, "recvmsg_nonblock", rbsrt_socket_recvmsg_nonblock, -1);
+    rb_alias(klass, rb_intern("read_nonblock"), rb_intern("recvmsg_nonblock"));
+
+    rb_define_method(klass, "sendmsg", rbsrt_socket_sendmsg, 1);
+    rb_alias(klass, rb_intern("write"), rb_intern("sendmsg"));
+    rb_define_method(klass, "sendmsg_nonblock", rbsrt_socket_sendmsg_nonblock, -1);
+    rb_alias(klass, rb_intern("write_nonblock"), rb_intern("sendmsg_nonblock"));
+    rb_define_method(klass, "sendfile", rbsrt_socket_sendfile, -1);
+    rb_define_method(klass, "recvfile", rbsrt_socket_recvfile, -1);
+
+    rbsrt_socket_base_define_coalescing_api(klass);
+}
+
+
+
+// MARK: - SRT::Socket Class
+
+size_t rbsrt_socket_dsize(const void *socket)
+{
+    RBSRT_DEBUG_PRINT("dsize srt socket");
+
+    return sizeof(rbsrt_client_t);
+}
+
+void rbsrt_socket_dmark(void *socket)
+{
+    RBSRT_DEBUG_PRINT("dmark srt socket");
+}
+
+
+// MARK: Initializers
+
+void rbsrt_socket_deallocate(rbsrt_socket_t *socket)
+{
+    RBSRT_DEBUG_PRINT("deallocate srt socket");
+
+    srt_close(socket->socket); // TODO: Check socket state before closing
+
+    rbsrt_socket_io_release(socket->io);
+
+    free(socket);
+}
+
+VALUE rbsrt_socket_allocate(VALUE klass)
+{
+    RBSRT_DEBUG_PRINT("allocate socket");
+
+    rbsrt_socket_t *socket = malloc(sizeof(rbsrt_socket_t));
+
+    memset(socket, 0, sizeof(rbsrt_socket_t));
+    
+    return TypedData_Wrap_Struct(klass, &rbsrt_socket_rbtype, socket);
+}
+
+VALUE rbsrt_socket_initialize(VALUE self)
+{
+    RBSRT_DEBUG_PRINT("initialize socket");
+
+    RBSRT_SOCKET_UNWRAP(self, socket);
+
+    socket->socket = srt_create_socket();
+
+    int livemode = SRTT_LIVE;
+
+    srt_setsockflag(socket->socket, SRTO_TRANSTYPE, &livemode, sizeof(livemode)); // set live mode
+
+    return self;
+}
+
+
+
+// MARK: - SRT::Connection Class
+
+// MARK: Ruby Type Helpers
+
+size_t rbsrt_connection_dsize(const void *server)
+{
+    RBSRT_DEBUG_PRINT("connection dsize");
+    
+    return sizeof(rbsrt_connection_t);
+}
+
+void rbsrt_connection_dmark(void *data)
+{
+    RBSRT_DEBUG_PRINT("connection mark");
+
+    rbsrt_connection_t *connection = (rbsrt_connection_t *)data;
+
+    if (connection->at_data_block)
+    {
+        rb_gc_mark(connection->at_data_block);
+    }
+
+    if (connection->at_close_block)
+    {
+        rb_gc_mark(connection->at_close_block);
+    }
+
+    if (connection->coalesced_data)
+    {
+        rb_gc_mark(connection->coalesced_data);
+    }
+
+    if (connection->dispatch_events)
+    {
+        rb_gc_mark(connection->dispatch_events);
+    }
+}
+
+
+// MARK: Send Queue
+
+// NOTE: Writes to a connection with a send queue never wait for the peer. What 
+//       srt can't take right away is queued and sent by the connection's worker 
+//       once the socket is writable. The queue is only used while holding the 
+//       gvl.
+
+void rbsrt_send_queue_drop_head(rbsrt_send_queue_t *queue)
+{
+    rbsrt_send_queue_entry_t *entry = queue->head;
+
+    queue->head = entry->next;
+
+    if (!queue->head)
+    {
+        queue->tail = NULL;
+    }
+
+    queue->num_bytes -= entry->len - entry->offset;
+
+    free(entry);
+}
+
+void rbsrt_send_queue_drop(rbsrt_send_queue_t *queue)
+{
+    queue->dropped_messages++;
+    queue->dropped_bytes += queue->head->len - queue->head->offset;
+
+    rbsrt_send_queue_drop_head(queue);
+}
+
+void rbsrt_send_queue_release(rbsrt_send_queue_t *queue)
+{
+    if (!queue)
+    {
+        return;
+    }
+
+    while (queue->head)
+    {
+        rbsrt_send_queue_drop_head(queue);
+    }
+
+    free(queue);
+}
+
+// Queues a message with room for capacity bytes, making room according to the 
+// queue's policy. Returns NULL when the message was dropped.
+rbsrt_send_queue_entry_t *rbsrt_send_queue_push(rbsrt_send_queue_t *queue, const char *buf, int len, int capacity)
+{
+    if (queue->policy == RBSRT_SEND_QUEUE_DROP_OLDEST)
+    {
+        while (queue->head && queue->num_bytes + len > queue->max_bytes)
+        {
+            rbsrt_send_queue_drop(queue);
+        }
+    }
+
+    if (queue->num_bytes + len > queue->max_bytes)
+    {
+        queue->dropped_messages++;
+        queue->dropped_bytes += len;
+
+        return NULL;
+    }
+
+    rbsrt_send_queue_entry_t *entry = malloc(sizeof(rbsrt_send_queue_entry_t) + (capacity > len ? capacity : len));
+
+    if (!entry)
+    {
+        rb_raise(rb_eNoMemError, "failed to queue message");
+    }
+
+    entry->next = NULL;
+    entry->enqueued = srt_time_now();
+    entry->len = len;
+    entry->offset = 0;
+
+    memcpy(entry->data, buf, len);
+
+    if (queue->tail)
+    {
+        queue->tail->next = entry;
+    }
+
+    else
+    {
+        queue->head = entry;
+    }
+
+    queue->tail = entry;
+    queue->num_bytes += len;
+
+    return entry;
+}
+
+void rbsrt_connection_watch_writable(rbsrt_connection_t *connection, int watch)
+{
+    rbsrt_send_queue_t *queue = connection->send_queue;
+
+    if (queue->watching == watch || connection->epollid == SRT_ERROR)
+    {
+        return;
+    }
+
+    int events = SRT_EPOLL_IN | SRT_EPOLL_ERR | (watch ? SRT_EPOLL_OUT : 0);
+
+    if (srt_epoll_update_usock(connection->epollid, connection->socket, &events) == SRT_ERROR)
+    {
+        DEBUG_ERROR_PRINT("failed to update connection events: %s", srt_getlasterror_str());
+
+        return;
+    }
+
+    queue->watching = watch;
+}
+
+// Sends queued messages until srt can't take more. Messages which waited longer 
+// than the queue's ttl are dropped instead.
+int rbsrt_connection_flush_send_queue(rbsrt_connection_t *connection)
+{
+    rbsrt_send_queue_t *queue = connection->send_queue;
+
+    if (!queue)
+    {
+        return SRT_SUCCESS;
+    }
+
+    int error_code = SRT_SUCCESS;
+    int64_t now = queue->ttl > 0 ? srt_time_now() : 0;
+
+    while (queue->head)
+    {
+        rbsrt_send_queue_entry_t *entry = queue->head;
+
+        if (queue->ttl > 0 && entry->offset == 0 && now - entry->enqueued > queue->ttl)
+        {
+            rbsrt_send_queue_drop(queue);
+
+            continue;
+        }
+
+        int nbytes = srt_sendmsg2(connection->socket, entry->data + entry->offset, entry->len - entry->offset, NULL);
+
+        if (nbytes == SRT_ERROR)
+        {
+            error_code = srt_getlasterror(NULL);
+
+            break;
+        }
+
+        entry->offset += nbytes;
+        queue->num_bytes -= nbytes;
+
+        if (entry->offset == entry->len)
+        {
+            rbsrt_send_queue_drop_head(queue);
+        }
+    }
+
+    rbsrt_connection_watch_writable(connection, queue->head != NULL);
+
+    return error_code == SRT_EASYNCSND ? SRT_SUCCESS : error_code;
+}
+
+
+// MARK: Recording
+
+// NOTE: A recorder writes everything a connection receives to a file. The 
+//       server worker copies messages into the recorder's buffer, a recorder 
+//       thread swaps it for a second buffer and writes it out once it is half 
+//       full or has waited RBSRT_RECORD_FLUSH_INTERVAL. Buffers hold whole 
+//       messages, so rotated files start at a message boundary.
+
+// Returns the path of a recording file, rotated files get their index inserted 
+// before the extension (recording.ts becomes recording-1.ts).
+char *rbsrt_recorder_file_path(rbsrt_recorder_t *recorder, int index)
+{
+    size_t len = strlen(recorder->path) + 16;
+    char *path = malloc(len);
+
+    if (!path || index == 0)
+    {
+        return path ? strcpy(path, recorder->path) : NULL;
+    }
+
+    const char *basename = strrchr(recorder->path, '/');
+    const char *extension = strrchr(basename ? basename : recorder->path, '.');
+    int stem_len = extension ? (int)(extension - recorder->path) : (int)strlen(recorder->path);
+
+    snprintf(path, len, "%.*s-%d%s", stem_len, recorder->path, index, extension ? extension : "");
+
+    return path;
+}
+
+// Opens the recording file with the given index. Returns 0 or an errno.
+int rbsrt_recorder_open(rbsrt_recorder_t *recorder, int index)
+{
+    char *path = rbsrt_recorder_file_path(recorder, index);
+
+    if (!path)
+    {
+        return ENOMEM;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int error_code = fd == -1 ? errno : 0;
+
+    RBSRT_DEBUG_PRINT("recording to %s", path);
+
+    free(path);
+
+    if (fd == -1)
+    {
+        return error_code;
+    }
+
+    if (recorder->fd != -1)
+    {
+        if (recorder->fsync_interval > 0)
+        {
+            fsync(recorder->fd);
+        }
+
+        close(recorder->fd);
+    }
+
+    recorder->fd = fd;
+    recorder->file_index = index;
+    recorder->file_bytes = 0;
+    recorder->opened_at = srt_time_now();
+
+    return 0;
+}
+
+// Writes a buffer to the recording file, rotating and syncing the file when it 
+// is due. Only called by the recorder thread. Returns 0 or an errno.
+int rbsrt_recorder_write(rbsrt_recorder_t *recorder, const char *buf, size_t len)
+{
+    int64_t now = srt_time_now();
+
+    if (recorder->path && recorder->file_bytes > 0 &&
+        ((recorder->rotate_bytes > 0 && recorder->file_bytes + (long)len > recorder->rotate_bytes) ||
+         (recorder->rotate_interval > 0 && now - recorder->opened_at >= recorder->rotate_interval)))
+    {
+        int error_code = rbsrt_recorder_open(recorder, recorder->file_index + 1);
+
+        if (error_code != 0)
+        {
+            return error_code;
+        }
+    }
+
+    while (len > 0)
+    {
+        ssize_t nbytes = write(recorder->fd, buf, len);
+
+        if (nbytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno;
+        }
+
+        buf += nbytes;
+        len -= (size_t)nbytes;
+
+        recorder->file_bytes += (long)nbytes;
+    }
+
+    if (recorder->fsync_interval > 0 && now - recorder->synced_at >= recorder->fsync_interval)
+    {
+        fsync(recorder->fd);
+
+        recorder->synced_at = now;
+    }
+
+    return 0;
+}
+
+void *rbsrt_recorder_run(void *context)
+{
+    rbsrt_recorder_t *recorder = (rbsrt_recorder_t *)context;
+
+    struct timespec deadline;
+
+    pthread_mutex_lock(&recorder->lock);
+
+    while (1)
+    {
+        if (recorder->buf_len < recorder->buf_size / 2 && !recorder->stopping)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+
+            deadline.tv_nsec += RBSRT_RECORD_FLUSH_INTERVAL * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+
+            pthread_cond_timedwait(&recorder->cond, &recorder->lock, &deadline);
+        }
+
+        if (recorder->buf_len == 0)
+        {
+            if (recorder->stopping)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        // write the filled buffer while the worker fills the other one
+
+        char *buf = recorder->buf;
+        size_t len = recorder->buf_len;
+
+        recorder->buf = recorder->write_buf;
+        recorder->write_buf = buf;
+        recorder->buf_len = 0;
+
+        pthread_mutex_unlock(&recorder->lock);
+
+        int error_code = recorder->error_code == 0 ? rbsrt_recorder_write(recorder, buf, len) : 0;
+
+        pthread_mutex_lock(&recorder->lock);
+
+        if (error_code != 0)
+        {
+            DEBUG_ERROR_PRINT("failed to record: %s", strerror(error_code));
+
+            recorder->error_code = error_code;
+        }
+
+        if (recorder->error_code == 0)
+        {
+            recorder->recorded_bytes += (long)len;
+        }
+
+        else
+        {
+            recorder->dropped_bytes += (long)len;
+        }
+    }
+
+    pthread_mutex_unlock(&recorder->lock);
+
+    // sync and close here rather than in the thread joining the recorder
+
+    if (recorder->fsync_interval > 0)
+    {
+        fsync(recorder->fd);
+    }
+
+    close(recorder->fd);
+
+    recorder->fd = -1;
+
+    return NULL;
+}
+
+// Copies a received message into the recorder's buffer. Never waits for the 
+// file, when the buffer is full the message is dropped and counted.
+void rbsrt_recorder_append(rbsrt_recorder_t *recorder, const char *buf, size_t len)
+{
+    pthread_mutex_lock(&recorder->lock);
+
+    if (recorder->buf_len + len > recorder->buf_size)
+    {
+        recorder->dropped_bytes += (long)len;
+    }
+
+    else
+    {
+        memcpy(recorder->buf + recorder->buf_len, buf, len);
+
+        recorder->buf_len += len;
+
+        if (recorder->buf_len >= recorder->buf_size / 2)
+        {
+            pthread_cond_signal(&recorder->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+// Lets the recorder thread write what is left in the buffers and stop, without 
+// waiting for it.
+void rbsrt_recorder_signal_stop(rbsrt_recorder_t *recorder)
+{
+    pthread_mutex_lock(&recorder->lock);
+
+    recorder->stopping = 1;
+
+    pthread_cond_signal(&recorder->cond);
+
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+// Writes what is left in the buffers and stops the recorder thread.
+void *rbsrt_recorder_stop_without_gvl(void *context)
+{
+    rbsrt_recorder_t *recorder = (rbsrt_recorder_t *)context;
+
+    rbsrt_recorder_signal_stop(recorder);
+
+    pthread_join(recorder->thread, NULL);
+
+    recorder->running = 0;
+
+    return recorder;
+}
+
+void rbsrt_recorder_release(rbsrt_recorder_t *recorder)
+{
+    if (!recorder)
+    {
+        return;
+    }
+
+    if (recorder->running)
+    {
+        rbsrt_recorder_stop_without_gvl(recorder);
+    }
+
+    if (recorder->fd != -1)
+    {
+        close(recorder->fd);
+    }
+
+    pthread_cond_destroy(&recorder->cond);
+    pthread_mutex_destroy(&recorder->lock);
+
+    free(recorder->buf);
+    free(recorder->write_buf);
+    free(recorder->path);
+    free(recorder);
+}
+
+// Stops recording and returns the recorder's totals. Raises when writing to 
+// the file failed.
+VALUE rbsrt_connection_stop_recorder(rbsrt_connection_t *connection)
+{
+    rbsrt_recorder_t *recorder = connection->recorder;
+
+    connection->recorder = NULL;
+
+    if (recorder->running)
+    {
+        // closing the connection only signals the recorder to stop
+
+        rb_thread_call_without_gvl(rbsrt_recorder_stop_without_gvl, recorder, NULL, NULL);
+    }
+
+    int error_code = recorder->error_code;
+    VALUE stats = rb_hash_new();
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), LONG2NUM(recorder->recorded_bytes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("dropped_bytes")), LONG2NUM(recorder->dropped_bytes));
+    // rotating recordings number their files from 1, others only use index 0
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("files")), INT2NUM(recorder->file_index > 0 ? recorder->file_index : 1));
+
+    rbsrt_recorder_release(recorder);
+
+    if (error_code != 0)
+    {
+        rb_syserr_fail(error_code, "failed to record");
+    }
+
+    return stats;
+}
+
+
+// MARK: Initializers
+
+VALUE rbsrt_connection_allocate(VALUE klass)
+{
+    RBSRT_DEBUG_PRINT("connection allocate");
+
+    rbsrt_connection_t *connection = malloc(sizeof(rbsrt_connection_t));
+
+    memset(connection, 0, sizeof(rbsrt_connection_t));
+
+    return TypedData_Wrap_Struct(klass, &rbsrt_connection_rbtype, connection);
+}
+
+void rbsrt_connection_deallocate(rbsrt_connection_t *connection)
+{
+    RBSRT_DEBUG_PRINT("connection deallocate");
+
+    rbsrt_socket_io_release(connection->io);
+
+    rbsrt_send_queue_release(connection->send_queue);
+
+    rbsrt_recorder_release(connection->recorder);
+
+    rbsrt_udp_forwarder_release(connection->udp_forwarder);
+
+    free(connection);
+}
+
+
+// MARK: API
+
+VALUE rbsrt_connection_set_at_data_block(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("connection set data block");
+
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    rb_need_block();
+
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    VALUE coalesce = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("coalesce")));
+    VALUE max_bytes = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("max_bytes")));
+    VALUE max_delay = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("max_delay")));
+
+    connection->coalesce_data = RTEST(coalesce);
+    connection->coalesce_max_bytes = NIL_P(max_bytes) ? RBSRT_COALESCE_DATA_MAX_BYTES : NUM2LONG(max_bytes);
+    connection->coalesce_max_delay = NIL_P(max_delay) ? 0 : (int64_t)NUM2INT(max_delay) * 1000;
+
+    if (connection->coalesce_max_bytes <= 0 || connection->coalesce_max_delay < 0)
+    {
+        rb_raise(rb_eArgError, "max_bytes must be positive and max_delay must not be negative");
+    }
+
+    connection->at_data_block = rb_block_proc();
+
+    return Qtrue;
+}
+
+VALUE rbsrt_connection_set_at_close_block(VALUE self)
+{
+    RBSRT_DEBUG_PRINT("connection set close block");
+
+    rb_need_block();
+
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    connection->at_close_block = rb_block_proc();
+    
+    return Qtrue;
+}
+
+VALUE rbsrt_connection_set_send_queue(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("connection set send queue");
+
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    VALUE max_bytes = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("max_bytes")));
+    VALUE ttl = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("ttl")));
+    VALUE policy = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("policy")));
+
+    long queue_max_bytes = NIL_P(max_bytes) ? RBSRT_SEND_QUEUE_MAX_BYTES : NUM2LONG(max_bytes);
+    int64_t queue_ttl = NIL_P(ttl) ? 0 : (int64_t)NUM2INT(ttl) * 1000;
+    rbsrt_send_queue_policy_t queue_policy = RBSRT_SEND_QUEUE_DROP_OLDEST;
+
+    if (queue_max_bytes <= 0 || queue_ttl < 0)
+    {
+        rb_raise(rb_eArgError, "max_bytes must be positive and ttl must not be negative");
+    }
+
+    if (policy == ID2SYM(rb_intern("drop_newest")))
+    {
+        queue_policy = RBSRT_SEND_QUEUE_DROP_NEWEST;
+    }
+
+    else if (!NIL_P(policy) && policy != ID2SYM(rb_intern("drop_oldest")))
+    {
+        rb_raise(rb_eArgError, "policy must be :drop_oldest or :drop_newest");
+    }
+
+    if (!connection->send_queue)
+    {
+        connection->send_queue = malloc(sizeof(rbsrt_send_queue_t));
+
+        if (!connection->send_queue)
+        {
+            rb_raise(rb_eNoMemError, "failed to allocate send queue");
+        }
+
+        memset(connection->send_queue, 0, sizeof(rbsrt_send_queue_t));
+    }
+
+    connection->send_queue->max_bytes = queue_max_bytes;
+    connection->send_queue->ttl = queue_ttl;
+    connection->send_queue->policy = queue_policy;
+
+    return Qtrue;
+}
+
+// Sends what srt takes right away and queues the rest. Without a send queue 
+// this is a regular sendmsg.
+VALUE rbsrt_connection_sendmsg(VALUE self, VALUE message)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    rbsrt_send_queue_t *queue = connection->send_queue;
+
+    if (!queue)
+    {
+        return rbsrt_socket_sendmsg(self, message);
+    }
+
+    VALUE parts = RB_TYPE_P(message, T_ARRAY) ? message : rb_ary_new_from_values(1, &message);
+    long total_nbytes = 0;
+
+    for (long i = 0; i < RARRAY_LEN(parts); i++)
+    {
+        VALUE part = RARRAY_AREF(parts, i);
+
+        if (!RB_TYPE_P(part, T_STRING))
+        {
+            rb_raise(rb_eArgError, "message must be a string or an array of strings");
+        }
+
+        total_nbytes += RSTRING_LEN(part);
+    }
+
+    // queued messages go first
+
+    int error_code = rbsrt_connection_flush_send_queue(connection);
+
+    if (error_code != SRT_SUCCESS)
+    {
+        rbsrt_raise_srt_error(error_code);
+    }
+
+    long skip = 0;
+
+    if (!queue->head)
+    {
+        VALUE nbytes = rbsrt_socket_send_message(self, message, 1, 0);
+
+        skip = RB_INTEGER_TYPE_P(nbytes) ? NUM2LONG(nbytes) : 0; // or :wait_writable
+    }
+
+    if (skip >= total_nbytes)
+    {
+        return LONG2NUM(total_nbytes);
+    }
+
+    // queue the rest, small parts are packed like sendmsg does
+
+    int packed = 0;
+    int payload_size = rbsrt_socket_send_size((rbsrt_socket_base_t *)connection, &packed);
+    rbsrt_send_queue_entry_t *packing = NULL;
+
+    for (long i = 0; i < RARRAY_LEN(parts); i++)
+    {
+        VALUE part = RARRAY_AREF(parts, i);
+        const char *buf = RSTRING_PTR(part);
+        long len = RSTRING_LEN(part);
+
+        if (skip >= len)
+        {
+            skip -= len;
+
+            continue;
+        }
+
+        buf += skip;
+        len -= skip;
+        skip = 0;
+
+        while (len > 0)
+        {
+            int nbytes;
+
+            if (packing && packing == queue->tail && packing->len < payload_size)
+            {
+                nbytes = payload_size - packing->len < len ? payload_size - packing->len : (int)len;
+
+                if (queue->num_bytes + nbytes <= queue->max_bytes)
+                {
+                    memcpy(packing->data + packing->len, buf, nbytes);
+
+                    packing->len += nbytes;
+                    queue->num_bytes += nbytes;
+
+                    buf += nbytes;
+                    len -= nbytes;
+
+                    continue;
+                }
+            }
+
+            nbytes = payload_size < len ? payload_size : (int)len;
+
+            packing = rbsrt_send_queue_push(queue, buf, nbytes, packed ? payload_size : nbytes);
+
+            if (!packed)
+            {
+                packing = NULL;
+            }
+
+            buf += nbytes;
+            len -= nbytes;
+        }
+    }
+
+    RB_GC_GUARD(parts);
+
+    rbsrt_connection_watch_writable(connection, queue->head != NULL);
+
+    return LONG2NUM(total_nbytes);
+}
+
+VALUE rbsrt_connection_record_to(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("connection record to");
+
+    VALUE path_or_fd, opts;
+
+    rb_scan_args(argc, argv, "1:", &path_or_fd, &opts);
+
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    VALUE buffer_size = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("buffer_size")));
+    VALUE fsync_every = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("fsync_every")));
+    VALUE rotate_bytes = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("rotate_bytes")));
+    VALUE rotate_every = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("rotate_every")));
+
+    long record_buffer_size = NIL_P(buffer_size) ? RBSRT_RECORD_BUFFER_SIZE : NUM2LONG(buffer_size);
+    int message_size = rbsrt_socket_recv_size((rbsrt_socket_base_t *)connection);
+
+    if (record_buffer_size < message_size)
+    {
+        rb_raise(rb_eArgError, "buffer_size must fit at least one message (%d bytes)", message_size);
+    }
+
+    if ((!NIL_P(fsync_every) && NUM2INT(fsync_every) <= 0) || (!NIL_P(rotate_bytes) && NUM2LONG(rotate_bytes) <= 0) || (!NIL_P(rotate_every) && NUM2INT(rotate_every) <= 0))
+    {
+        rb_raise(rb_eArgError, "fsync_every, rotate_bytes and rotate_every must be positive");
+    }
+
+    if (connection->recorder)
+    {
+        rbsrt_connection_stop_recorder(connection);
+    }
+
+    rbsrt_recorder_t *recorder = malloc(sizeof(rbsrt_recorder_t));
+
+    if (!recorder)
+    {
+        rb_raise(rb_eNoMemError, "failed to allocate recorder");
+    }
+
+    memset(recorder, 0, sizeof(rbsrt_recorder_t));
+
+    recorder->fd = -1;
+    recorder->buf_size = (size_t)record_buffer_size;
+    recorder->fsync_interval = NIL_P(fsync_every) ? 0 : (int64_t)NUM2INT(fsync_every) * 1000;
+    recorder->rotate_bytes = NIL_P(rotate_bytes) ? 0 : NUM2LONG(rotate_bytes);
+    recorder->rotate_interval = NIL_P(rotate_every) ? 0 : (int64_t)NUM2INT(rotate_every) * 1000;
+    recorder->synced_at = srt_time_now();
+    recorder->buf = malloc(recorder->buf_size);
+    recorder->write_buf = malloc(recorder->buf_size);
+
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_cond_init(&recorder->cond, NULL);
+
+    if (!recorder->buf || !recorder->write_buf)
+    {
+        rbsrt_recorder_release(recorder);
+
+        rb_raise(rb_eNoMemError, "failed to allocate recording buffers");
+    }
+
+    if (RB_INTEGER_TYPE_P(path_or_fd) || RB_TYPE_P(path_or_fd, T_FILE))
+    {
+        // the recorder writes to its own copy, ruby may close the original
+
+        int fd = NUM2INT(RB_INTEGER_TYPE_P(path_or_fd) ? path_or_fd : rb_funcall(path_or_fd, rb_intern("fileno"), 0));
+
+        if (recorder->rotate_bytes > 0 || recorder->rotate_interval > 0)
+        {
+            rbsrt_recorder_release(recorder);
+
+            rb_raise(rb_eArgError, "rotating recordings requires a path");
+        }
+
+        if (RB_TYPE_P(path_or_fd, T_FILE))
+        {
+            rb_io_flush(path_or_fd);
+        }
+
+        if ((recorder->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1)
+        {
+            rbsrt_recorder_release(recorder);
+
+            rb_sys_fail("dup");
+        }
+    }
+
+    else
+    {
+        VALUE path = rb_get_path(path_or_fd);
+        int rotates = recorder->rotate_bytes > 0 || recorder->rotate_interval > 0;
+        int error_code;
+
+        recorder->path = strdup(StringValueCStr(path));
+
+        if (!recorder->path)
+        {
+            rbsrt_recorder_release(recorder);
+
+            rb_raise(rb_eNoMemError, "failed to allocate recording path");
+        }
+
+        if ((error_code = rbsrt_recorder_open(recorder, rotates ? 1 : 0)) != 0)
+        {
+            rbsrt_recorder_release(recorder);
+
+            rb_syserr_fail_str(error_code, path);
+        }
+    }
+
+    if (pthread_create(&recorder->thread, NULL, rbsrt_recorder_run, recorder) != 0)
+    {
+        rbsrt_recorder_release(recorder);
+
+        rb_raise(rbsrt_eStandardError, "failed to start recorder thread");
+    }
+
+    recorder->running = 1;
+
+    connection->recorder = recorder;
+
+    return Qtrue;
+}
+
+VALUE rbsrt_connection_stop_recording(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    if (!connection->recorder)
+    {
+        return Qnil;
+    }
+
+    return rbsrt_connection_stop_recorder(connection);
+}
+
+VALUE rbsrt_connection_forward_udp(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("connection forward udp");
+
+    VALUE host, port, opts;
+
+    rb_scan_args(argc, argv, "2:", &host, &port, &opts);
+
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    rbsrt_udp_forwarder_t *forwarder = rbsrt_udp_forwarder_create(host, port, opts, SRT_INVALID_SOCK);
+
+    if (connection->udp_forwarder)
+    {
+        rbsrt_udp_forwarder_finish(connection->udp_forwarder);
+    }
+
+    connection->udp_forwarder = forwarder;
+
+    return Qtrue;
+}
+
+VALUE rbsrt_connection_stop_forwarding(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    rbsrt_udp_forwarder_t *forwarder = connection->udp_forwarder;
+
+    if (!forwarder)
+    {
+        return Qnil;
+    }
+
+    connection->udp_forwarder = NULL;
+
+    return rbsrt_udp_forwarder_finish(forwarder);
+}
+
+VALUE rbsrt_connection_send_queue_size(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    return LONG2NUM(connection->send_queue ? connection->send_queue->num_bytes : 0);
+}
+
+VALUE rbsrt_connection_dropped_messages(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    return LONG2NUM(connection->send_queue ? connection->send_queue->dropped_messages : 0);
+}
+
+VALUE rbsrt_connection_dropped_bytes(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    return LONG2NUM(connection->send_queue ? connection->send_queue->dropped_bytes : 0);
+}
+
+VALUE rbsrt_connection_dropped_events(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    return LONG2NUM(connection->dropped_events);
+}
+
+VALUE rbsrt_connection_idle_timeout(VALUE self)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    if (connection->idle_timeout == 0)
+    {
+        return Qnil;
+    }
+
+    return LL2NUM(connection->idle_timeout < 0 ? 0 : connection->idle_timeout);
+}
+
+void rbsrt_server_worker_reschedule_idle(VALUE rb_connection, rbsrt_connection_t *connection);
+
+VALUE rbsrt_connection_set_idle_timeout(VALUE self, VALUE timeout)
+{
+    RBSRT_CONNECTION_UNWRAP(self, connection);
+
+    // nil uses the server's idle timeout, 0 never times out
+
+    int64_t idle_timeout = NIL_P(timeout) ? 0 : NUM2LL(timeout);
+
+    if (idle_timeout < 0)
+    {
+        rb_raise(rb_eArgError, "idle_timeout must not be negative");
+    }
+
+    connection->idle_timeout = idle_timeout == 0 && !NIL_P(timeout) ? -1 : idle_timeout;
+
+    rbsrt_server_worker_reschedule_idle(self, connection);
+
+    return timeout;
+}
+
+// MARK: Connection Table
+
+// NOTE: Open addressing table with linear probing, mapping srt sockets to their 
+//       connections. It is only used while holding the gvl.
+
+#define RBSRT_CONNECTION_TABLE_MIN_CAPACITY 64
+
+size_t rbsrt_connection_table_slot(rbsrt_connection_table_t *table, SRTSOCKET socket)
+{
+    uint32_t hash = (uint32_t)socket * 2654435761u;
+
+    return (size_t)(hash ^ (hash >> 16)) & (table->capacity - 1);
+}
+
+void rbsrt_connection_table_release(rbsrt_connection_table_t *table)
+{
+    free(table->entries);
+
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+void rbsrt_connection_table_mark(rbsrt_connection_table_t *table)
+{
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        if (table->entries[i].socket != SRT_INVALID_SOCK)
+        {
+            rb_gc_mark(table->entries[i].rb_connection);
+        }
+    }
+}
+
+rbsrt_connection_table_entry_t *rbsrt_connection_table_lookup(rbsrt_connection_table_t *table, SRTSOCKET socket)
+{
+    if (table->count == 0)
+    {
+        return NULL;
+    }
+
+    for (size_t i = rbsrt_connection_table_slot(table, socket);; i = (i + 1) & (table->capacity - 1))
+    {
+        rbsrt_connection_table_entry_t *entry = &table->entries[i];
+
+        if (entry->socket == socket)
+        {
+            return entry;
+        }
+
+        if (entry->socket == SRT_INVALID_SOCK)
+        {
+            return NULL;
+        }
+    }
+}
+
+void rbsrt_connection_table_put(rbsrt_connection_table_t *table, SRTSOCKET socket, rbsrt_connection_t *connection, VALUE rb_connection)
+{
+    size_t i = rbsrt_connection_table_slot(table, socket);
+
+    while (table->entries[i].socket != SRT_INVALID_SOCK && table->entries[i].socket != socket)
+    {
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    if (table->entries[i].socket == SRT_INVALID_SOCK)
+    {
+        table->count++;
+    }
+
+    table->entries[i].socket = socket;
+    table->entries[i].connection = connection;
+    table->entries[i].rb_connection = rb_connection;
+}
+
+void rbsrt_connection_table_resize(rbsrt_connection_table_t *table, size_t capacity)
+{
+    rbsrt_connection_table_entry_t *entries = malloc(sizeof(rbsrt_connection_table_entry_t) * capacity);
+
+    if (!entries)
+    {
+        rb_raise(rb_eNoMemError, "failed to grow the connection table");
+    }
+
+    for (size_t i = 0; i < capacity; i++)
+    {
+        entries[i].socket = SRT_INVALID_SOCK;
+    }
+
+    rbsrt_connection_table_t resized = {
+        .entries = entries,
+        .capacity = capacity,
+        .count = 0
+    };
+
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        rbsrt_connection_table_entry_t *entry = &table->entries[i];
+
+        if (entry->socket != SRT_INVALID_SOCK)
+        {
+            rbsrt_connection_table_put(&resized, entry->socket, entry->connection, entry->rb_connection);
+        }
+    }
+
+    free(table->entries);
+
+    *table = resized;
+}
+
+void rbsrt_connection_table_insert(rbsrt_connection_table_t *table, SRTSOCKET socket, rbsrt_connection_t *connection, VALUE rb_connection)
+{
+    // keep the load below 3/4
+
+    if ((table->count + 1) * 4 > table->capacity * 3)
+    {
+        rbsrt_connection_table_resize(table, table->capacity ? table->capacity * 2 : RBSRT_CONNECTION_TABLE_MIN_CAPACITY);
+    }
+
+    rbsrt_connection_table_put(table, socket, connection, rb_connection);
+}
+
+// Removes the socket and returns its connection, or Qnil when the socket is not 
+// in the table.
+VALUE rbsrt_connection_table_remove(rbsrt_connection_table_t *table, SRTSOCKET socket)
+{
+    rbsrt_connection_table_entry_t *entry = rbsrt_connection_table_lookup(table, socket);
+
+    if (!entry)
+    {
+        return Qnil;
+    }
+
+    VALUE rb_connection = entry->rb_connection;
+    size_t mask = table->capacity - 1;
+    size_t hole = (size_t)(entry - table->entries);
+
+    // shift the following entries of the probe sequence back, so lookups never 
+    // stop at the removed slot
+
+    for (size_t i = (hole + 1) & mask; table->entries[i].socket != SRT_INVALID_SOCK; i = (i + 1) & mask)
+    {
+        size_t home = rbsrt_connection_table_slot(table, table->entries[i].socket);
+
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            table->entries[hole] = table->entries[i];
+
+            hole = i;
+        }
+    }
+
+    table->entries[hole].socket = SRT_INVALID_SOCK;
+    table->entries[hole].connection = NULL;
+    table->entries[hole].rb_connection = Qnil;
+    table->count--;
+
+    return rb_connection;
+}
+
+
+// MARK: - SRT::Server Class
+
+// MARK: Ruby Type Helpers
 
 size_t rbsrt_server_dsize(const void *server)
 {
-    RBSRT_DEBUG_PRINT("server dsize");
+    RBSRT_DEBUG_PRINT("server dsize");
+
+    return sizeof(rbsrt_server_t);
+}
+
+void rbsrt_server_dmark(void *data)
+{
+    RBSRT_DEBUG_PRINT("server mark");
+
+    rbsrt_server_t *server = (rbsrt_server_t *)data;
+
+    if (server->acceptor_block)
+    {
+        rb_gc_mark(server->acceptor_block);
+    }
+
+    if (server->handshake_block)
+    {
+        rb_gc_mark(server->handshake_block);
+    }
+
+    if (server->handshake_thread)
+    {
+        rb_gc_mark(server->handshake_thread);
+    }
+
+    if (server->tick_block)
+    {
+        rb_gc_mark(server->tick_block);
+    }
+
+    if (server->dispatch_queue)
+    {
+        rb_gc_mark(server->dispatch_queue);
+    }
+
+    if (server->dispatch_threads)
+    {
+        rb_gc_mark(server->dispatch_threads);
+    }
+
+    if (server->dispatch_lock)
+    {
+        rb_gc_mark(server->dispatch_lock);
+        rb_gc_mark(server->dispatch_space);
+    }
+
+    rbsrt_connection_table_mark(&server->connections);
+
+    for (int i = 0; i < server->num_workers; i++)
+    {
+        if (server->workers[i].coalescing)
+        {
+            rb_gc_mark(server->workers[i].coalescing);
+        }
+
+        if (server->workers[i].timer_slots)
+        {
+            rb_gc_mark(server->workers[i].timer_slots);
+        }
+
+        if (server->workers[i].thread)
+        {
+            rb_gc_mark(server->workers[i].thread);
+        }
+    }
+}
+
+
+// MARK: Utils
+
+#define RBSRT_SERVER_NUM_CONNECTIONS(server) (size_t)atomic_load(&server->num_connections)
+
+// Counts a new connection, fails when the server has max_connections.
+int rbsrt_server_reserve_connection(rbsrt_server_t *server)
+{
+    size_t num_connections = atomic_load(&server->num_connections);
+
+    do
+    {
+        if (server->admission.max_connections > 0 && num_connections >= (size_t)server->admission.max_connections)
+        {
+            return RBSRT_FAILURE;
+        }
+    }
+    while (!atomic_compare_exchange_weak(&server->num_connections, &num_connections, num_connections + 1));
+
+    return RBSRT_SUCCESS;
+}
+
+void rbsrt_server_release_connection(rbsrt_server_t *server)
+{
+    size_t num_connections = atomic_load(&server->num_connections);
+
+    do
+    {
+        if (num_connections == 0)
+        {
+            DEBUG_ERROR_PRINT("removed to many connections");
+
+            return;
+        }
+    }
+    while (!atomic_compare_exchange_weak(&server->num_connections, &num_connections, num_connections - 1));
+}
+
+
+// MARK: SRT
+
+// NOTE: srt calls the listen callback on its receive thread, which delivers the
+//       packets of every socket on the port and can not run ruby. Callers are 
+//       decided from native state first: the decisions set by #decide_streamid
+//       and the cache of earlier on_handshake decisions, by streamid and peer 
+//       host. Only then the callback hands the handshake to a ruby thread 
+//       started by #start, waiting at most the on_handshake timeout (a few ms 
+//       by default) for its decision, all other sockets stall meanwhile.
+
+// Finds the decision set for a streamid, or sets index to where it belongs. 
+// Called while holding the handshake lock.
+rbsrt_handshake_rule_t *rbsrt_handshake_rule(rbsrt_handshake_t *handshake, const char *streamid, long *index)
+{
+    long low = 0;
+    long high = handshake->num_rules;
+
+    while (low < high)
+    {
+        long middle = low + (high - low) / 2;
+        int order = strcmp(handshake->rules[middle].streamid, streamid);
+
+        if (order == 0)
+        {
+            *index = middle;
+
+            return &handshake->rules[middle];
+        }
+
+        if (order < 0)
+        {
+            low = middle + 1;
+        }
+
+        else
+        {
+            high = middle;
+        }
+    }
+
+    *index = low;
+
+    return NULL;
+}
+
+rbsrt_handshake_cache_entry_t *rbsrt_handshake_cache_entry(rbsrt_handshake_t *handshake, const char *streamid, const char *host)
+{
+    // fnv-1a over the streamid and the host, separated by the streamid's nul
+
+    uint32_t hash = 2166136261u;
+
+    for (const char *c = streamid; *c; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+
+    hash *= 16777619u;
+
+    for (const char *c = host; *c; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+
+    return &handshake->cache[hash % RBSRT_HANDSHAKE_CACHE_SIZE];
+}
+
+int rbsrt_server_apply_handshake_decision(SRTSOCKET remote_socket, rbsrt_handshake_decision_t *decision)
+{
+    if (!decision->accept)
+    {
+        srt_setrejectreason(remote_socket, decision->reject_reason);
+
+        return -1;
+    }
+
+    if (decision->passphrase[0] && srt_setsockflag(remote_socket, SRTO_PASSPHRASE, decision->passphrase, (int)strlen(decision->passphrase)) == SRT_ERROR)
+    {
+        DEBUG_ERROR_PRINT("failed to set the passphrase of socket %d: %s", remote_socket, srt_getlasterror_str());
+
+        srt_setrejectreason(remote_socket, SRT_REJX_ISE);
+
+        return -1;
+    }
+
+    if (decision->latency >= 0 && srt_setsockflag(remote_socket, SRTO_LATENCY, &decision->latency, sizeof(decision->latency)) == SRT_ERROR)
+    {
+        DEBUG_ERROR_PRINT("failed to set the latency of socket %d: %s", remote_socket, srt_getlasterror_str());
+
+        srt_setrejectreason(remote_socket, SRT_REJX_ISE);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// NOTE: srt calls the listen callback before the handshake is done, an admitted
+//       caller can still fail (e.g. with a wrong passphrase) and never be 
+//       accepted. So num_connections only counts accepted connections, while 
+//       admitted callers are listed by their socket until they are accepted, 
+//       srt drops their socket or RBSRT_ADMISSION_TIMEOUT passes. Callers are 
+//       admitted while both together stay below max_connections.
+
+// Drops callers whose handshake failed or which were not accepted in time, 
+// called while holding the admission lock.
+void rbsrt_admission_prune(rbsrt_admission_t *admission, int64_t now)
+{
+    for (long i = 0; i < admission->num_callers;)
+    {
+        rbsrt_admitted_caller_t *caller = &admission->callers[i];
+
+        if (caller->expires > now && srt_getsockstate(caller->socket) < SRTS_BROKEN)
+        {
+            i++;
+
+            continue;
+        }
+
+        RBSRT_DEBUG_PRINT("admitted caller %d is gone", caller->socket);
+
+        *caller = admission->callers[--admission->num_callers];
+    }
+}
+
+// Lists an admitted caller, called while holding the admission lock.
+int rbsrt_admission_add(rbsrt_admission_t *admission, SRTSOCKET socket, int64_t now)
+{
+    if (admission->num_callers == admission->callers_capacity)
+    {
+        long capacity = admission->callers_capacity ? admission->callers_capacity * 2 : 16;
+        rbsrt_admitted_caller_t *callers = realloc(admission->callers, capacity * sizeof(rbsrt_admitted_caller_t));
+
+        if (!callers)
+        {
+            return RBSRT_FAILURE;
+        }
+
+        admission->callers = callers;
+        admission->callers_capacity = capacity;
+    }
+
+    admission->callers[admission->num_callers].socket = socket;
+    admission->callers[admission->num_callers].expires = now + (int64_t)RBSRT_ADMISSION_TIMEOUT * 1000;
+    admission->num_callers++;
+
+    return RBSRT_SUCCESS;
+}
+
+// Removes a caller once it is accepted or rejected, returns 1 when it was listed.
+int rbsrt_server_forget_caller(rbsrt_server_t *server, SRTSOCKET socket)
+{
+    rbsrt_admission_t *admission = &server->admission;
+    int found = 0;
+
+    pthread_mutex_lock(&admission->lock);
+
+    for (long i = 0; i < admission->num_callers; i++)
+    {
+        if (admission->callers[i].socket == socket)
+        {
+            admission->callers[i] = admission->callers[--admission->num_callers];
+
+            found = 1;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&admission->lock);
+
+    return found;
+}
+
+// Decides if a caller may connect before srt accepts it, returns a reject 
+// reason or 0 when the caller is admitted. The rate is limited with a token 
+// bucket which holds at most a second worth of connections.
+int rbsrt_server_admit(rbsrt_server_t *server, SRTSOCKET remote_socket)
+{
+    rbsrt_admission_t *admission = &server->admission;
+    int reject_reason = 0;
+    int64_t now = srt_time_now();
+
+    pthread_mutex_lock(&admission->lock);
+
+    if (admission->max_connections > 0)
+    {
+        rbsrt_admission_prune(admission, now);
+    }
+
+    if (admission->max_connections > 0 && RBSRT_SERVER_NUM_CONNECTIONS(server) + (size_t)admission->num_callers >= (size_t)admission->max_connections)
+    {
+        admission->rejected_max_connections++;
+
+        reject_reason = SRT_REJX_DOWN;
+    }
+
+    else if (admission->max_accept_rate > 0)
+    {
+        double burst = admission->max_accept_rate < 1 ? 1 : admission->max_accept_rate;
+
+        admission->tokens += (double)(now - admission->refilled) / 1000000.0 * admission->max_accept_rate;
+        admission->refilled = now;
+
+        if (admission->tokens > burst)
+        {
+            admission->tokens = burst;
+        }
+
+        if (admission->tokens < 1)
+        {
+            admission->rejected_max_accept_rate++;
+
+            reject_reason = SRT_REJX_OVERLOAD;
+        }
+
+        else
+        {
+            admission->tokens -= 1;
+        }
+    }
+
+    if (!reject_reason && admission->max_connections > 0 && rbsrt_admission_add(admission, remote_socket, now) == RBSRT_FAILURE)
+    {
+        DEBUG_ERROR_PRINT("failed to list admitted caller %d", remote_socket);
+
+        reject_reason = SRT_REJX_ISE;
+    }
+
+    pthread_mutex_unlock(&admission->lock);
+
+    return reject_reason;
+}
+
+// Runs the handshake block for an admitted caller, returns -1 when it is 
+// rejected.
+int rbsrt_server_decide_handshake(rbsrt_server_t *server, SRTSOCKET remote_socket, const struct sockaddr* peeraddr, const char* streamid)
+{
+    rbsrt_handshake_t *handshake = server->handshake;
+
+    if (!handshake)
+    {
+        return 0;
+    }
+
+    const char *key = streamid ? streamid : "";
+    char host[INET6_ADDRSTRLEN] = "";
+    char peer[INET6_ADDRSTRLEN + 8] = "";
+    rbsrt_handshake_decision_t decision;
+    struct timespec deadline;
+
+    if (peeraddr)
+    {
+        char port[8];
+        socklen_t peeraddr_len = peeraddr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+        if (getnameinfo(peeraddr, peeraddr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        {
+            snprintf(peer, sizeof(peer), peeraddr->sa_family == AF_INET6 ? "[%s]:%s" : "%s:%s", host, port);
+        }
+
+        else
+        {
+            host[0] = '\0';
+        }
+    }
+
+    long rule_index;
+
+    pthread_mutex_lock(&handshake->lock);
+
+    rbsrt_handshake_rule_t *rule = rbsrt_handshake_rule(handshake, key, &rule_index);
+
+    if (rule)
+    {
+        decision = rule->decision;
+
+        pthread_mutex_unlock(&handshake->lock);
+
+        return rbsrt_server_apply_handshake_decision(remote_socket, &decision);
+    }
+
+    if (!handshake->running)
+    {
+        // no on_handshake block or the server is not started, leave it to the acceptor block
+
+        pthread_mutex_unlock(&handshake->lock);
+
+        return 0;
+    }
+
+    rbsrt_handshake_cache_entry_t *cached = rbsrt_handshake_cache_entry(handshake, key, host);
+
+    if (cached->expires > srt_time_now() && strcmp(cached->streamid, key) == 0 && strcmp(cached->host, host) == 0)
+    {
+        RBSRT_DEBUG_PRINT("cached handshake decision for streamid %s from %s", key, host);
+
+        decision = cached->decision;
+
+        pthread_mutex_unlock(&handshake->lock);
+
+        return rbsrt_server_apply_handshake_decision(remote_socket, &decision);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec += handshake->timeout / 1000;
+    deadline.tv_nsec += (long)(handshake->timeout % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int timed_out = 0;
+
+    while (handshake->state != RBSRT_HANDSHAKE_IDLE && !timed_out)
+    {
+        timed_out = pthread_cond_timedwait(&handshake->cond, &handshake->lock, &deadline) != 0;
+    }
+
+    if (!timed_out)
+    {
+        snprintf(handshake->streamid, sizeof(handshake->streamid), "%s", key);
+
+        memcpy(handshake->peer, peer, sizeof(handshake->peer));
+        memcpy(handshake->host, host, sizeof(handshake->host));
+
+        handshake->state = RBSRT_HANDSHAKE_PENDING;
+
+        pthread_cond_broadcast(&handshake->cond);
+
+        while (handshake->state != RBSRT_HANDSHAKE_DECIDED && !timed_out)
+        {
+            timed_out = pthread_cond_timedwait(&handshake->cond, &handshake->lock, &deadline) != 0;
+        }
+
+        if (handshake->state == RBSRT_HANDSHAKE_DECIDED)
+        {
+            timed_out = 0;
+            decision = handshake->decision;
+            handshake->state = RBSRT_HANDSHAKE_IDLE;
+        }
+
+        else if (handshake->state == RBSRT_HANDSHAKE_TAKEN)
+        {
+            // the ruby thread drops the decision when it is done
+
+            handshake->state = RBSRT_HANDSHAKE_ABANDONED;
+        }
+
+        else
+        {
+            handshake->state = RBSRT_HANDSHAKE_IDLE;
+        }
+
+        pthread_cond_broadcast(&handshake->cond);
+    }
+
+    pthread_mutex_unlock(&handshake->lock);
+
+    if (timed_out)
+    {
+        DEBUG_ERROR_PRINT("handshake for streamid %s timed out", key);
+
+        srt_setrejectreason(remote_socket, SRT_REJX_OVERLOAD);
+
+        return -1;
+    }
+
+    return rbsrt_server_apply_handshake_decision(remote_socket, &decision);
+}
+
+int rbsrt_server_listen_callback(void* context, SRTSOCKET remote_socket, int hs_version, const struct sockaddr* peeraddr, const char* streamid)
+{
+    rbsrt_server_t *server = (rbsrt_server_t *)context;
+    int reject_reason = rbsrt_server_admit(server, remote_socket);
+
+    if (reject_reason)
+    {
+        RBSRT_DEBUG_PRINT("rejecting caller with reason %d", reject_reason);
+
+        srt_setrejectreason(remote_socket, reject_reason);
+
+        return -1;
+    }
+
+    if (rbsrt_server_decide_handshake(server, remote_socket, peeraddr, streamid) == -1)
+    {
+        rbsrt_server_forget_caller(server, remote_socket);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+typedef struct RBSRTHandshakeWaitArg
+{
+    rbsrt_handshake_t *handshake;
+    char streamid[RBSRT_STREAMID_MAX + 1];
+    char peer[INET6_ADDRSTRLEN + 8];
+    char host[INET6_ADDRSTRLEN];
+    int taken;
+} rbsrt_handshake_wait_arg_t;
+
+void *rbsrt_server_handshake_wait_without_gvl(void *context)
+{
+    rbsrt_handshake_wait_arg_t *arg = (rbsrt_handshake_wait_arg_t *)context;
+    rbsrt_handshake_t *handshake = arg->handshake;
+
+    pthread_mutex_lock(&handshake->lock);
+
+    while (handshake->state != RBSRT_HANDSHAKE_PENDING && !handshake->interrupted)
+    {
+        pthread_cond_wait(&handshake->cond, &handshake->lock);
+    }
+
+    if (handshake->state == RBSRT_HANDSHAKE_PENDING)
+    {
+        memcpy(arg->streamid, handshake->streamid, sizeof(arg->streamid));
+        memcpy(arg->peer, handshake->peer, sizeof(arg->peer));
+        memcpy(arg->host, handshake->host, sizeof(arg->host));
+
+        handshake->state = RBSRT_HANDSHAKE_TAKEN;
+
+        arg->taken = 1;
+    }
+
+    handshake->interrupted = 0;
+
+    pthread_mutex_unlock(&handshake->lock);
+
+    return arg;
+}
+
+void rbsrt_server_handshake_interrupt(void *context)
+{
+    rbsrt_handshake_t *handshake = (rbsrt_handshake_t *)context;
+
+    pthread_mutex_lock(&handshake->lock);
+
+    handshake->interrupted = 1;
+
+    pthread_cond_broadcast(&handshake->cond);
+
+    pthread_mutex_unlock(&handshake->lock);
+}
+
+VALUE rbsrt_server_call_handshake_block(VALUE context)
+{
+    VALUE *args = (VALUE *)context;
+
+    return rb_funcall(args[0], rb_intern("call"), 2, args[1], args[2]);
+}
+
+// Turns the value returned by the on_handshake block into a decision. true or a 
+// hash accepts the caller, a hash can set :passphrase and :latency, or :reject 
+// with a reason. false or nil rejects with SRT_REJX_FORBIDDEN, an integer 
+// rejects with that reason.
+void rbsrt_server_handshake_decision(VALUE result, rbsrt_handshake_decision_t *decision)
+{
+    memset(decision, 0, sizeof(rbsrt_handshake_decision_t));
+
+    decision->latency = -1;
+
+    if (FIXNUM_P(result))
+    {
+        decision->reject_reason = FIX2INT(result);
+
+        return;
+    }
+
+    if (!RTEST(result))
+    {
+        decision->reject_reason = SRT_REJX_FORBIDDEN;
+
+        return;
+    }
+
+    decision->accept = 1;
+
+    if (!RB_TYPE_P(result, T_HASH))
+    {
+        return;
+    }
+
+    VALUE reject = rb_hash_aref(result, ID2SYM(rb_intern("reject")));
+    VALUE passphrase = rb_hash_aref(result, ID2SYM(rb_intern("passphrase")));
+    VALUE latency = rb_hash_aref(result, ID2SYM(rb_intern("latency")));
+
+    if (RTEST(reject))
+    {
+        decision->accept = 0;
+        decision->reject_reason = FIXNUM_P(reject) ? FIX2INT(reject) : SRT_REJX_FORBIDDEN;
+
+        return;
+    }
+
+    if (RB_TYPE_P(passphrase, T_STRING))
+    {
+        if (RSTRING_LEN(passphrase) >= RBSRT_HANDSHAKE_PASSPHRASE_SIZE)
+        {
+            decision->accept = 0;
+            decision->reject_reason = SRT_REJX_ISE;
+
+            return;
+        }
+
+        memcpy(decision->passphrase, RSTRING_PTR(passphrase), RSTRING_LEN(passphrase));
+    }
+
+    if (FIXNUM_P(latency))
+    {
+        decision->latency = FIX2INT(latency);
+    }
+}
+
+VALUE rbsrt_server_handshake_thread(void *context)
+{
+    rbsrt_server_t *server = (rbsrt_server_t *)context;
+    rbsrt_handshake_t *handshake = server->handshake;
+
+    while (1)
+    {
+        rbsrt_handshake_wait_arg_t arg = { .handshake = handshake, .taken = 0 };
+
+        rb_thread_call_without_gvl(rbsrt_server_handshake_wait_without_gvl, &arg, rbsrt_server_handshake_interrupt, handshake);
+
+        if (!arg.taken)
+        {
+            continue;
+        }
+
+        VALUE args[3] = { server->handshake_block, rb_str_new_cstr(arg.streamid), rb_str_new_cstr(arg.peer) };
+        int exception = 0;
+        rbsrt_handshake_decision_t decision;
+
+        VALUE result = rb_protect(rbsrt_server_call_handshake_block, (VALUE)args, &exception);
+
+        if (exception)
+        {
+            rb_warn("on_handshake raised %"PRIsVALUE", rejecting streamid %s", rb_errinfo(), arg.streamid);
+
+            rb_set_errinfo(Qnil);
+
+            memset(&decision, 0, sizeof(decision));
+
+            decision.reject_reason = SRT_REJX_ISE;
+            decision.latency = -1;
+        }
+
+        else
+        {
+            rbsrt_server_handshake_decision(result, &decision);
+        }
+
+        pthread_mutex_lock(&handshake->lock);
+
+        if (handshake->cache_ttl > 0 && !exception)
+        {
+            rbsrt_handshake_cache_entry_t *cached = rbsrt_handshake_cache_entry(handshake, arg.streamid, arg.host);
+
+            memcpy(cached->streamid, arg.streamid, sizeof(cached->streamid));
+            memcpy(cached->host, arg.host, sizeof(cached->host));
+
+            cached->decision = decision;
+            cached->expires = srt_time_now() + handshake->cache_ttl;
+        }
+
+        if (handshake->state == RBSRT_HANDSHAKE_TAKEN)
+        {
+            handshake->decision = decision;
+            handshake->state = RBSRT_HANDSHAKE_DECIDED;
+        }
+
+        else
+        {
+            handshake->state = RBSRT_HANDSHAKE_IDLE;
+        }
+
+        pthread_cond_broadcast(&handshake->cond);
+
+        pthread_mutex_unlock(&handshake->lock);
+
+        RB_GC_GUARD(args[1]);
+        RB_GC_GUARD(args[2]);
+    }
+
+    return Qnil;
+}
+
+void rbsrt_server_set_handshake_running(rbsrt_server_t *server, int running)
+{
+    if (!server->handshake)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&server->handshake->lock);
+
+    server->handshake->running = running;
+
+    if (running)
+    {
+        // a killed handshake thread can leave a request behind
+
+        server->handshake->state = RBSRT_HANDSHAKE_IDLE;
+    }
+
+    pthread_cond_broadcast(&server->handshake->cond);
+
+    pthread_mutex_unlock(&server->handshake->lock);
+}
+
+void rbsrt_server_handshake_release(rbsrt_handshake_t *handshake)
+{
+    if (!handshake)
+    {
+        return;
+    }
+
+    pthread_cond_destroy(&handshake->cond);
+    pthread_mutex_destroy(&handshake->lock);
+
+    free(handshake->rules);
+
+    free(handshake);
+}
+
+// The handshake state of the server, created by the first #on_handshake or 
+// #decide_streamid.
+rbsrt_handshake_t *rbsrt_server_handshake(rbsrt_server_t *server)
+{
+    if (!server->handshake)
+    {
+        server->handshake = malloc(sizeof(rbsrt_handshake_t));
+
+        memset(server->handshake, 0, sizeof(rbsrt_handshake_t));
+
+        pthread_mutex_init(&server->handshake->lock, NULL);
+        pthread_cond_init(&server->handshake->cond, NULL);
+
+        server->handshake->timeout = RBSRT_HANDSHAKE_TIMEOUT;
+    }
+
+    return server->handshake;
+}
+
+VALUE rbsrt_server_set_handshake_block(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("server set handshake block");
+
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    rb_need_block();
+
+    RBSRT_SERVER_UNWRAP(self, server);
+
+    VALUE cache_ttl = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("cache_ttl")));
+    VALUE timeout = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("timeout")));
+
+    if (server->workers)
+    {
+        rb_raise(rbsrt_eStandardError, "on_handshake must be set before the server is started");
+    }
+
+    if (!NIL_P(cache_ttl) && NUM2INT(cache_ttl) < 0)
+    {
+        rb_raise(rb_eArgError, "cache_ttl must not be negative");
+    }
+
+    if (!NIL_P(timeout) && NUM2INT(timeout) < 0)
+    {
+        rb_raise(rb_eArgError, "timeout must not be negative");
+    }
+
+    rbsrt_handshake_t *handshake = rbsrt_server_handshake(server);
+
+    pthread_mutex_lock(&handshake->lock);
+
+    handshake->cache_ttl = NIL_P(cache_ttl) ? 0 : (int64_t)NUM2INT(cache_ttl) * 1000;
+    handshake->timeout = NIL_P(timeout) ? RBSRT_HANDSHAKE_TIMEOUT : NUM2INT(timeout);
+
+    memset(handshake->cache, 0, sizeof(handshake->cache));
+
+    pthread_mutex_unlock(&handshake->lock);
+
+    server->handshake_block = rb_block_proc();
+
+    return Qtrue;
+}
+
+// Sets how callers with the streamid are decided without calling into ruby, 
+// with the values the on_handshake block returns. nil removes the decision.
+VALUE rbsrt_server_decide_streamid(VALUE self, VALUE streamid, VALUE result)
+{
+    RBSRT_SERVER_UNWRAP(self, server);
+
+    const char *key = StringValueCStr(streamid);
+
+    if (RSTRING_LEN(streamid) > RBSRT_STREAMID_MAX)
+    {
+        rb_raise(rb_eArgError, "streamid must be at most %d characters", RBSRT_STREAMID_MAX);
+    }
+
+    rbsrt_handshake_decision_t decision;
+
+    rbsrt_server_handshake_decision(result, &decision);
+
+    rbsrt_handshake_t *handshake = rbsrt_server_handshake(server);
+    long index;
+
+    pthread_mutex_lock(&handshake->lock);
+
+    rbsrt_handshake_rule_t *rule = rbsrt_handshake_rule(handshake, key, &index);
+
+    if (NIL_P(result))
+    {
+        if (rule)
+        {
+            memmove(rule, rule + 1, (handshake->num_rules - index - 1) * sizeof(rbsrt_handshake_rule_t));
+
+            handshake->num_rules--;
+        }
+    }
+
+    else if (rule)
+    {
+        rule->decision = decision;
+    }
+
+    else
+    {
+        if (handshake->num_rules == handshake->rules_capacity)
+        {
+            long capacity = handshake->rules_capacity ? handshake->rules_capacity * 2 : 16;
+            rbsrt_handshake_rule_t *rules = realloc(handshake->rules, capacity * sizeof(rbsrt_handshake_rule_t));
+
+            if (!rules)
+            {
+                pthread_mutex_unlock(&handshake->lock);
+
+                rb_raise(rb_eNoMemError, "failed to add a handshake decision");
+            }
+
+            handshake->rules = rules;
+            handshake->rules_capacity = capacity;
+        }
+
+        rule = &handshake->rules[index];
+
+        memmove(rule + 1, rule, (handshake->num_rules - index) * sizeof(rbsrt_handshake_rule_t));
+
+        memset(rule->streamid, 0, sizeof(rule->streamid));
+        memcpy(rule->streamid, key, RSTRING_LEN(streamid));
+
+        rule->decision = decision;
+
+        handshake->num_rules++;
+    }
+
+    pthread_mutex_unlock(&handshake->lock);
+
+    return result;
+}
+
+
+// MARK: Relay
+
+// NOTE: In relay mode connections publishing a resource (m=publish) have every 
+//       message they send forwarded to the connections requesting the same 
+//       resource (m=request). Workers forward right after reading, without the 
+//       gvl and without creating ruby strings. Channels are kept in a small 
+//       array guarded by the relay lock, a relay serves few resources. Workers
+//       find the channel of a publisher in a table rebuilt whenever publishers
+//       come and go, and send to a copy of its subscribers after releasing the
+//       lock, so a slow subscriber does not hold up other workers.
+
+#ifndef RBSRT_RELAY_FORWARD_SUBSCRIBERS
+#define RBSRT_RELAY_FORWARD_SUBSCRIBERS 64 // subscribers copied on the stack when forwarding, more are copied to the heap
+#endif
+
+rbsrt_relay_t *rbsrt_relay_create()
+{
+    rbsrt_relay_t *relay = malloc(sizeof(rbsrt_relay_t));
+
+    if (!relay)
+    {
+        rb_raise(rb_eNoMemError, "failed to allocate relay");
+    }
+
+    memset(relay, 0, sizeof(rbsrt_relay_t));
+
+    pthread_mutex_init(&relay->lock, NULL);
+
+    return relay;
+}
+
+void rbsrt_relay_release(rbsrt_relay_t *relay)
+{
+    if (!relay)
+    {
+        return;
+    }
+
+    for (int i = 0; i < relay->num_channels; i++)
+    {
+        free(relay->channels[i].subscribers);
+    }
+
+    free(relay->channels);
+    free(relay->publishers);
+
+    pthread_mutex_destroy(&relay->lock);
+
+    free(relay);
+}
+
+// Returns the channel of a resource, creating it when create is set. Must be 
+// called while holding the relay lock.
+rbsrt_relay_channel_t *rbsrt_relay_channel(rbsrt_relay_t *relay, const char *resource_name, int create)
+{
+    for (int i = 0; i < relay->num_channels; i++)
+    {
+        if (strcmp(relay->channels[i].resource_name, resource_name) == 0)
+        {
+            return &relay->channels[i];
+        }
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    if (relay->num_channels == relay->max_channels)
+    {
+        int max_channels = relay->max_channels ? relay->max_channels * 2 : 8;
+        rbsrt_relay_channel_t *channels = realloc(relay->channels, sizeof(rbsrt_relay_channel_t) * max_channels);
+
+        if (!channels)
+        {
+            return NULL;
+        }
+
+        relay->channels = channels;
+        relay->max_channels = max_channels;
+    }
+
+    rbsrt_relay_channel_t *channel = &relay->channels[relay->num_channels++];
+
+    memset(channel, 0, sizeof(rbsrt_relay_channel_t));
+
+    strncpy(channel->resource_name, resource_name, RBSRT_STREAMID_MAX);
+
+    channel->publisher = SRT_INVALID_SOCK;
+
+    return channel;
+}
+
+// Rebuilds the table of channels by publisher, channels move when one is 
+// removed. Without memory for the table the channels are scanned instead. Must 
+// be called while holding the relay lock.
+void rbsrt_relay_index_publishers(rbsrt_relay_t *relay)
+{
+    size_t capacity = 16;
+
+    while (capacity < (size_t)relay->num_channels * 2)
+    {
+        capacity *= 2;
+    }
+
+    if (capacity != relay->publishers_capacity)
+    {
+        free(relay->publishers);
+
+        relay->publishers = malloc(sizeof(rbsrt_relay_publisher_t) * capacity);
+        relay->publishers_capacity = relay->publishers ? capacity : 0;
+    }
+
+    if (!relay->publishers)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < capacity; i++)
+    {
+        relay->publishers[i].socket = SRT_INVALID_SOCK;
+    }
+
+    for (int i = 0; i < relay->num_channels; i++)
+    {
+        SRTSOCKET publisher = relay->channels[i].publisher;
+
+        if (publisher == SRT_INVALID_SOCK)
+        {
+            continue;
+        }
+
+        size_t j = (size_t)publisher & (capacity - 1);
+
+        while (relay->publishers[j].socket != SRT_INVALID_SOCK)
+        {
+            j = (j + 1) & (capacity - 1);
+        }
+
+        relay->publishers[j].socket = publisher;
+        relay->publishers[j].channel = i;
+    }
+}
+
+// Returns the channel published by socket, or NULL. Must be called while 
+// holding the relay lock.
+rbsrt_relay_channel_t *rbsrt_relay_publisher_channel(rbsrt_relay_t *relay, SRTSOCKET socket)
+{
+    if (!relay->publishers)
+    {
+        for (int i = 0; i < relay->num_channels; i++)
+        {
+            if (relay->channels[i].publisher == socket)
+            {
+                return &relay->channels[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    for (size_t i = (size_t)socket & (relay->publishers_capacity - 1);; i = (i + 1) & (relay->publishers_capacity - 1))
+    {
+        if (relay->publishers[i].socket == SRT_INVALID_SOCK)
+        {
+            return NULL;
+        }
+
+        if (relay->publishers[i].socket == socket)
+        {
+            return &relay->channels[relay->publishers[i].channel];
+        }
+    }
+}
+
+int rbsrt_relay_add_subscriber(rbsrt_relay_channel_t *channel, SRTSOCKET socket)
+{
+    if (channel->num_subscribers == channel->max_subscribers)
+    {
+        int max_subscribers = channel->max_subscribers ? channel->max_subscribers * 2 : 8;
+        SRTSOCKET *subscribers = realloc(channel->subscribers, sizeof(SRTSOCKET) * max_subscribers);
+
+        if (!subscribers)
+        {
+            return RBSRT_FAILURE;
+        }
+
+        channel->subscribers = subscribers;
+        channel->max_subscribers = max_subscribers;
+    }
+
+    channel->subscribers[channel->num_subscribers++] = socket;
+
+    return RBSRT_SUCCESS;
+}
+
+// Attaches a socket to the channel of resource_name. A resource has a single 
+// publisher, a second one is refused.
+int rbsrt_relay_attach(rbsrt_relay_t *relay, SRTSOCKET socket, const char *resource_name, int publisher)
+{
+    int status = RBSRT_FAILURE;
+
+    pthread_mutex_lock(&relay->lock);
+
+    rbsrt_relay_channel_t *channel = rbsrt_relay_channel(relay, resource_name, 1);
+
+    if (channel && publisher && channel->publisher == SRT_INVALID_SOCK)
+    {
+        channel->publisher = socket;
+
+        rbsrt_relay_index_publishers(relay);
+
+        status = RBSRT_SUCCESS;
+    }
+
+    else if (channel && !publisher)
+    {
+        status = rbsrt_relay_add_subscriber(channel, socket);
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+
+    return status;
+}
+
+void rbsrt_relay_detach(rbsrt_relay_t *relay, SRTSOCKET socket)
+{
+    pthread_mutex_lock(&relay->lock);
+
+    for (int i = 0; i < relay->num_channels; i++)
+    {
+        rbsrt_relay_channel_t *channel = &relay->channels[i];
+
+        if (channel->publisher == socket)
+        {
+            channel->publisher = SRT_INVALID_SOCK;
+        }
+
+        for (int j = 0; j < channel->num_subscribers; j++)
+        {
+            if (channel->subscribers[j] == socket)
+            {
+                channel->subscribers[j--] = channel->subscribers[--channel->num_subscribers];
+            }
+        }
+
+        if (channel->publisher == SRT_INVALID_SOCK && channel->num_subscribers == 0)
+        {
+            // channels are unordered, move the last one into the gap
+
+            free(channel->subscribers);
+
+            *channel = relay->channels[--relay->num_channels];
+
+            i--;
+        }
+    }
+
+    rbsrt_relay_index_publishers(relay);
+
+    pthread_mutex_unlock(&relay->lock);
+}
+
+// Sends a message read from socket to the subscribers of the resource it 
+// publishes. Subscribers which can't take the message right away miss it, as 
+// do subscribers which leave while it is sent.
+void rbsrt_relay_forward(rbsrt_relay_t *relay, SRTSOCKET socket, const char *buf, int len)
+{
+    SRTSOCKET stack_subscribers[RBSRT_RELAY_FORWARD_SUBSCRIBERS];
+    SRTSOCKET *subscribers = stack_subscribers;
+    int num_subscribers = 0;
+    int num_dropped = 0;
+
+    pthread_mutex_lock(&relay->lock);
+
+    rbsrt_relay_channel_t *channel = rbsrt_relay_publisher_channel(relay, socket);
+
+    if (channel)
+    {
+        num_subscribers = channel->num_subscribers;
+
+        if (num_subscribers > RBSRT_RELAY_FORWARD_SUBSCRIBERS)
+        {
+            subscribers = malloc(sizeof(SRTSOCKET) * num_subscribers);
+        }
+
+        if (subscribers)
+        {
+            memcpy(subscribers, channel->subscribers, sizeof(SRTSOCKET) * num_subscribers);
+        }
+
+        else
+        {
+            num_dropped = num_subscribers;
+            num_subscribers = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+
+    if (!channel)
+    {
+        return;
+    }
+
+    for (int i = 0; i < num_subscribers; i++)
+    {
+        if (srt_sendmsg2(subscribers[i], buf, len, NULL) == SRT_ERROR)
+        {
+            num_dropped++;
+        }
+    }
+
+    if (subscribers != stack_subscribers)
+    {
+        free(subscribers);
+    }
+
+    // the channel may have moved or gone while sending, look it up again
+
+    pthread_mutex_lock(&relay->lock);
+
+    if ((channel = rbsrt_relay_publisher_channel(relay, socket)))
+    {
+        channel->forwarded_messages++;
+        channel->dropped_messages += num_dropped;
+    }
+
+    pthread_mutex_unlock(&relay->lock);
+}
+
+// Attaches a new connection by the resource name and mode of its streamid. 
+// Connections with another mode are not relayed.
+int rbsrt_server_relay_attach(rbsrt_server_t *server, VALUE rb_connection, SRTSOCKET socket)
+{
+    VALUE streamid = rb_funcall(rb_connection, rb_intern("streamid"), 0);
+    VALUE components = rb_class_new_instance(1, &streamid, rb_const_get(mSRTModule, rb_intern("StreamIDComponents")));
+    VALUE resource_name = rb_funcall(components, rb_intern("resource_name"), 0);
+    VALUE mode = rb_funcall(components, rb_intern("mode"), 0);
+
+    resource_name = NIL_P(resource_name) ? rb_str_new_cstr("") : rb_obj_as_string(resource_name);
+
+    if (mode == ID2SYM(rb_intern("publish")))
+    {
+        return rbsrt_relay_attach(server->relay, socket, StringValueCStr(resource_name), 1);
+    }
+
+    else if (mode == ID2SYM(rb_intern("request")))
+    {
+        return rbsrt_relay_attach(server->relay, socket, StringValueCStr(resource_name), 0);
+    }
+
+    return RBSRT_SUCCESS;
+}
+
+VALUE rbsrt_server_relay_channels(VALUE self)
+{
+    RBSRT_SERVER_UNWRAP(self, server);
+
+    VALUE channels = rb_hash_new();
+
+    if (!server->relay)
+    {
+        return channels;
+    }
+
+    pthread_mutex_lock(&server->relay->lock);
+
+    // NOTE: Copy the counts before building ruby objects, allocating may run 
+    //       the gc, which must not happen while holding the lock.
+
+    int num_channels = server->relay->num_channels;
+    rbsrt_relay_channel_t *copies = malloc(sizeof(rbsrt_relay_channel_t) * (num_channels + 1));
+
+    if (copies)
+    {
+        memcpy(copies, server->relay->channels, sizeof(rbsrt_relay_channel_t) * num_channels);
+    }
+
+    pthread_mutex_unlock(&server->relay->lock);
+
+    if (!copies)
+    {
+        rb_raise(rb_eNoMemError, "failed to copy relay channels");
+    }
+
+    for (int i = 0; i < num_channels; i++)
+    {
+        VALUE channel = rb_hash_new();
+
+        rb_hash_aset(channel, ID2SYM(rb_intern("publisher")), copies[i].publisher != SRT_INVALID_SOCK ? Qtrue : Qfalse);
+        rb_hash_aset(channel, ID2SYM(rb_intern("subscribers")), INT2NUM(copies[i].num_subscribers));
+        rb_hash_aset(channel, ID2SYM(rb_intern("forwarded_messages")), LONG2NUM(copies[i].forwarded_messages));
+        rb_hash_aset(channel, ID2SYM(rb_intern("dropped_messages")), LONG2NUM(copies[i].dropped_messages));
+
+        rb_hash_aset(channels, rb_str_new_cstr(copies[i].resource_name), channel);
+    }
+
+    free(copies);
+
+    return channels;
+}
+
+
+// MARK: Dispatch
+
+// NOTE: By default workers call the at_data and at_close blocks themselves, so 
+//       a slow block holds up every connection of its worker. When started 
+//       with handlers, workers queue the events of a connection instead and a 
+//       pool of ruby threads calls the blocks. A connection is listed once in 
+//       the server's dispatch queue while it has events, so its events are 
+//       handled in order by one handler thread at a time. The queues are only 
+//       used while holding the gvl. With the :block overflow a worker waits on
+//       a condition variable which handler threads signal after taking events.
+
+#ifndef RBSRT_DISPATCH_BATCH
+#define RBSRT_DISPATCH_BATCH 64 // events a handler thread handles for one connection before moving on
+#endif
+
+void rbsrt_server_worker_close(rbsrt_server_worker_t *worker, SRTSOCKET sock);
+
+void rbsrt_connection_call_at_close(rbsrt_connection_t *connection)
+{
+    if (connection->at_close_block)
+    {
+        rb_funcall(connection->at_close_block, rb_intern("call"), 0);
+
+        connection->at_close_block = 0;
+    }
+
+    if (connection->at_data_block)
+    {
+        connection->at_data_block = 0;
+    }
+}
+
+// Waits until the handler threads took events of a connection whose queue is 
+// full. Called while holding the dispatch lock.
+VALUE rbsrt_server_dispatch_wait(VALUE context)
+{
+    VALUE *args = (VALUE *)context;
+    rbsrt_server_t *server = (rbsrt_server_t *)args[0];
+    rbsrt_connection_t *connection = (rbsrt_connection_t *)args[1];
+
+    while (RARRAY_LEN(connection->dispatch_events) >= server->dispatch_queue_size)
+    {
+        rb_funcall(server->dispatch_space, rb_intern("wait"), 1, server->dispatch_lock);
+    }
+
+    return Qnil;
+}
+
+VALUE rbsrt_server_dispatch_wait_done(VALUE context)
+{
+    rbsrt_server_t *server = (rbsrt_server_t *)context;
+
+    server->dispatch_waiting--;
+
+    rb_mutex_unlock(server->dispatch_lock);
+
+    return Qnil;
+}
+
+// Queues data, or the close when event is false, for the handler threads.
+void rbsrt_server_dispatch(rbsrt_server_worker_t *worker, VALUE rb_connection, rbsrt_connection_t *connection, VALUE event)
+{
+    rbsrt_server_t *server = worker->server;
+
+    if (!connection->dispatch_events)
+    {
+        connection->dispatch_events = rb_ary_new();
+    }
+
+    if (RTEST(event) && RARRAY_LEN(connection->dispatch_events) >= server->dispatch_queue_size)
+    {
+        switch (server->dispatch_overflow)
+        {
+            case RBSRT_DISPATCH_OVERFLOW_BLOCK:
+                rb_mutex_lock(server->dispatch_lock);
+
+                server->dispatch_waiting++;
+
+                {
+                    VALUE args[2] = { (VALUE)server, (VALUE)connection };
+
+                    rb_ensure(rbsrt_server_dispatch_wait, (VALUE)args, rbsrt_server_dispatch_wait_done, (VALUE)server);
+                }
+
+                break;
+
+            case RBSRT_DISPATCH_OVERFLOW_DISCONNECT:
+                connection->dropped_events++;
+                server->dropped_events++;
+
+                if (rbsrt_connection_table_lookup(&server->connections, connection->socket))
+                {
+                    RBSRT_DEBUG_PRINT("handlers fell behind, disconnecting socket %d", connection->socket);
+
+                    srt_close(connection->socket);
+
+                    rbsrt_server_worker_close(worker, connection->socket);
+                }
+
+                return;
+
+            case RBSRT_DISPATCH_OVERFLOW_DROP:
+                connection->dropped_events++;
+                server->dropped_events++;
+
+                return;
+        }
+    }
+
+    rb_ary_push(connection->dispatch_events, event);
+
+    if (!connection->dispatch_scheduled)
+    {
+        connection->dispatch_scheduled = 1;
+
+        rb_funcall(server->dispatch_queue, rb_intern("push"), 1, rb_connection);
+    }
+}
+
+VALUE rbsrt_server_call_dispatch_event(VALUE arg)
+{
+    VALUE *args = (VALUE *)arg;
+
+    RBSRT_CONNECTION_UNWRAP(args[0], connection);
+
+    if (!RTEST(args[1]))
+    {
+        rbsrt_connection_call_at_close(connection);
+    }
+
+    else if (connection->at_data_block)
+    {
+        rb_funcall(connection->at_data_block, rb_intern("call"), 1, args[1]);
+    }
+
+    return Qnil;
+}
+
+VALUE rbsrt_server_requeue_dispatch(VALUE context)
+{
+    VALUE *args = (VALUE *)context;
+
+    rb_funcall(args[0], rb_intern("push"), 1, args[1]);
+
+    return Qtrue;
+}
+
+VALUE rbsrt_server_requeue_dispatch_closed(VALUE context, VALUE error)
+{
+    return Qfalse;
+}
+
+// Calls up to RBSRT_DISPATCH_BATCH queued events of a connection.
+void rbsrt_server_dispatch_batch(rbsrt_server_t *server, VALUE rb_connection, rbsrt_connection_t *connection)
+{
+    for (int i = 0; i < RBSRT_DISPATCH_BATCH && RARRAY_LEN(connection->dispatch_events) > 0; i++)
+    {
+        VALUE args[2] = { rb_connection, rb_ary_shift(connection->dispatch_events) };
+        int exception = 0;
+
+        rb_protect(rbsrt_server_call_dispatch_event, (VALUE)args, &exception);
+
+        if (exception)
+        {
+            rb_warn("%s raised %"PRIsVALUE, RTEST(args[1]) ? "at_data" : "at_close", rb_errinfo());
+
+            rb_set_errinfo(Qnil);
+        }
+    }
+
+    // wake blocked workers, the lock makes sure a worker about to wait 
+    // does not miss it
+
+    if (server->dispatch_waiting > 0)
+    {
+        rb_mutex_lock(server->dispatch_lock);
+
+        rb_funcall(server->dispatch_space, rb_intern("broadcast"), 0);
+
+        rb_mutex_unlock(server->dispatch_lock);
+    }
+}
+
+VALUE rbsrt_server_dispatch_thread(void *context)
+{
+    rbsrt_server_t *server = (rbsrt_server_t *)context;
+    VALUE queue = server->dispatch_queue;
+
+    while (1)
+    {
+        VALUE rb_connection = rb_funcall(queue, rb_intern("pop"), 0);
+
+        if (NIL_P(rb_connection))
+        {
+            break; // closed and empty
+        }
+
+        RBSRT_CONNECTION_UNWRAP(rb_connection, connection);
+
+        rbsrt_server_dispatch_batch(server, rb_connection, connection);
+
+        // give other connections a turn before handling the rest, once the 
+        // server stopped and closed the queue the rest is handled right away
+
+        while (RARRAY_LEN(connection->dispatch_events) > 0)
+        {
+            VALUE args[2] = { queue, rb_connection };
+
+            if (RTEST(rb_rescue2(rbsrt_server_requeue_dispatch, (VALUE)args, rbsrt_server_requeue_dispatch_closed, Qnil, rb_path2class("ClosedQueueError"), (VALUE)0)))
+            {
+                break;
+            }
+
+            rbsrt_server_dispatch_batch(server, rb_connection, connection);
+        }
+
+        if (RARRAY_LEN(connection->dispatch_events) == 0)
+        {
+            connection->dispatch_scheduled = 0;
+        }
+    }
+
+    return Qnil;
+}
+
+rbsrt_dispatch_overflow_t rbsrt_dispatch_overflow_option(VALUE overflow)
+{
+    if (NIL_P(overflow) || overflow == ID2SYM(rb_intern("block")))
+    {
+        return RBSRT_DISPATCH_OVERFLOW_BLOCK;
+    }
+
+    if (overflow == ID2SYM(rb_intern("drop")))
+    {
+        return RBSRT_DISPATCH_OVERFLOW_DROP;
+    }
+
+    if (overflow == ID2SYM(rb_intern("disconnect")))
+    {
+        return RBSRT_DISPATCH_OVERFLOW_DISCONNECT;
+    }
+
+    rb_raise(rb_eArgError, "overflow must be :drop, :block or :disconnect");
+}
+
+void rbsrt_server_start_dispatch(rbsrt_server_t *server, int num_handlers)
+{
+    server->dispatch_queue = rb_class_new_instance(0, NULL, rb_path2class("Thread::Queue"));
+    server->dispatch_threads = rb_ary_new_capa(num_handlers);
+    server->dispatch_lock = rb_mutex_new();
+    server->dispatch_space = rb_class_new_instance(0, NULL, rb_path2class("Thread::ConditionVariable"));
+    server->dispatch_waiting = 0;
+
+    for (int i = 0; i < num_handlers; i++)
+    {
+        rb_ary_push(server->dispatch_threads, rb_thread_create(rbsrt_server_dispatch_thread, server));
+    }
+}
+
+// Lets the handler threads finish the queued events and waits for them.
+void rbsrt_server_stop_dispatch(rbsrt_server_t *server)
+{
+    if (!server->dispatch_queue)
+    {
+        return;
+    }
+
+    rb_funcall(server->dispatch_queue, rb_intern("close"), 0);
+
+    for (long i = 0; i < RARRAY_LEN(server->dispatch_threads); i++)
+    {
+        rb_funcall(RARRAY_AREF(server->dispatch_threads, i), rb_intern("join"), 0);
+    }
+
+    server->dispatch_queue = 0;
+    server->dispatch_threads = 0;
+    server->dispatch_lock = 0;
+    server->dispatch_space = 0;
+}
+
+VALUE rbsrt_server_dropped_events(VALUE self)
+{
+    RBSRT_SERVER_UNWRAP(self, server);
+
+    return LONG2NUM(server->dropped_events);
+}
+
+
+// MARK: Workers
+
+// NOTE: Every worker owns an epoll, an event buffer and a read buffer. Workers 
+//       wait and read without the gvl and take the gvl to deliver what they 
+//       read to ruby. workers[0] runs on the thread calling #start and accepts 
+//       connections, the other workers run on their own ruby threads. Accepted 
+//       connections are spread over the workers, or handled by workers[0] when 
+//       the server has no extra workers.
+
+#ifndef RBSRT_TIMER_WHEEL_SLOTS
+#define RBSRT_TIMER_WHEEL_SLOTS 512 // slots of a worker's timer wheel
+#endif
+
+#ifndef RBSRT_TIMER_WHEEL_TICK
+#define RBSRT_TIMER_WHEEL_TICK 100 // ms covered by a slot of the timer wheel
+#endif
+
+void rbsrt_server_release_workers(rbsrt_server_t *server)
+{
+    if (!server->workers)
+    {
+        return;
+    }
+
+    for (int i = 0; i < server->num_workers; i++)
+    {
+        rbsrt_server_worker_t *worker = &server->workers[i];
+
+        if (worker->epollid != SRT_ERROR)
+        {
+            srt_epoll_release(worker->epollid);
+        }
+
+        if (worker->wake_fds[0] != -1)
+        {
+            close(worker->wake_fds[0]);
+            close(worker->wake_fds[1]);
+        }
+
+        free(worker->readfds);
+        free(worker->writefds);
+        free(worker->events);
+        free(worker->pending);
+        free(worker->read_buf);
+    }
+
+    free(server->workers);
+
+    server->workers = NULL;
+    server->num_workers = 0;
+}
+
+void rbsrt_server_create_workers(rbsrt_server_t *server, VALUE rbserver, int num_extra_workers)
+{
+    // NOTE: Connections inherit the options of the server socket, a buffer which 
+    //       fits a message of the server fits messages of every connection.
+
+    int message_size = rbsrt_socket_recv_size((rbsrt_socket_base_t *)server);
+
+    server->num_workers = num_extra_workers + 1;
+    server->next_worker = 0;
+    server->workers = malloc(sizeof(rbsrt_server_worker_t) * server->num_workers);
+
+    memset(server->workers, 0, sizeof(rbsrt_server_worker_t) * server->num_workers);
+
+    for (int i = 0; i < server->num_workers; i++)
+    {
+        server->workers[i].epollid = SRT_ERROR;
+        server->workers[i].wake_fds[0] = -1;
+        server->workers[i].wake_fds[1] = -1;
+    }
+
+    for (int i = 0; i < server->num_workers; i++)
+    {
+        rbsrt_server_worker_t *worker = &server->workers[i];
+
+        worker->server = server;
+        worker->rbserver = rbserver;
+        worker->epollid = srt_epoll_create();
+        worker->readfds = malloc(sizeof(SRTSOCKET) * RBSRT_SERVER_MAX_EVENTS);
+        worker->writefds = malloc(sizeof(SRTSOCKET) * RBSRT_SERVER_MAX_EVENTS);
+        worker->events = malloc(sizeof(SRT_EPOLL_EVENT) * RBSRT_SERVER_MAX_EVENTS * 2);
+        worker->pending = malloc(sizeof(rbsrt_server_event_t) * RBSRT_SERVER_MAX_PENDING);
+        worker->message_size = message_size;
+        worker->large_messages = rbsrt_socket_large_messages((rbsrt_socket_base_t *)server);
+        worker->read_buf_size = (long)message_size + RBSRT_SERVER_READ_BUF_SIZE;
+        worker->read_buf = malloc((size_t)worker->read_buf_size);
+        worker->wait_timeout = server->timeout;
+        worker->coalescing = rb_ary_new();
+        worker->timer_slots = rb_ary_new_capa(RBSRT_TIMER_WHEEL_SLOTS);
+        worker->timer_tick = srt_time_now() / 1000 / RBSRT_TIMER_WHEEL_TICK;
+        worker->thread = 0;
+
+        for (int slot = 0; slot < RBSRT_TIMER_WHEEL_SLOTS; slot++)
+        {
+            rb_ary_push(worker->timer_slots, rb_ary_new());
+        }
+
+        if (!worker->readfds || !worker->writefds || !worker->events || !worker->pending || !worker->read_buf)
+        {
+            rbsrt_server_release_workers(server);
+
+            rb_raise(rb_eNoMemError, "failed to allocate server workers");
+        }
+
+        if (worker->epollid == SRT_ERROR)
+        {
+            rbsrt_server_release_workers(server);
+
+            rbsrt_raise_last_srt_error();
+        }
+
+        // NOTE: The wake pipe lets #stop and ruby interrupts end a wait without 
+        //       a timeout.
+
+        int wake_events = SRT_EPOLL_IN;
+
+        if (pipe(worker->wake_fds) != 0)
+        {
+            worker->wake_fds[0] = -1;
+
+            rbsrt_server_release_workers(server);
+
+            rb_sys_fail("pipe");
+        }
+
+        fcntl(worker->wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(worker->wake_fds[1], F_SETFL, O_NONBLOCK);
+
+        if (srt_epoll_add_ssock(worker->epollid, worker->wake_fds[0], &wake_events) == SRT_ERROR)
+        {
+            rbsrt_server_release_workers(server);
+
+            rbsrt_raise_last_srt_error();
+        }
+    }
+}
+
+void rbsrt_server_worker_wake(void *context)
+{
+    rbsrt_server_worker_t *worker = (rbsrt_server_worker_t *)context;
+
+    char byte = 1;
+
+    if (write(worker->wake_fds[1], &byte, 1) != 1)
+    {
+        // the pipe is full, the worker wakes anyway
+    }
+}
+
+#ifndef RBSRT_SERVER_BACKLOG
+#define RBSRT_SERVER_BACKLOG 6 // pending handshakes queued by the listener
+#endif
+
+#ifndef RBSRT_SERVER_READ_BUDGET
+#define RBSRT_SERVER_READ_BUDGET 64 // messages read from a single connection per wait
+#endif
+
+rbsrt_server_event_t *rbsrt_server_worker_push_pending(rbsrt_server_worker_t *worker, SRTSOCKET socket, rbsrt_server_event_type_t type)
+{
+    if (worker->num_pending >= RBSRT_SERVER_MAX_PENDING)
+    {
+        return NULL;
+    }
+
+    rbsrt_server_event_t *pending = &worker->pending[worker->num_pending++];
+
+    pending->socket = socket;
+    pending->type = type;
+    pending->offset = 0;
+    pending->len = 0;
+
+    return pending;
+}
+
+// Waits for events and reads the available messages into the worker's read 
+// buffer. Everything which needs ruby is queued in worker->pending.
+//
+// Readable connections are drained in rounds of one message per connection, 
+// until srt has nothing left to read, a connection used its read budget or the 
+// read buffer is full. Connections which still have data are reported again by 
+// the next wait.
+void *rbsrt_server_worker_poll_without_gvl(void *context)
+{
+    rbsrt_server_worker_t *worker = (rbsrt_server_worker_t *)context;
+
+    worker->num_pending = 0;
+    worker->read_buf_len = 0;
+
+    int num_readfds = RBSRT_SERVER_MAX_EVENTS;
+    int num_writefds = RBSRT_SERVER_MAX_EVENTS;
+    SYSSOCKET lrfds[1];
+    int num_lrfds = 1;
+    int num_events = 0;
+    int num_readable = 0;
+
+    if (srt_epoll_wait(worker->epollid, worker->readfds, &num_readfds, worker->writefds, &num_writefds, worker->wait_timeout, lrfds, &num_lrfds, NULL, NULL) > 0)
+    {
+        // srt reports broken and closed sockets as readable
+
+        for (int i = 0; i < num_readfds; i++)
+        {
+            worker->events[num_events].fd = worker->readfds[i];
+            worker->events[num_events].events = SRT_EPOLL_IN;
+            num_events++;
+        }
+
+        // only connections with queued messages wait for SRT_EPOLL_OUT
+
+        for (int i = 0; i < num_writefds; i++)
+        {
+            worker->events[num_events].fd = worker->writefds[i];
+            worker->events[num_events].events = SRT_EPOLL_OUT;
+            num_events++;
+        }
+
+        if (num_lrfds > 0)
+        {
+            char drain[64];
+
+            while (read(worker->wake_fds[0], drain, sizeof(drain)) > 0);
+        }
+    }
+
+    for (int i = 0; i < num_events; i++)
+    {
+        SRT_EPOLL_EVENT *event = &worker->events[i];
+
+        switch (srt_getsockstate(event->fd))
+        {
+            case SRTS_LISTENING:
+                rbsrt_server_worker_push_pending(worker, event->fd, RBSRT_SERVER_EVENT_ACCEPT);
+                break;
+
+            case SRTS_CLOSED:
+            case SRTS_NONEXIST:
+            case SRTS_BROKEN:
+                if ((event->events & SRT_EPOLL_IN) && rbsrt_server_worker_push_pending(worker, event->fd, RBSRT_SERVER_EVENT_CLOSE))
+                {
+                    srt_epoll_remove_usock(worker->epollid, event->fd);
+                }
+
+                break;
+
+            case SRTS_CONNECTED:
+                if (event->events & SRT_EPOLL_OUT)
+                {
+                    rbsrt_server_worker_push_pending(worker, event->fd, RBSRT_SERVER_EVENT_WRITE);
+                }
+
+                else if (event->events & SRT_EPOLL_IN)
+                {
+                    // collect readable connections at the front of the event buffer
+
+                    worker->events[num_readable++].fd = event->fd;
+                }
+
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    for (int round = 0; round < RBSRT_SERVER_READ_BUDGET && num_readable > 0; round++)
+    {
+        int num_still_readable = 0;
+
+        for (int i = 0; i < num_readable; i++)
+        {
+            SRTSOCKET sock = worker->events[i].fd;
+            int queued_size = worker->large_messages ? rbsrt_socket_queued_size(sock) : 0;
+            int message_size = queued_size > worker->message_size ? queued_size : worker->message_size;
+
+            if (worker->read_buf_len == 0 && worker->read_buf_size < message_size)
+            {
+                // grow the empty read buffer for a message larger than it
+
+                char *read_buf = realloc(worker->read_buf, (size_t)message_size + RBSRT_SERVER_READ_BUF_SIZE);
+
+                if (read_buf)
+                {
+                    worker->read_buf = read_buf;
+                    worker->read_buf_size = (long)message_size + RBSRT_SERVER_READ_BUF_SIZE;
+                }
+            }
+
+            if (worker->read_buf_size - worker->read_buf_len < message_size || worker->num_pending >= RBSRT_SERVER_MAX_PENDING)
+            {
+                // the read buffer is full, the connection is reported again on the next wait
+
+                return worker;
+            }
+
+            int nbytes = srt_recvmsg2(sock, worker->read_buf + worker->read_buf_len, message_size, NULL);
+
+            if (nbytes == SRT_ERROR || nbytes == 0)
+            {
+                RBSRT_DEBUG_PRINT("done reading from socket %d after %d messages: %s", sock, round, srt_getlasterror_str());
+
+                continue;
+            }
+
+            RBSRT_DEBUG_PRINT("received %d bytes from socket %d", nbytes, sock);
+
+            if (worker->server->relay)
+            {
+                rbsrt_relay_forward(worker->server->relay, sock, worker->read_buf + worker->read_buf_len, nbytes);
+            }
+
+            rbsrt_server_event_t *pending = rbsrt_server_worker_push_pending(worker, sock, RBSRT_SERVER_EVENT_DATA);
+
+            pending->offset = worker->read_buf_len;
+            pending->len = nbytes;
+
+            worker->read_buf_len += nbytes;
+            worker->events[num_still_readable++].fd = sock;
+        }
+
+        num_readable = num_still_readable;
+    }
+
+    return worker;
+}
+
+// NOTE: Every worker keeps its connections in a hashed timer wheel. A slot 
+//       lists the connections whose idle deadline falls in one of its ticks. 
+//       Received data only updates last_active, when the slot of a connection 
+//       comes up it is closed if it was idle for too long, or moved to the 
+//       slot of its new deadline. Connections without an idle timeout are 
+//       not listed, setting a timeout later on lists them. Closed connections 
+//       are removed from their slot right away. The wheel is only used while 
+//       holding the gvl.
+
+// The idle timeout of the connection in ms, 0 when it never times out.
+int64_t rbsrt_server_connection_idle_timeout(rbsrt_server_t *server, rbsrt_connection_t *connection)
+{
+    if (connection->idle_timeout < 0)
+    {
+        return 0;
+    }
+
+    return connection->idle_timeout > 0 ? connection->idle_timeout : server->idle_timeout;
+}
+
+void rbsrt_server_worker_schedule_idle(rbsrt_server_worker_t *worker, VALUE rb_connection, rbsrt_connection_t *connection)
+{
+    int64_t timeout = rbsrt_server_connection_idle_timeout(worker->server, connection);
+
+    if (timeout <= 0)
+    {
+        return; // never times out
+    }
+
+    int64_t tick = (connection->last_active / 1000 + timeout + RBSRT_TIMER_WHEEL_TICK - 1) / RBSRT_TIMER_WHEEL_TICK;
+
+    if (tick <= worker->timer_tick)
+    {
+        tick = worker->timer_tick + 1;
+    }
+
+    VALUE slot = RARRAY_AREF(worker->timer_slots, tick % RBSRT_TIMER_WHEEL_SLOTS);
+
+    connection->idle_timer = 1;
+    connection->idle_slot = (long)(tick % RBSRT_TIMER_WHEEL_SLOTS);
+    connection->idle_index = RARRAY_LEN(slot);
+
+    rb_ary_push(slot, rb_connection);
+}
+
+// Removes the connection from its slot, the last connection of the slot takes 
+// its place.
+void rbsrt_server_worker_unschedule_idle(rbsrt_server_worker_t *worker, rbsrt_connection_t *connection)
+{
+    if (!connection->idle_timer)
+    {
+        return;
+    }
+
+    VALUE slot = RARRAY_AREF(worker->timer_slots, connection->idle_slot);
+    VALUE rb_last = rb_ary_pop(slot);
+
+    if (connection->idle_index < RARRAY_LEN(slot))
+    {
+        RBSRT_CONNECTION_UNWRAP(rb_last, last);
+
+        last->idle_index = connection->idle_index;
+
+        rb_ary_store(slot, connection->idle_index, rb_last);
+    }
+
+    connection->idle_timer = 0;
+}
+
+// Lists the connection for its current idle timeout and wakes its worker to 
+// pick up the new deadline.
+void rbsrt_server_worker_reschedule_idle(VALUE rb_connection, rbsrt_connection_t *connection)
+{
+    rbsrt_server_worker_t *worker = connection->worker;
+
+    if (!worker)
+    {
+        return; // not accepted yet or closed
+    }
+
+    rbsrt_server_worker_unschedule_idle(worker, connection);
+    rbsrt_server_worker_schedule_idle(worker, rb_connection, connection);
+    rbsrt_server_worker_wake(worker);
+}
+
+// Closes idle connections, calls the on_tick block and lowers the wait timeout 
+// to the next tick which has work.
+void rbsrt_server_worker_run_timers(rbsrt_server_worker_t *worker)
+{
+    rbsrt_server_t *server = worker->server;
+    int64_t now = srt_time_now();
+    int64_t current_tick = now / 1000 / RBSRT_TIMER_WHEEL_TICK;
+    int64_t first_tick = worker->timer_tick + 1;
+
+    if (current_tick - first_tick >= RBSRT_TIMER_WHEEL_SLOTS)
+    {
+        first_tick = current_tick - RBSRT_TIMER_WHEEL_SLOTS + 1; // every slot is handled once
+    }
+
+    for (int64_t tick = first_tick; tick <= current_tick; tick++)
+    {
+        long slot = (long)(tick % RBSRT_TIMER_WHEEL_SLOTS);
+        VALUE expired = RARRAY_AREF(worker->timer_slots, slot);
+
+        worker->timer_tick = tick;
+
+        if (RARRAY_LEN(expired) == 0)
+        {
+            continue;
+        }
+
+        rb_ary_store(worker->timer_slots, slot, rb_ary_new());
+
+        for (long i = 0; i < RARRAY_LEN(expired); i++)
+        {
+            RBSRT_CONNECTION_UNWRAP(RARRAY_AREF(expired, i), connection);
+
+            connection->idle_timer = 0; // no longer listed
+        }
+
+        for (long i = 0; i < RARRAY_LEN(expired); i++)
+        {
+            VALUE rb_connection = RARRAY_AREF(expired, i);
+
+            RBSRT_CONNECTION_UNWRAP(rb_connection, connection);
+
+            if (connection->worker != worker || connection->idle_timer)
+            {
+                continue; // closed, or listed again by the close of an earlier one
+            }
+
+            int64_t timeout = rbsrt_server_connection_idle_timeout(server, connection);
+
+            if (timeout > 0 && now - connection->last_active >= timeout * 1000)
+            {
+                SRTSOCKET sock = connection->socket;
+
+                RBSRT_DEBUG_PRINT("closing socket %d, idle for %lld ms", sock, (long long)((now - connection->last_active) / 1000));
+
+                srt_close(sock);
+
+                rbsrt_server_worker_close(worker, sock);
+
+                continue;
+            }
+
+            rbsrt_server_worker_schedule_idle(worker, rb_connection, connection);
+        }
+
+        RB_GC_GUARD(expired);
+    }
+
+    int64_t timeout = -1; // ms
+
+    for (int64_t tick = worker->timer_tick + 1; tick <= worker->timer_tick + RBSRT_TIMER_WHEEL_SLOTS; tick++)
+    {
+        if (RARRAY_LEN(RARRAY_AREF(worker->timer_slots, tick % RBSRT_TIMER_WHEEL_SLOTS)) > 0)
+        {
+            timeout = tick * RBSRT_TIMER_WHEEL_TICK - now / 1000;
+
+            break;
+        }
+    }
+
+    if (server->tick_block && worker == &server->workers[0])
+    {
+        if (now >= server->next_tick)
+        {
+            server->next_tick += server->tick_interval;
+
+            if (server->next_tick <= now)
+            {
+                server->next_tick = now + server->tick_interval; // fell behind, skip the missed ticks
+            }
+
+            rb_funcall(server->tick_block, rb_intern("call"), 1, worker->rbserver);
+        }
+
+        int64_t remaining = (server->next_tick - srt_time_now() + 999) / 1000;
+
+        if (timeout < 0 || remaining < timeout)
+        {
+            timeout = remaining;
+        }
+    }
+
+    if (timeout < 0)
+    {
+        return;
+    }
+
+    if (timeout < 1)
+    {
+        timeout = 1;
+    }
+
+    if (worker->wait_timeout < 0 || timeout < worker->wait_timeout)
+    {
+        worker->wait_timeout = timeout;
+    }
+}
+
+void rbsrt_server_worker_accept(rbsrt_server_worker_t *worker, SRTSOCKET listener)
+{
+    rbsrt_server_t *server = worker->server;
+
+    struct sockaddr_storage remote_address;
+    int addr_size = sizeof(remote_address);
+    int no = 0;
+    int no_size = sizeof(no);
+    int connection_epoll_events = SRT_EPOLL_IN | SRT_EPOLL_ERR;
+
+    SRTSOCKET remote_fd = srt_accept(listener, (struct sockaddr *)&remote_address, &addr_size);
+
+    if (remote_fd == SRT_INVALID_SOCK)
+    {
+        RBSRT_DEBUG_PRINT("failed to accept: %s", srt_getlasterror_str());
+
+        return;
+    }
+
+    rbsrt_server_forget_caller(server, remote_fd);
+
+    if (rbsrt_server_reserve_connection(server) == RBSRT_FAILURE)
+    {
+        // its admission expired and another caller took the slot
+
+        RBSRT_DEBUG_PRINT("server is full, closing socket %d", remote_fd);
+
+        srt_close(remote_fd);
+
+        return;
+    }
+
+    srt_setsockflag(remote_fd, SRTO_RCVSYN, &no, no_size);
+    srt_setsockflag(remote_fd, SRTO_SNDSYN, &no, no_size);
+
+    rbsrt_connection_t *connection;
+
+    VALUE rb_connection = TypedData_Make_Struct(mSRTConnectionKlass, rbsrt_connection_t, &rbsrt_connection_rbtype, connection);
+
+    connection->socket = remote_fd;
+    connection->epollid = SRT_ERROR;
+
+    rbsrt_socket_io((rbsrt_socket_base_t *)connection)->transtype = rbsrt_socket_transtype((rbsrt_socket_base_t *)server);
+
+    VALUE should_accept = rb_funcall_with_block(worker->rbserver, rb_intern("instance_exec"), 1, &rb_connection, server->acceptor_block);
+
+    if (RTEST(should_accept) && server->relay && rbsrt_server_relay_attach(server, rb_connection, remote_fd) == RBSRT_FAILURE)
+    {
+        RBSRT_DEBUG_PRINT("relay refused socket %d", remote_fd);
+
+        should_accept = Qfalse;
+    }
+
+    if (RTEST(should_accept))
+    {
+        // spread connections over the extra workers, round robin
+
+        rbsrt_server_worker_t *target = &server->workers[0];
+
+        if (server->num_workers > 1)
+        {
+            target = &server->workers[1 + (server->next_worker++ % (server->num_workers - 1))];
+        }
+
+        rbsrt_connection_table_insert(&server->connections, connection->socket, connection, rb_connection);
+
+        connection->epollid = target->epollid;
+        connection->worker = target;
+        connection->last_active = srt_time_now();
+
+        rbsrt_server_worker_schedule_idle(target, rb_connection, connection);
+
+        if (connection->send_queue && connection->send_queue->head)
+        {
+            // written to from the accept block
+
+            connection->send_queue->watching = 1;
+
+            connection_epoll_events |= SRT_EPOLL_OUT;
+        }
+
+        srt_epoll_add_usock(target->epollid, connection->socket, &connection_epoll_events);
+
+        if (target != worker)
+        {
+            rbsrt_server_worker_wake(target); // waits for its timers
+        }
+    }
+
+    else
+    {
+        rbsrt_server_release_connection(server);
+
+        srt_close(remote_fd);
+    }
+}
+
+// Calls the at_data block of the connection, or queues the data for the 
+// handler threads.
+void rbsrt_server_worker_deliver(rbsrt_server_worker_t *worker, VALUE rb_connection, rbsrt_connection_t *connection, VALUE data)
+{
+    if (worker->server->dispatch_queue)
+    {
+        rbsrt_server_dispatch(worker, rb_connection, connection, data);
+
+        return;
+    }
+
+    rb_funcall(connection->at_data_block, rb_intern("call"), 1, data);
+}
+
+void rbsrt_server_worker_deliver_coalesced(rbsrt_server_worker_t *worker, VALUE rb_connection, rbsrt_connection_t *connection)
+{
+    VALUE data = connection->coalesced_data;
+
+    if (!data)
+    {
+        return;
+    }
+
+    connection->coalesced_data = 0;
+
+    if (connection->at_data_block)
+    {
+        rbsrt_server_worker_deliver(worker, rb_connection, connection, data);
+    }
+}
+
+void rbsrt_server_worker_close(rbsrt_server_worker_t *worker, SRTSOCKET sock)
+{
+    rbsrt_server_t *server = worker->server;
+
+    RBSRT_DEBUG_PRINT("removing connection with socket: %d", sock);
+
+    VALUE rb_connection = rbsrt_connection_table_remove(&server->connections, sock);
+
+    if (!RTEST(rb_connection))
+    {
+        return;
+    }
+
+    rbsrt_server_release_connection(server);
+
+    RBSRT_DEBUG_PRINT("remove connection with socket %d, now %lu sockets", sock, RBSRT_SERVER_NUM_CONNECTIONS(server));
+
+    if (server->relay)
+    {
+        rbsrt_relay_detach(server->relay, sock);
+    }
+
+    RBSRT_CONNECTION_UNWRAP(rb_connection, removed_connection);
+
+    if (removed_connection->worker)
+    {
+        rbsrt_server_worker_unschedule_idle(removed_connection->worker, removed_connection);
+
+        removed_connection->worker = NULL;
+    }
+
+    rbsrt_server_worker_deliver_coalesced(worker, rb_connection, removed_connection);
+
+    // NOTE: The worker does not wait for the recorder's last write or the 
+    //       forwarder's last datagrams, they are joined by #stop_recording and
+    //       #stop_forwarding or when the connection is collected.
+
+    if (removed_connection->recorder)
+    {
+        rbsrt_recorder_signal_stop(removed_connection->recorder);
+    }
+
+    if (removed_connection->udp_forwarder)
+    {
+        rbsrt_udp_forwarder_signal_stop(removed_connection->udp_forwarder);
+    }
+
+    if (server->dispatch_queue)
+    {
+        rbsrt_server_dispatch(worker, rb_connection, removed_connection, Qfalse);
+
+        return;
+    }
+
+    rbsrt_connection_call_at_close(removed_connection);
+}
+
+void rbsrt_server_worker_data(rbsrt_server_worker_t *worker, rbsrt_server_event_t *pending)
+{
+    rbsrt_connection_table_entry_t *entry = rbsrt_connection_table_lookup(&worker->server->connections, pending->socket);
+
+    if (!entry)
+    {
+        return;
+    }
+
+    RBSRT_DEBUG_PRINT("found connection for socket %d", pending->socket);
+
+    VALUE rb_connection = entry->rb_connection;
+    rbsrt_connection_t *connection = entry->connection;
+
+    connection->last_active = worker->now;
+
+    if (connection->recorder)
+    {
+        rbsrt_recorder_append(connection->recorder, worker->read_buf + pending->offset, (size_t)pending->len);
+    }
+
+    if (connection->udp_forwarder)
+    {
+        rbsrt_udp_forwarder_push(connection->udp_forwarder, worker->read_buf + pending->offset, pending->len);
+    }
+
+    if (!connection->at_data_block)
+    {
+        return;
+    }
+
+    RBSRT_DEBUG_PRINT("found data handler for socket %d", pending->socket);
+
+    if (connection->coalesce_data)
+    {
+        if (!connection->coalesced_data)
+        {
+            connection->coalesced_data = rb_str_buf_new(connection->coalesce_max_bytes);
+            connection->coalesced_since = srt_time_now();
+        }
+
+        if (!connection->coalescing)
+        {
+            connection->coalescing = 1;
+
+            rb_ary_push(worker->coalescing, rb_connection);
+        }
+
+        rb_str_cat(connection->coalesced_data, worker->read_buf + pending->offset, pending->len);
+
+        if (RSTRING_LEN(connection->coalesced_data) >= connection->coalesce_max_bytes)
+        {
+            rbsrt_server_worker_deliver_coalesced(worker, rb_connection, connection);
+        }
+
+        return;
+    }
+
+    VALUE data = rb_str_new(worker->read_buf + pending->offset, pending->len);
+
+    rbsrt_server_worker_deliver(worker, rb_connection, connection, data);
+}
+
+void rbsrt_server_worker_write(rbsrt_server_worker_t *worker, SRTSOCKET sock)
+{
+    rbsrt_connection_table_entry_t *entry = rbsrt_connection_table_lookup(&worker->server->connections, sock);
+
+    if (!entry)
+    {
+        return;
+    }
+
+    rbsrt_connection_flush_send_queue(entry->connection);
+}
+
+// Delivers the coalesced data of connections which reached their max delay and 
+// sets the next wait timeout to the earliest remaining deadline.
+void rbsrt_server_worker_flush_coalesced(rbsrt_server_worker_t *worker)
+{
+    int64_t now = srt_time_now();
+    int64_t timeout = worker->server->timeout < 0 ? INT64_MAX : worker->server->timeout * 1000;
+
+    VALUE coalescing = worker->coalescing;
+
+    worker->coalescing = rb_ary_new();
+
+    for (long i = 0; i < RARRAY_LEN(coalescing); i++)
+    {
+        VALUE rb_connection = RARRAY_AREF(coalescing, i);
+
+        RBSRT_CONNECTION_UNWRAP(rb_connection, connection);
+
+        connection->coalescing = 0;
+
+        if (!connection->coalesced_data)
+        {
+            continue; // delivered when full or closed
+        }
+
+        int64_t remaining = connection->coalesced_since + connection->coalesce_max_delay - now;
+
+        if (remaining <= 0)
+        {
+            rbsrt_server_worker_deliver_coalesced(worker, rb_connection, connection);
+
+            continue;
+        }
+
+        if (remaining < timeout)
+        {
+            timeout = remaining;
+        }
+
+        connection->coalescing = 1;
+
+        rb_ary_push(worker->coalescing, rb_connection);
+    }
+
+    worker->wait_timeout = timeout == INT64_MAX ? -1 : (timeout + 999) / 1000;
+
+    RB_GC_GUARD(coalescing);
+}
+
+VALUE rbsrt_server_worker_run(rbsrt_server_worker_t *worker)
+{
+    while (!atomic_load(&worker->server->stopping))
+    {
+        rb_thread_call_without_gvl(rbsrt_server_worker_poll_without_gvl, worker, rbsrt_server_worker_wake, worker);
+
+        if (atomic_load(&worker->server->stopping))
+        {
+            break;
+        }
 
-    return sizeof(rbsrt_server_t);
-}
+        worker->now = srt_time_now();
 
-void rbsrt_server_dmark(void *data)
-{
-    RBSRT_DEBUG_PRINT("server mark");
+        for (int i = 0; i < worker->num_pending; i++)
+        {
+            rbsrt_server_event_t *pending = &worker->pending[i];
 
-    rbsrt_server_t *server = (rbsrt_server_t *)data;
+            switch (pending->type)
+            {
+                case RBSRT_SERVER_EVENT_ACCEPT:
+                    rbsrt_server_worker_accept(worker, pending->socket);
+                    break;
 
-    if (server->acceptor_block)
-    {
-        rb_gc_mark(server->acceptor_block);
-    }
-}
+                case RBSRT_SERVER_EVENT_CLOSE:
+                    rbsrt_server_worker_close(worker, pending->socket);
+                    break;
 
+                case RBSRT_SERVER_EVENT_DATA:
+                    rbsrt_server_worker_data(worker, pending);
+                    break;
 
-// MARK: Utils
+                case RBSRT_SERVER_EVENT_WRITE:
+                    rbsrt_server_worker_write(worker, pending->socket);
+                    break;
+            }
+        }
 
-#define RBSRT_SERVER_NUM_CONNECTIONS(server) (size_t)atomic_load(&server->num_connections)
+        rbsrt_server_worker_flush_coalesced(worker);
 
+        rbsrt_server_worker_run_timers(worker);
+    }
 
-// MARK: SRT
+    return Qnil;
+}
 
-int rbsrt_server_listen_callback(void* context, SRTSOCKET remote_socket, int hs_version, const struct sockaddr* peeraddr, const char* streamid)
+VALUE rbsrt_server_worker_thread(void *context)
 {
-    // TODO: Call into ruby and allow pre-setup of the socket
-
-    return 1;
+    return rbsrt_server_worker_run((rbsrt_server_worker_t *)context);
 }
 
 
@@ -1435,6 +8229,20 @@ void rbsrt_server_deallocate(rbsrt_server_t *server)
         srt_close(server->socket);
     }
 
+    rbsrt_socket_io_release(server->io);
+
+    rbsrt_server_release_workers(server);
+
+    rbsrt_connection_table_release(&server->connections);
+
+    rbsrt_server_handshake_release(server->handshake);
+
+    rbsrt_relay_release(server->relay);
+
+    pthread_mutex_destroy(&server->admission.lock);
+
+    free(server->admission.callers);
+
     free(server);
 }
  
@@ -1446,37 +8254,42 @@ VALUE rbsrt_server_allocate(VALUE klass)
 
     memset(server, 0, sizeof(rbsrt_server_t));
 
+    pthread_mutex_init(&server->admission.lock, NULL);
+
     return TypedData_Wrap_Struct(klass, &rbsrt_server_rbtype, server);
 }
 
-VALUE rbsrt_server_initialize(VALUE self, VALUE address, VALUE port)
+VALUE rbsrt_server_initialize(int argc, VALUE* argv, VALUE self)
 {
     RBSRT_DEBUG_PRINT("server initialize");
 
     rbsrt_server_t *server;
     int status;
-    struct sockaddr_in sa;
     int livemode = SRTT_LIVE;
     int no = 1;
+    const char *error = NULL;
+
+    VALUE address, port, opts;
+
+    rb_scan_args(argc, argv, "2:", &address, &port, &opts);
 
     Check_Type(address, T_STRING);
     Check_Type(port, T_STRING);
 
+    VALUE backlog_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("backlog")));
+    int backlog = NIL_P(backlog_val) ? RBSRT_SERVER_BACKLOG : NUM2INT(backlog_val);
+
+    if (backlog < 1)
+    {
+        rb_raise(rb_eArgError, "backlog must be at least 1");
+    }
+
     TypedData_Get_Struct(self, rbsrt_server_t, &rbsrt_server_rbtype, server);
 
     // Initialize struct
 
     atomic_init(&server->num_connections, 0);
 
-
-    // Ruby API
-
-    VALUE connections_by_socket = rb_hash_new();
-
-    rb_hash_clear(connections_by_socket);
-    
-    rb_ivar_set(self, rb_intern("@connections_by_socket"), connections_by_socket);
-
     
     // create socket
 
@@ -1490,19 +8303,6 @@ VALUE rbsrt_server_initialize(VALUE self, VALUE address, VALUE port)
     }
 
 
-    // get address info
-
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(atoi(StringValuePtr(port)));
-    
-    if (inet_pton(AF_INET, StringValuePtr(address), &sa.sin_addr) != 1)
-    {
-        rb_raise(rb_eArgError, "bad adddress: %s", strerror(errno));
-        
-        return Qfalse;
-    }
-    
-
     // set up socket
 
     srt_setsockflag(server->socket, SRTO_TRANSTYPE, &livemode, sizeof(livemode)); // set live mode
@@ -1512,16 +8312,14 @@ VALUE rbsrt_server_initialize(VALUE self, VALUE address, VALUE port)
 
     // set up callback
 
-    srt_listen_callback(server->socket, rbsrt_server_listen_callback, (void *)self);
+    srt_listen_callback(server->socket, rbsrt_server_listen_callback, (void *)server);
 
     
     // bind server
     
-    status = srt_bind(server->socket, (struct sockaddr *)&sa, sizeof(sa));
-    
-    if (status == SRT_ERROR)
+    if (rbsrt_bind_address(server->socket, StringValueCStr(address), StringValueCStr(port), rbsrt_ipv6only_option(opts), &error) == RBSRT_FAILURE)
     {
-        rb_raise(rb_eStandardError, "%s", srt_getlasterror_str());
+        rb_raise(rb_eStandardError, "%s", error);
         
         return Qfalse;
     }
@@ -1529,7 +8327,7 @@ VALUE rbsrt_server_initialize(VALUE self, VALUE address, VALUE port)
     
     // listen
     
-    status = srt_listen(server->socket, 6); // TODO: Pass backlog size
+    status = srt_listen(server->socket, backlog);
     
     if (status == SRT_ERROR)
     {
@@ -1541,6 +8339,22 @@ VALUE rbsrt_server_initialize(VALUE self, VALUE address, VALUE port)
     return self;
 }
 
+VALUE rbsrt_server_stop(VALUE self)
+{
+    RBSRT_DEBUG_PRINT("server stop");
+
+    RBSRT_SERVER_UNWRAP(self, server);
+
+    atomic_store(&server->stopping, 1);
+
+    for (int i = 0; i < server->num_workers; i++)
+    {
+        rbsrt_server_worker_wake(&server->workers[i]);
+    }
+
+    return Qnil;
+}
+
 VALUE rbsrt_server_close(VALUE self)
 {
     RBSRT_DEBUG_PRINT("server close");
@@ -1558,219 +8372,286 @@ VALUE rbsrt_server_close(VALUE self)
     return Qnil;
 }
 
-struct rbsrt_server_epoll_wait_args
+VALUE rbsrt_server_connection_count(VALUE self)
 {
-    rbsrt_server_t *server;
-    int64_t timeout;
-    int num_events;
-    SRT_EPOLL_EVENT *events;
-};
+    RBSRT_SERVER_UNWRAP(self, server);
+    
+    return SIZET2NUM(RBSRT_SERVER_NUM_CONNECTIONS(server));
+}
 
-void *rbsrt_server_epoll_wait(void *args)
+VALUE rbsrt_server_rejected_connections(VALUE self)
 {
-    struct rbsrt_server_epoll_wait_args *arg = args;
+    RBSRT_SERVER_UNWRAP(self, server);
 
-    int num_events = srt_epoll_uwait(arg->server->epollid, arg->events, arg->num_events, arg->timeout);
+    pthread_mutex_lock(&server->admission.lock);
 
-    return (void *)(uintptr_t)num_events;
+    long rejected_max_connections = server->admission.rejected_max_connections;
+    long rejected_max_accept_rate = server->admission.rejected_max_accept_rate;
+
+    pthread_mutex_unlock(&server->admission.lock);
+
+    VALUE rejected = rb_hash_new();
+
+    rb_hash_aset(rejected, ID2SYM(rb_intern("max_connections")), LONG2NUM(rejected_max_connections));
+    rb_hash_aset(rejected, ID2SYM(rb_intern("max_accept_rate")), LONG2NUM(rejected_max_accept_rate));
+
+    return rejected;
 }
 
-VALUE rbsrt_server_connection_count(VALUE self)
+VALUE rbsrt_server_idle_timeout(VALUE self)
 {
     RBSRT_SERVER_UNWRAP(self, server);
-    
-    return SIZET2NUM(RBSRT_SERVER_NUM_CONNECTIONS(server));
+
+    return server->idle_timeout > 0 ? LL2NUM(server->idle_timeout) : Qnil;
 }
 
-VALUE rbsrt_server_start(VALUE self)
+VALUE rbsrt_server_set_idle_timeout(VALUE self, VALUE timeout)
 {
-    RBSRT_DEBUG_PRINT("server start");
+    RBSRT_SERVER_UNWRAP(self, server);
+
+    int64_t idle_timeout = NIL_P(timeout) ? 0 : NUM2LL(timeout);
+
+    if (idle_timeout < 0)
+    {
+        rb_raise(rb_eArgError, "idle_timeout must not be negative");
+    }
+
+    server->idle_timeout = idle_timeout;
+
+    for (size_t i = 0; i < server->connections.capacity; i++)
+    {
+        rbsrt_connection_table_entry_t *entry = &server->connections.entries[i];
+
+        if (entry->socket != SRT_INVALID_SOCK && entry->connection->idle_timeout == 0)
+        {
+            rbsrt_server_worker_reschedule_idle(entry->rb_connection, entry->connection);
+        }
+    }
+
+    return timeout;
+}
+
+VALUE rbsrt_server_set_tick_block(VALUE self, VALUE interval)
+{
+    RBSRT_DEBUG_PRINT("server set tick block");
 
     rb_need_block();
 
     RBSRT_SERVER_UNWRAP(self, server);
 
-    // rb_iv_set(self, rb_intern("acceptor_block"), rb_block_proc());
+    int64_t tick_interval = NUM2LL(interval);
 
-    server->acceptor_block = rb_block_proc();
+    if (tick_interval < 1)
+    {
+        rb_raise(rb_eArgError, "interval must be at least 1 ms");
+    }
 
-    server->epollid = srt_epoll_create();
+    server->tick_block = rb_block_proc();
+    server->tick_interval = tick_interval * 1000;
+    server->next_tick = srt_time_now() + server->tick_interval;
 
-    int event_types = SRT_EPOLL_IN;
+    return Qtrue;
+}
 
-    srt_epoll_add_usock(server->epollid, server->socket, &event_types);
+VALUE rbsrt_server_run(VALUE context)
+{
+    rbsrt_server_t *server = (rbsrt_server_t *)context;
 
-    SRT_EPOLL_EVENT events[1024];
+    for (int i = 1; i < server->num_workers; i++)
+    {
+        server->workers[i].thread = rb_thread_create(rbsrt_server_worker_thread, &server->workers[i]);
+    }
 
-    struct rbsrt_server_epoll_wait_args args = {
-        .server = server,
-        .timeout = 100,
-        .num_events = 1024,
-        .events = events
-    };
+    if (server->handshake && server->handshake_block)
+    {
+        server->handshake_thread = rb_thread_create(rbsrt_server_handshake_thread, server);
 
-    struct sockaddr_storage remote_address;
-    int addr_size = sizeof(remote_address);
-    int remote_fd;
-    int running = 1;
+        rbsrt_server_set_handshake_running(server, 1);
+    }
+
+    return rbsrt_server_worker_run(&server->workers[0]);
+}
 
-    VALUE connections_by_socket = rb_ivar_get(self, rb_intern("@connections_by_socket"));
+// Closes every connection and calls their at_close blocks.
+void rbsrt_server_close_connections(rbsrt_server_t *server)
+{
+    rbsrt_connection_table_t *table = &server->connections;
+    size_t num_sockets = 0;
+    SRTSOCKET *sockets = malloc(sizeof(SRTSOCKET) * (table->count + 1));
 
-    while (running)
+    if (!sockets)
     {
-        int num_events = (int)(uintptr_t)rb_thread_call_without_gvl(rbsrt_server_epoll_wait, &args, RUBY_UBF_IO, 0);
+        rb_raise(rb_eNoMemError, "failed to close connections");
+    }
 
-        if (num_events <= 0)
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        if (table->entries[i].socket != SRT_INVALID_SOCK)
         {
-            continue; // timeout
+            sockets[num_sockets++] = table->entries[i].socket;
         }
+    }
+
+    RBSRT_DEBUG_PRINT("closing %zu connections", num_sockets);
 
-        int read_buf_size = RBSRT_PAYLOAD_SIZE * 8;
-        char read_buf[read_buf_size];
-        int nbytes;
+    for (size_t i = 0; i < num_sockets; i++)
+    {
+        srt_close(sockets[i]);
+    }
 
-        // SRT_MSGCTRL msgctl;
-        SRT_EPOLL_EVENT *event;
-        SRTSOCKET sock;
-        SRT_SOCKSTATUS status;
-        rbsrt_connection_t *connection;
+    for (size_t i = 0; i < num_sockets; i++)
+    {
+        rbsrt_server_worker_close(&server->workers[0], sockets[i]);
+    }
 
-        VALUE rb_connection;
+    free(sockets);
+}
 
-        int no = 0;
-        int no_size = sizeof(no);
-        int connection_epoll_events = SRT_EPOLL_OUT | SRT_EPOLL_IN | SRT_EPOLL_ERR;
+VALUE rbsrt_server_stop_workers(VALUE context)
+{
+    rbsrt_server_t *server = (rbsrt_server_t *)context;
 
-        for (int i = 0; i < num_events; i++)
-        {
-            event = &args.events[i];
-            sock = event->fd;
-            status = srt_getsockstate(sock);
-            
-            switch (status)
-            {
-                // accept connections
-                case SRTS_LISTENING:
+    atomic_store(&server->stopping, 1);
+
+    for (int i = 0; i < server->num_workers; i++)
+    {
+        rbsrt_server_worker_wake(&server->workers[i]);
+    }
 
-                    remote_fd = srt_accept(sock, (struct sockaddr *)&remote_address, &addr_size);
+    rbsrt_server_set_handshake_running(server, 0);
 
-                    srt_setsockflag(remote_fd, SRTO_RCVSYN, &no, no_size);
-                    srt_setsockflag(remote_fd, SRTO_SNDSYN, &no, no_size);
+    if (server->handshake_thread)
+    {
+        rb_funcall(server->handshake_thread, rb_intern("kill"), 0);
+        rb_funcall(server->handshake_thread, rb_intern("join"), 0);
+
+        server->handshake_thread = 0;
+    }
 
-                    connection = malloc(sizeof(rbsrt_connection_t));
+    for (int i = 1; i < server->num_workers; i++)
+    {
+        if (server->workers[i].thread)
+        {
+            rb_funcall(server->workers[i].thread, rb_intern("join"), 0);
 
-                    memset(connection, 0, sizeof(rbsrt_connection_t));
+            server->workers[i].thread = 0;
+        }
+    }
 
-                    rb_connection = TypedData_Make_Struct(mSRTConnectionKlass, rbsrt_connection_t, &rbsrt_connection_rbtype, connection);
+    rbsrt_server_close_connections(server);
 
-                    connection->socket = remote_fd;
+    rbsrt_server_stop_dispatch(server);
 
-                    VALUE should_accept = rb_funcall_with_block(self, rb_intern("instance_exec"), 1, &rb_connection, server->acceptor_block);
+    rbsrt_server_release_workers(server);
 
-                    if (RTEST(should_accept))
-                    {
-                        srt_epoll_add_usock(server->epollid, connection->socket, &connection_epoll_events);
+    return Qnil;
+}
 
-                        atomic_fetch_add(&server->num_connections, 1);
-                        
-                        rb_hash_aset(connections_by_socket, INT2FIX(connection->socket), rb_connection);
-                    }
+VALUE rbsrt_server_start(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("server start");
 
-                    else
-                    {
-                        atomic_fetch_sub(&server->num_connections, 1);
-                        
-                        srt_close(remote_fd);
-                    }
+    VALUE opts;
 
-                    break;
+    rb_scan_args(argc, argv, "0:", &opts);
 
-                case SRTS_CLOSED:
-                case SRTS_NONEXIST:
-                case SRTS_BROKEN:
-                    RBSRT_DEBUG_PRINT("removing connection with socket: %d", sock);
+    rb_need_block();
 
-                    srt_epoll_remove_usock(server->epollid, sock);
+    RBSRT_SERVER_UNWRAP(self, server);
 
-                    rb_connection = rb_hash_delete(connections_by_socket, INT2FIX(sock));
+    VALUE workers_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("workers")));
+    VALUE timeout_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("timeout")));
+    VALUE relay_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("relay")));
+    VALUE handlers_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("handlers")));
+    VALUE queue_size_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("queue_size")));
+    VALUE overflow_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("overflow")));
+    VALUE max_connections_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("max_connections")));
+    VALUE max_accept_rate_val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("max_accept_rate")));
+    int num_workers = NIL_P(workers_val) ? 0 : NUM2INT(workers_val);
+    int64_t timeout = NIL_P(timeout_val) ? -1 : NUM2LL(timeout_val);
+    int num_handlers = NIL_P(handlers_val) ? 0 : NUM2INT(handlers_val);
+    long queue_size = NIL_P(queue_size_val) ? RBSRT_DISPATCH_QUEUE_SIZE : NUM2LONG(queue_size_val);
+    rbsrt_dispatch_overflow_t overflow = rbsrt_dispatch_overflow_option(overflow_val);
+    long max_connections = NIL_P(max_connections_val) ? 0 : NUM2LONG(max_connections_val);
+    double max_accept_rate = NIL_P(max_accept_rate_val) ? 0 : NUM2DBL(max_accept_rate_val);
+
+    if (num_workers < 0)
+    {
+        rb_raise(rb_eArgError, "workers must not be negative");
+    }
 
-                    if (RTEST(rb_connection))
-                    {
-                        if (atomic_fetch_sub(&server->num_connections, 1) == 0)
-                        {
-                            DEBUG_ERROR_PRINT("removed to many connections");
-                        }
+    if (num_handlers < 0)
+    {
+        rb_raise(rb_eArgError, "handlers must not be negative");
+    }
 
-                        RBSRT_DEBUG_PRINT("remove connection with socket %d, now %lu sockets", sock, RBSRT_SERVER_NUM_CONNECTIONS(server));
+    if (queue_size < 1)
+    {
+        rb_raise(rb_eArgError, "queue_size must be at least 1");
+    }
 
-                        RBSRT_CONNECTION_UNWRAP(rb_connection, removed_connection);
+    if (max_connections < 0 || max_accept_rate < 0)
+    {
+        rb_raise(rb_eArgError, "max_connections and max_accept_rate must not be negative");
+    }
 
-                        if (removed_connection->at_close_block)
-                        {
-                            rb_funcall(removed_connection->at_close_block, rb_intern("call"), 0);
+    if (timeout < -1)
+    {
+        rb_raise(rb_eArgError, "timeout must be a number of milliseconds, or nil to wait without a timeout");
+    }
 
-                            removed_connection->at_close_block = 0;
-                        }
+    if (server->workers)
+    {
+        rb_raise(rbsrt_eStandardError, "server is already started");
+    }
 
-                        if (removed_connection->at_data_block)
-                        {
-                            removed_connection->at_data_block = 0;
-                        }
-                    }
+    // rb_iv_set(self, rb_intern("acceptor_block"), rb_block_proc());
 
-                    break;
+    server->acceptor_block = rb_block_proc();
+    server->timeout = timeout;
+    server->dispatch_queue_size = queue_size;
+    server->dispatch_overflow = overflow;
+    server->next_tick = srt_time_now() + server->tick_interval;
 
-                case SRTS_CONNECTED:
-                    if (event->events & SRT_EPOLL_IN)
-                    {
-                        RBSRT_DEBUG_PRINT("will read from socket %d (max bytes %d)", sock, read_buf_size);
+    // connections were closed by the last run, their channels are gone
 
-                        nbytes = srt_recvmsg2(event->fd, read_buf, read_buf_size, NULL);
+    rbsrt_relay_release(server->relay);
 
-                        if (nbytes == SRT_ERROR)
-                        {
-                            RBSRT_DEBUG_PRINT("failed to read from socket %d: %s", sock, srt_getlasterror_str());
+    server->relay = RTEST(relay_val) ? rbsrt_relay_create() : NULL;
 
-                            break;
-                        }
+    atomic_store(&server->stopping, 0);
 
-                        if (nbytes > 0)
-                        {
-                            RBSRT_DEBUG_PRINT("received %d bytes from socket %d", nbytes, sock);
+    // the last run closed every accepted connection
 
-                            rb_connection = rb_hash_lookup(connections_by_socket, INT2FIX(sock));
+    atomic_store(&server->num_connections, 0);
 
-                            if (RTEST(rb_connection))
-                            {
-                                RBSRT_DEBUG_PRINT("found connection for socket %d", sock);
+    pthread_mutex_lock(&server->admission.lock);
 
-                                TypedData_Get_Struct(rb_connection, rbsrt_connection_t, &rbsrt_connection_rbtype, connection);
+    server->admission.max_connections = max_connections;
+    server->admission.max_accept_rate = max_accept_rate;
+    server->admission.tokens = max_accept_rate < 1 ? 1 : max_accept_rate;
+    server->admission.refilled = srt_time_now();
 
-                                if (connection->at_data_block)
-                                {
-                                    RBSRT_DEBUG_PRINT("found data handler for socket %d", sock);
+    pthread_mutex_unlock(&server->admission.lock);
 
-                                    VALUE data = rb_str_new(read_buf, nbytes);
+    rbsrt_server_create_workers(server, self, num_workers);
 
-                                    rb_funcall(connection->at_data_block, rb_intern("call"), 1, data);
-                                }
-                            }
-                        }
-                    }
+    int event_types = SRT_EPOLL_IN;
 
-                    // TODO: Handle other events
-                    break;
+    srt_epoll_add_usock(server->workers[0].epollid, server->socket, &event_types);
 
-                default:
-                    break;
-            }
-        }
+    if (num_handlers > 0)
+    {
+        rbsrt_server_start_dispatch(server, num_handlers);
     }
+
+    rb_ensure(rbsrt_server_run, (VALUE)server, rbsrt_server_stop_workers, (VALUE)server);
     
     return Qtrue;
 }
 
 
+
 // MARK: Connections
 
 VALUE rbsrt_server_accept(VALUE self)
@@ -1841,6 +8722,12 @@ void rbsrt_client_deallocate(rbsrt_client_t *client)
         break;
     }
 
+    rbsrt_udp_forwarder_release(client->udp_forwarder);
+
+    rbsrt_udp_ingest_release(client->udp_ingest);
+
+    rbsrt_socket_io_release(client->io);
+
     free(client);
 }
 
@@ -1866,6 +8753,122 @@ VALUE rbsrt_client_initialize(VALUE self)
     return self;
 }
 
+VALUE rbsrt_client_reject_reason(VALUE self)
+{
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    return INT2NUM(srt_getrejectreason(client->socket));
+}
+
+
+// MARK: UDP
+
+VALUE rbsrt_client_forward_udp(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("client forward udp");
+
+    VALUE host, port, opts;
+
+    rb_scan_args(argc, argv, "2:", &host, &port, &opts);
+
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    if (client->udp_forwarder)
+    {
+        rb_raise(rbsrt_eStandardError, "client is already forwarding, call #stop_forwarding first");
+    }
+
+    client->udp_forwarder = rbsrt_udp_forwarder_create(host, port, opts, client->socket);
+
+    return Qtrue;
+}
+
+VALUE rbsrt_client_stop_forwarding(VALUE self)
+{
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    rbsrt_udp_forwarder_t *forwarder = client->udp_forwarder;
+
+    if (!forwarder)
+    {
+        return Qnil;
+    }
+
+    client->udp_forwarder = NULL;
+
+    return rbsrt_udp_forwarder_finish(forwarder);
+}
+
+
+VALUE rbsrt_client_ingest_udp(int argc, VALUE *argv, VALUE self)
+{
+    RBSRT_DEBUG_PRINT("client ingest udp");
+
+    VALUE address, port, opts;
+
+    rb_scan_args(argc, argv, "2:", &address, &port, &opts);
+
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    if (client->udp_ingest)
+    {
+        rb_raise(rbsrt_eStandardError, "client is already ingesting, call #stop_ingest first");
+    }
+
+    client->udp_ingest = rbsrt_udp_ingest_create(address, port, opts, client->socket);
+
+    return Qtrue;
+}
+
+VALUE rbsrt_client_ingest_stats(VALUE self)
+{
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    return client->udp_ingest ? rbsrt_udp_ingest_stats(client->udp_ingest) : Qnil;
+}
+
+VALUE rbsrt_client_stop_ingest(VALUE self)
+{
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    rbsrt_udp_ingest_t *ingest = client->udp_ingest;
+
+    if (!ingest)
+    {
+        return Qnil;
+    }
+
+    client->udp_ingest = NULL;
+
+    return rbsrt_udp_ingest_finish(ingest);
+}
+
+// Stops forwarding and ingesting before closing the socket, so their threads 
+// are not left to be joined when the client is collected.
+VALUE rbsrt_client_close(VALUE self)
+{
+    RBSRT_DEBUG_PRINT("client close");
+
+    RBSRT_CLIENT_UNWRAP(self, client);
+
+    rbsrt_client_stop_forwarding(self);
+
+    if (client->udp_ingest)
+    {
+        // errors of the ingest are only raised by #stop_ingest
+
+        rbsrt_udp_ingest_t *ingest = client->udp_ingest;
+
+        client->udp_ingest = NULL;
+
+        rb_thread_call_without_gvl(rbsrt_udp_ingest_stop_without_gvl, ingest, NULL, NULL);
+
+        rbsrt_udp_ingest_release(ingest);
+    }
+
+    return rbsrt_socket_close(self);
+}
+
 
 // MARK: - SRT::Poll Klass
 
@@ -2182,7 +9185,7 @@ void Init_rbsrt()
     rbsrt_define_socket_state_api(mSRTSocketKlass);
 
     rb_define_method(mSRTSocketKlass, "accept", rbsrt_socket_accept, 0);
-    rb_define_method(mSRTSocketKlass, "bind", rbsrt_socket_bind, 2);
+    rb_define_method(mSRTSocketKlass, "bind", rbsrt_socket_bind, -1);
     rb_define_method(mSRTSocketKlass, "connect", rbsrt_socket_connect, 2);
     rb_define_method(mSRTSocketKlass, "listen", rbsrt_socket_listen, 1);
 
@@ -2194,14 +9197,30 @@ void Init_rbsrt()
 
     rb_define_alloc_func(mSRTServerKlass, rbsrt_server_allocate);
 
-    rb_define_method(mSRTServerKlass, "initialize", rbsrt_server_initialize, 2);
+    rb_define_method(mSRTServerKlass, "initialize", rbsrt_server_initialize, -1);
 
     rbsrt_socket_base_define_base_api(mSRTServerKlass);
     rbsrt_define_socket_state_api(mSRTServerKlass);
     
     rb_define_method(mSRTServerKlass, "close", rbsrt_server_close, 0);
     rb_define_method(mSRTServerKlass, "connection_count", rbsrt_server_connection_count, 0);
-    rb_define_method(mSRTServerKlass, "start", rbsrt_server_start, 0);
+    rb_define_method(mSRTServerKlass, "start", rbsrt_server_start, -1);
+    rb_define_method(mSRTServerKlass, "on_handshake", rbsrt_server_set_handshake_block, -1);
+    rb_define_method(mSRTServerKlass, "decide_streamid", rbsrt_server_decide_streamid, 2);
+    rb_define_method(mSRTServerKlass, "stop", rbsrt_server_stop, 0);
+    rb_define_method(mSRTServerKlass, "relay_channels", rbsrt_server_relay_channels, 0);
+    rb_define_method(mSRTServerKlass, "dropped_events", rbsrt_server_dropped_events, 0);
+    rb_define_method(mSRTServerKlass, "rejected_connections", rbsrt_server_rejected_connections, 0);
+    rb_define_method(mSRTServerKlass, "idle_timeout", rbsrt_server_idle_timeout, 0);
+    rb_define_method(mSRTServerKlass, "idle_timeout=", rbsrt_server_set_idle_timeout, 1);
+    rb_define_method(mSRTServerKlass, "on_tick", rbsrt_server_set_tick_block, 1);
+
+    rb_define_const(mSRTServerKlass, "REJECT_BAD_REQUEST", INT2FIX(SRT_REJX_BAD_REQUEST));
+    rb_define_const(mSRTServerKlass, "REJECT_UNAUTHORIZED", INT2FIX(SRT_REJX_UNAUTHORIZED));
+    rb_define_const(mSRTServerKlass, "REJECT_OVERLOAD", INT2FIX(SRT_REJX_OVERLOAD));
+    rb_define_const(mSRTServerKlass, "REJECT_FORBIDDEN", INT2FIX(SRT_REJX_FORBIDDEN));
+    rb_define_const(mSRTServerKlass, "REJECT_NOT_FOUND", INT2FIX(SRT_REJX_NOTFOUND));
+    rb_define_const(mSRTServerKlass, "REJECT_UNAVAILABLE", INT2FIX(SRT_REJX_DOWN));
 
 
     // SRT::Connection Class
@@ -2215,13 +9234,29 @@ void Init_rbsrt()
     rbsrt_socket_base_define_option_api(mSRTConnectionKlass);
     rbsrt_define_socket_state_api(mSRTConnectionKlass);
 
-    rb_define_method(mSRTConnectionKlass, "sendmsg", rbsrt_socket_sendmsg, 1);
+    rb_define_method(mSRTConnectionKlass, "sendmsg", rbsrt_connection_sendmsg, 1);
     rb_alias(mSRTConnectionKlass, rb_intern("write"), rb_intern("sendmsg"));
+    rb_define_method(mSRTConnectionKlass, "sendmsg_nonblock", rbsrt_socket_sendmsg_nonblock, -1);
+    rb_alias(mSRTConnectionKlass, rb_intern("write_nonblock"), rb_intern("sendmsg_nonblock"));
+    rb_define_method(mSRTConnectionKlass, "sendfile", rbsrt_socket_sendfile, -1);
+    rb_define_method(mSRTConnectionKlass, "send_queue", rbsrt_connection_set_send_queue, -1);
+    rb_define_method(mSRTConnectionKlass, "record_to", rbsrt_connection_record_to, -1);
+    rb_define_method(mSRTConnectionKlass, "stop_recording", rbsrt_connection_stop_recording, 0);
+    rb_define_method(mSRTConnectionKlass, "forward_udp", rbsrt_connection_forward_udp, -1);
+    rb_define_method(mSRTConnectionKlass, "stop_forwarding", rbsrt_connection_stop_forwarding, 0);
+    rb_define_method(mSRTConnectionKlass, "send_queue_size", rbsrt_connection_send_queue_size, 0);
+    rb_define_method(mSRTConnectionKlass, "dropped_messages", rbsrt_connection_dropped_messages, 0);
+    rb_define_method(mSRTConnectionKlass, "dropped_bytes", rbsrt_connection_dropped_bytes, 0);
+    rb_define_method(mSRTConnectionKlass, "dropped_events", rbsrt_connection_dropped_events, 0);
+    rb_define_method(mSRTConnectionKlass, "idle_timeout", rbsrt_connection_idle_timeout, 0);
+    rb_define_method(mSRTConnectionKlass, "idle_timeout=", rbsrt_connection_set_idle_timeout, 1);
+
+    rbsrt_socket_base_define_coalescing_api(mSRTConnectionKlass);
 
 
     // calbacks
 
-    rb_define_method(mSRTConnectionKlass, "at_data", rbsrt_connection_set_at_data_block, 0);
+    rb_define_method(mSRTConnectionKlass, "at_data", rbsrt_connection_set_at_data_block, -1);
     rb_define_method(mSRTConnectionKlass, "at_close", rbsrt_connection_set_at_close_block, 0);
 
     
@@ -2234,6 +9269,12 @@ void Init_rbsrt()
     // SRT::Client methods
 
     rb_define_method(mSRTClientKlass, "initialize", rbsrt_client_initialize, 0);
+    rb_define_method(mSRTClientKlass, "reject_reason", rbsrt_client_reject_reason, 0);
+    rb_define_method(mSRTClientKlass, "forward_udp", rbsrt_client_forward_udp, -1);
+    rb_define_method(mSRTClientKlass, "stop_forwarding", rbsrt_client_stop_forwarding, 0);
+    rb_define_method(mSRTClientKlass, "ingest_udp", rbsrt_client_ingest_udp, -1);
+    rb_define_method(mSRTClientKlass, "ingest_stats", rbsrt_client_ingest_stats, 0);
+    rb_define_method(mSRTClientKlass, "stop_ingest", rbsrt_client_stop_ingest, 0);
 
     rbsrt_socket_base_define_basic_api(mSRTClientKlass);
     rbsrt_socket_base_define_base_api(mSRTClientKlass);
@@ -2242,6 +9283,9 @@ void Init_rbsrt()
     rbsrt_socket_base_define_io_api(mSRTClientKlass);
     rbsrt_define_socket_state_api(mSRTClientKlass);
 
+    // replaces the close of the socket api
+    rb_define_method(mSRTClientKlass, "close", rbsrt_client_close, 0);
+
 
     // SRT::Poll
 
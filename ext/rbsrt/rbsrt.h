@@ -18,6 +18,9 @@
 #define RBSRT_HEADER
 
 #include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
 
 #include <ruby/ruby.h>
 #include <srt/srt.h>
@@ -63,41 +66,398 @@
 
 // MARK: Constants
 
-#define RBSRT_PAYLOAD_SIZE 1316
+#define RBSRT_PAYLOAD_SIZE 1316      // default live mode payload, 7 mpeg-ts packets
+#define RBSRT_MAX_PAYLOAD_SIZE 1456  // largest live mode payload (mtu - udp and srt headers)
+#define RBSRT_UDP_HEADER_SIZE 28     // ip and udp headers srt counts in the mss
+#define RBSRT_PACKET_OVERHEAD 44     // ip, udp and srt headers of a data packet
+#define RBSRT_FILE_RECV_SIZE 65536   // bytes read at once from a file mode socket
+#define RBSRT_TS_PACKET_SIZE 188     // mpeg-ts packet size
+#define RBSRT_COALESCE_DELAY 10      // default ms a coalesced write may be held back
+#define RBSRT_SERVER_MAX_EVENTS 1024 // events handled by a server worker per wait
+#define RBSRT_SERVER_MAX_PENDING 8192 // accepts, closes and messages a server worker delivers per wait
+#define RBSRT_COALESCE_DATA_MAX_BYTES 65536 // default bytes collected for a coalesced at_data call
+#define RBSRT_SEND_QUEUE_MAX_BYTES (1024 * 1024) // default bytes queued for a connection which can't keep up
+#define RBSRT_RECORD_BUFFER_SIZE (1024 * 1024) // default bytes a recording collects before writing
+#define RBSRT_RECORD_FLUSH_INTERVAL 100 // ms recorded data may wait in the buffer
+#define RBSRT_UDP_FORWARD_SLOTS 1024 // datagrams a udp forwarder queues
+#define RBSRT_UDP_FORWARD_BATCH 64   // datagrams sent by a single sendmmsg call
+#define RBSRT_UDP_FORWARD_WAIT 100   // ms a forwarder reading a client waits before checking if it should stop
+#define RBSRT_UDP_DATAGRAM_SIZE 1500 // largest datagram a udp ingest receives, larger ones are dropped
+#define RBSRT_STREAMID_MAX 512       // longest streamid srt accepts
+#define RBSRT_HANDSHAKE_PASSPHRASE_SIZE 80 // longest passphrase plus terminator
+#define RBSRT_HANDSHAKE_CACHE_SIZE 256 // cached handshake decisions
+#define RBSRT_HANDSHAKE_TIMEOUT 5   // default ms a handshake waits for the on_handshake block
+#define RBSRT_ADMISSION_TIMEOUT 5000 // ms an admitted caller holds a connection slot until it is accepted
+#define RBSRT_SERVER_READ_BUF_SIZE (1024 * 1024) // bytes a server worker reads per wait, besides one message
+#define RBSRT_DISPATCH_QUEUE_SIZE 1024 // default events queued for a connection waiting for a handler thread
 
 
 // MARK: - Structs
 
+// NOTE: Every socket like struct starts with the socket followed by the io 
+//       state so they can be unwrapped as a rbsrt_socket_base_t.
+
+typedef struct RBSRTCoalescer
+{
+    SRTSOCKET socket;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    char buf[RBSRT_MAX_PAYLOAD_SIZE];
+    int len;
+    int payload_size;
+    int delay;
+    struct timespec since;
+    int error_code;
+    int stopping;
+    atomic_int interrupted; // the thread stopping the coalescer was interrupted, gives up sending what is left
+    SRT_EPOLL_T epollid; // waits for the socket to become writable
+    atomic_int refs; // the socket, the flusher thread and writes in progress
+} rbsrt_coalescer_t;
+
+typedef struct RBSRTSocketIO
+{
+    SRT_TRANSTYPE transtype;
+    SRT_EPOLL_T read_epollid;
+    SRT_EPOLL_T write_epollid;
+    int coalesce_delay;
+    rbsrt_coalescer_t *coalescer;
+    char *recv_buf;
+    size_t recv_buf_size;
+    atomic_int recv_buf_busy;
+} rbsrt_socket_io_t;
+
 typedef struct RBSRTSocketBase
 {
     SRTSOCKET socket;
+    rbsrt_socket_io_t *io;
 } rbsrt_socket_base_t;
 
 typedef struct RBSRTSocket
 {
     SRTSOCKET socket;
+    rbsrt_socket_io_t *io;
 } rbsrt_socket_t;
 
+typedef enum RBSRTSendQueuePolicy
+{
+    RBSRT_SEND_QUEUE_DROP_OLDEST, // make room by dropping the oldest queued messages
+    RBSRT_SEND_QUEUE_DROP_NEWEST  // drop what does not fit
+} rbsrt_send_queue_policy_t;
+
+typedef struct RBSRTSendQueueEntry
+{
+    struct RBSRTSendQueueEntry *next;
+    int64_t enqueued; // us
+    int len;
+    int offset; // bytes already sent
+    char data[];
+} rbsrt_send_queue_entry_t;
+
+typedef struct RBSRTSendQueue
+{
+    rbsrt_send_queue_entry_t *head;
+    rbsrt_send_queue_entry_t *tail;
+    long num_bytes;
+    long max_bytes;
+    int64_t ttl; // us, 0 keeps messages until they are sent
+    rbsrt_send_queue_policy_t policy;
+    int watching; // the connection is registered for SRT_EPOLL_OUT
+    long dropped_messages;
+    long dropped_bytes;
+} rbsrt_send_queue_t;
+
+typedef struct RBSRTRecorder
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    char *buf; // filled by the server worker
+    char *write_buf; // written to the file by the recorder thread
+    size_t buf_size;
+    size_t buf_len;
+    int fd;
+    char *path; // NULL when recording to a file descriptor
+    int file_index; // 0 without rotation
+    long file_bytes;
+    int64_t opened_at; // us
+    int64_t synced_at; // us
+    int64_t fsync_interval; // us, 0 leaves syncing to the system
+    long rotate_bytes; // 0 never rotates by size
+    int64_t rotate_interval; // us, 0 never rotates by time
+    long recorded_bytes;
+    long dropped_bytes; // received while the buffer was full
+    int error_code; // errno of the first failed write
+    int stopping;
+    int running; // the thread was started and not yet joined
+} rbsrt_recorder_t;
+
+typedef struct RBSRTUDPForwarder
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int fd; // udp socket connected to the destination
+    SRTSOCKET source; // read by the forwarder thread, SRT_INVALID_SOCK when messages are pushed
+    SRT_EPOLL_T epollid; // waits for the source
+    char *slots; // RBSRT_UDP_FORWARD_SLOTS datagrams of up to RBSRT_MAX_PAYLOAD_SIZE bytes
+    int lens[RBSRT_UDP_FORWARD_SLOTS];
+    int head;
+    int count;
+    long sent_datagrams;
+    long dropped_datagrams;
+    int error_code; // errno of the last failed send
+    int stopping;
+    int running; // the thread was started and not yet joined
+} rbsrt_udp_forwarder_t;
+
+typedef struct RBSRTUDPIngest
+{
+    pthread_mutex_t lock; // guards the counters and stopping
+    pthread_t thread;
+    int fd; // bound udp socket
+    SRTSOCKET target;
+    int payload_size; // mpeg-ts aligned
+    char *slots; // RBSRT_UDP_FORWARD_BATCH datagrams of RBSRT_UDP_DATAGRAM_SIZE bytes
+    char packet[RBSRT_MAX_PAYLOAD_SIZE];
+    int packet_len;
+    uint32_t kernel_drops; // SO_RXQ_OVFL count of the last datagram
+    long received_datagrams;
+    long dropped_datagrams; // dropped by the kernel or too large
+    long sent_messages;
+    long dropped_messages; // the client could not take them
+    int error_code;
+    int stopping;
+} rbsrt_udp_ingest_t;
+
+struct RBSRTServerWorker;
+
 typedef struct RBSRTConnection
 {
     SRTSOCKET socket;
+    rbsrt_socket_io_t *io;
     VALUE at_data_block;
     VALUE at_close_block;
+    int coalesce_data;
+    long coalesce_max_bytes;
+    int64_t coalesce_max_delay; // us
+    VALUE coalesced_data;
+    int64_t coalesced_since;
+    int coalescing; // listed in the worker's coalescing connections
+    SRT_EPOLL_T epollid; // epoll of the worker handling the connection
+    struct RBSRTServerWorker *worker; // worker handling the connection, NULL when not accepted or closed
+    rbsrt_send_queue_t *send_queue;
+    rbsrt_recorder_t *recorder;
+    rbsrt_udp_forwarder_t *udp_forwarder;
+    VALUE dispatch_events; // data strings, and false for the close, waiting for a handler thread
+    int dispatch_scheduled; // listed in the server's dispatch queue or run by a handler thread
+    long dropped_events; // at_data calls dropped because the handlers fell behind
+    int64_t idle_timeout; // ms, 0 uses the server's idle timeout, -1 never times out
+    int64_t last_active; // us, when the connection was accepted or last received data
+    int idle_timer; // listed in the timer wheel of its worker
+    long idle_slot; // slot of the timer wheel listing the connection
+    long idle_index; // position of the connection in its slot
 } rbsrt_connection_t;
 
+typedef struct RBSRTHandshakeDecision
+{
+    int accept;
+    int reject_reason;
+    char passphrase[RBSRT_HANDSHAKE_PASSPHRASE_SIZE]; // empty to keep the server's passphrase
+    int latency; // ms, -1 to keep the server's latency
+} rbsrt_handshake_decision_t;
+
+typedef struct RBSRTHandshakeCacheEntry
+{
+    char streamid[RBSRT_STREAMID_MAX + 1];
+    char host[INET6_ADDRSTRLEN]; // of the peer, decisions may depend on it
+    rbsrt_handshake_decision_t decision;
+    int64_t expires; // us, 0 when the entry is unused
+} rbsrt_handshake_cache_entry_t;
+
+typedef struct RBSRTHandshakeRule
+{
+    char streamid[RBSRT_STREAMID_MAX + 1];
+    rbsrt_handshake_decision_t decision;
+} rbsrt_handshake_rule_t;
+
+typedef enum RBSRTHandshakeState
+{
+    RBSRT_HANDSHAKE_IDLE,
+    RBSRT_HANDSHAKE_PENDING,   // waiting for the ruby thread
+    RBSRT_HANDSHAKE_TAKEN,     // the ruby thread runs the block
+    RBSRT_HANDSHAKE_DECIDED,   // waiting for the listen callback to pick up the decision
+    RBSRT_HANDSHAKE_ABANDONED  // the listen callback timed out
+} rbsrt_handshake_state_t;
+
+typedef struct RBSRTHandshake
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rbsrt_handshake_state_t state;
+    char streamid[RBSRT_STREAMID_MAX + 1];
+    char peer[INET6_ADDRSTRLEN + 8];
+    char host[INET6_ADDRSTRLEN];
+    rbsrt_handshake_decision_t decision;
+    int running; // a ruby thread runs the on_handshake block
+    int interrupted;
+    int64_t timeout; // ms the listen callback waits for the on_handshake block
+    int64_t cache_ttl; // us, 0 disables the cache
+    rbsrt_handshake_cache_entry_t cache[RBSRT_HANDSHAKE_CACHE_SIZE];
+    rbsrt_handshake_rule_t *rules; // decisions set by #decide_streamid, sorted by streamid
+    long num_rules;
+    long rules_capacity;
+} rbsrt_handshake_t;
+
+typedef struct RBSRTConnectionTableEntry
+{
+    SRTSOCKET socket; // SRT_INVALID_SOCK when the slot is empty
+    rbsrt_connection_t *connection;
+    VALUE rb_connection;
+} rbsrt_connection_table_entry_t;
+
+typedef struct RBSRTConnectionTable
+{
+    rbsrt_connection_table_entry_t *entries;
+    size_t capacity; // power of 2
+    size_t count;
+} rbsrt_connection_table_t;
+
+typedef struct RBSRTRelayChannel
+{
+    char resource_name[RBSRT_STREAMID_MAX + 1];
+    SRTSOCKET publisher; // SRT_INVALID_SOCK while no publisher is connected
+    SRTSOCKET *subscribers;
+    int num_subscribers;
+    int max_subscribers;
+    long forwarded_messages;
+    long dropped_messages; // messages a subscriber could not take
+} rbsrt_relay_channel_t;
+
+typedef struct RBSRTRelayPublisher
+{
+    SRTSOCKET socket; // SRT_INVALID_SOCK when the slot is empty
+    int channel; // index into the relay's channels
+} rbsrt_relay_publisher_t;
+
+typedef struct RBSRTRelay
+{
+    pthread_mutex_t lock;
+    rbsrt_relay_channel_t *channels;
+    int num_channels;
+    int max_channels;
+    rbsrt_relay_publisher_t *publishers; // open addressing table of the channels by publisher, NULL to scan the channels
+    size_t publishers_capacity; // power of 2
+} rbsrt_relay_t;
+
+typedef struct RBSRTAdmittedCaller
+{
+    SRTSOCKET socket; // created by srt for the caller, returned by srt_accept once the handshake is done
+    int64_t expires; // us, when the caller no longer holds a connection slot
+} rbsrt_admitted_caller_t;
+
+typedef struct RBSRTAdmission
+{
+    pthread_mutex_t lock;
+    long max_connections; // 0 for no limit
+    rbsrt_admitted_caller_t *callers; // admitted but not yet accepted, only tracked with max_connections
+    long num_callers;
+    long callers_capacity;
+    double max_accept_rate; // connections per second, 0 for no limit
+    double tokens; // callers which may be admitted right away
+    int64_t refilled; // us, when tokens were last added
+    long rejected_max_connections;
+    long rejected_max_accept_rate;
+} rbsrt_admission_t;
+
+typedef enum RBSRTDispatchOverflow
+{
+    RBSRT_DISPATCH_OVERFLOW_DROP,       // drop the new data
+    RBSRT_DISPATCH_OVERFLOW_BLOCK,      // wait for the handlers, holding up the worker
+    RBSRT_DISPATCH_OVERFLOW_DISCONNECT  // close the connection
+} rbsrt_dispatch_overflow_t;
+
+typedef enum RBSRTServerEventType
+{
+    RBSRT_SERVER_EVENT_ACCEPT,
+    RBSRT_SERVER_EVENT_DATA,
+    RBSRT_SERVER_EVENT_WRITE,
+    RBSRT_SERVER_EVENT_CLOSE
+} rbsrt_server_event_type_t;
+
+typedef struct RBSRTServerEvent
+{
+    SRTSOCKET socket;
+    rbsrt_server_event_type_t type;
+    long offset;
+    int len;
+} rbsrt_server_event_t;
+
+struct RBSRTServer;
+
+typedef struct RBSRTServerWorker
+{
+    struct RBSRTServer *server;
+    VALUE rbserver;
+    SRT_EPOLL_T epollid;
+    int wake_fds[2]; // pipe waking the worker's wait
+    SRTSOCKET *readfds;
+    SRTSOCKET *writefds;
+    SRT_EPOLL_EVENT *events;
+    rbsrt_server_event_t *pending;
+    int num_pending;
+    char *read_buf;
+    long read_buf_size;
+    long read_buf_len;
+    int message_size;
+    int large_messages; // message api connections, read_buf grows with their messages
+    int64_t wait_timeout; // ms, -1 to wait until woken
+    VALUE coalescing; // connections holding coalesced data
+    int64_t now; // us, when the last wait returned
+    VALUE timer_slots; // timer wheel, an array of arrays of connections
+    int64_t timer_tick; // last tick handled by the timer wheel
+    VALUE thread;
+} rbsrt_server_worker_t;
+
 typedef struct RBSRTServer
 {
     SRTSOCKET socket;
+    rbsrt_socket_io_t *io;
     int flags; // TODO: Deprecate flags
     atomic_size_t num_connections;
-    SRT_EPOLL_T epollid;
+    rbsrt_connection_table_t connections;
     VALUE acceptor_block;
+    VALUE handshake_block;
+    rbsrt_handshake_t *handshake;
+    VALUE handshake_thread;
+    rbsrt_server_worker_t *workers; // workers[0] runs on the thread which started the server
+    int num_workers;
+    int next_worker;
+    int64_t timeout; // ms between wakeups of idle workers, -1 for none
+    atomic_int stopping;
+    rbsrt_relay_t *relay; // forwards publishers to their subscribers, NULL when not relaying
+    VALUE dispatch_queue; // Thread::Queue of connections with events, 0 when workers call the blocks
+    VALUE dispatch_threads;
+    VALUE dispatch_lock; // Thread::Mutex of dispatch_space
+    VALUE dispatch_space; // Thread::ConditionVariable signalled when handlers take events
+    int dispatch_waiting; // workers waiting for dispatch_space
+    long dispatch_queue_size; // events queued per connection
+    rbsrt_dispatch_overflow_t dispatch_overflow;
+    long dropped_events;
+    int64_t idle_timeout; // ms, 0 never times out
+    VALUE tick_block;
+    int64_t tick_interval; // us
+    int64_t next_tick; // us
+    rbsrt_admission_t admission; // checked by the listen callback, before srt accepts a caller
 } rbsrt_server_t;
 
 typedef struct RBSRTClient
 {
     SRTSOCKET socket;
+    rbsrt_socket_io_t *io;
     int flags; // TODO: Deprecate flags
+    rbsrt_udp_forwarder_t *udp_forwarder;
+    rbsrt_udp_ingest_t *udp_ingest;
 } rbsrt_client_t;
 
 typedef struct RBSRTPoll
@@ -114,6 +474,10 @@ typedef struct RBSRTStats
 
 // MARK: - Ruby Struct Headers
 
+// MARK: Socket IO
+
+void rbsrt_socket_io_release(rbsrt_socket_io_t *io);
+
 // MARK: SRT::Socket Class
 
 size_t rbsrt_socket_dsize(const void *socket);
@@ -261,5 +625,6 @@ TypedData_Get_Struct(input, rbsrt_stats_t, &rbsrt_stats_rbtype, output);
 // MARK: - Errors
 
 _Noreturn void rbsrt_raise_last_srt_error(void);
+_Noreturn void rbsrt_raise_srt_error(int error_code);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,848 @@
+require 'minitest/spec'
+
+require "rbsrt"
+require "thread"
+require "tmpdir"
+require "socket"
+
+describe SRT::Server do
+
+  def start_server(port, **opts, &block)
+    server = SRT::Server.new "127.0.0.1", port.to_s
+
+    thread = Thread.new { server.start(**opts, &block) }
+
+    sleep 0.1
+
+    [server, thread]
+  end
+
+  def connect_client(port)
+    client = SRT::Client.new
+    client.connect "127.0.0.1", port.to_s
+    client
+  end
+
+  describe "workers" do
+    it "delivers data from connections spread over workers" do
+      received = Queue.new
+
+      server, thread = start_server(6800, workers: 2) do |connection|
+        connection.at_data { |chunk| received << chunk }
+        true
+      end
+
+      clients = 4.times.map { connect_client(6800) }
+
+      sleep 0.2
+
+      clients.each_with_index { |client, i| client.sendmsg "client #{i}" }
+
+      messages = 4.times.map { received.pop }
+
+      assert_equal 4.times.map { |i| "client #{i}" }.sort, messages.sort
+      assert_equal 4, server.connection_count
+    ensure
+      clients.each(&:close) if clients
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "does not accept a negative number of workers" do
+      server = SRT::Server.new "127.0.0.1", "6801"
+
+      assert_raises(ArgumentError) { server.start(workers: -1) { true } }
+    ensure
+      server.close if server
+    end
+  end
+
+  describe "reading" do
+    it "delivers a burst of messages in order" do
+      received = Queue.new
+
+      server, thread = start_server(6802) do |connection|
+        connection.at_data { |chunk| received << chunk }
+        true
+      end
+
+      client = connect_client(6802)
+
+      sleep 0.1
+
+      100.times { |i| client.sendmsg "message #{i}" }
+
+      assert_equal 100.times.map { |i| "message #{i}" }, 100.times.map { received.pop }
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+  end
+
+  describe "coalesced data" do
+    it "delivers messages joined in fewer calls" do
+      received = Queue.new
+
+      server, thread = start_server(6803) do |connection|
+        connection.at_data(coalesce: true, max_delay: 50) { |chunk| received << chunk }
+        true
+      end
+
+      client = connect_client(6803)
+
+      sleep 0.1
+
+      20.times { |i| client.sendmsg "%02d" % i }
+
+      data = String.new
+
+      chunks = 0
+
+      while data.bytesize < 40
+        data << received.pop
+        chunks += 1
+      end
+
+      assert_equal 20.times.map { |i| "%02d" % i }.join, data
+      assert_operator chunks, :<, 20
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "delivers when max_bytes is reached" do
+      received = Queue.new
+
+      server, thread = start_server(6804) do |connection|
+        connection.at_data(coalesce: true, max_bytes: 10, max_delay: 10_000) { |chunk| received << chunk }
+        true
+      end
+
+      client = connect_client(6804)
+
+      sleep 0.1
+
+      client.sendmsg "0123456789"
+
+      assert_equal "0123456789", received.pop
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+  end
+
+  describe "connections" do
+    it "routes data and closes for many connections" do
+      received = Queue.new
+      closed = Queue.new
+
+      server, thread = start_server(6805) do |connection|
+        connection.at_data { |chunk| received << [connection, chunk] }
+        connection.at_close { closed << connection }
+        true
+      end
+
+      clients = 70.times.map { connect_client(6805) }
+
+      sleep 0.5
+
+      assert_equal 70, server.connection_count
+
+      clients.first(35).each(&:close)
+
+      35.times { closed.pop }
+
+      clients.last(35).each_with_index { |client, i| client.sendmsg "client #{i}" }
+
+      messages = 35.times.map { received.pop }
+
+      assert_equal 35, messages.map(&:first).uniq.size
+      assert_equal 35.times.map { |i| "client #{i}" }.sort, messages.map(&:last).sort
+      assert_equal 35, server.connection_count
+    ensure
+      clients.each(&:close) if clients
+      thread.kill.join if thread
+      server.close if server
+    end
+  end
+
+  describe "on_handshake" do
+    it "rejects callers before they are accepted" do
+      accepted = Queue.new
+
+      server = SRT::Server.new "127.0.0.1", "6806"
+
+      server.on_handshake(timeout: 100) do |streamid, peer|
+        assert_match(/\A127\.0\.0\.1:\d+\z/, peer)
+
+        streamid == "good" ? true : SRT::Server::REJECT_FORBIDDEN
+      end
+
+      thread = Thread.new { server.start { |connection| accepted << connection.streamid; true } }
+
+      sleep 0.1
+
+      bad = SRT::Client.new
+      bad.streamid = "bad"
+
+      assert_raises(SRT::Error) { bad.connect "127.0.0.1", "6806" }
+
+      good = SRT::Client.new
+      good.streamid = "good"
+      good.connect "127.0.0.1", "6806"
+
+      assert_equal "good", accepted.pop
+    ensure
+      good.close if good
+      bad.close if bad
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "caches decisions by streamid" do
+      calls = 0
+
+      server = SRT::Server.new "127.0.0.1", "6807"
+
+      server.on_handshake(cache_ttl: 10_000, timeout: 100) { |streamid, peer| calls += 1; true }
+
+      thread = Thread.new { server.start { true } }
+
+      sleep 0.1
+
+      clients = 3.times.map do
+        client = SRT::Client.new
+        client.streamid = "cached"
+        client.connect "127.0.0.1", "6807"
+        client
+      end
+
+      assert_equal 1, calls
+    ensure
+      clients.each(&:close) if clients
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "decides streamids without calling into ruby" do
+      accepted = Queue.new
+      calls = 0
+
+      server = SRT::Server.new "127.0.0.1", "6836"
+      server.on_handshake { |streamid, peer| calls += 1; true }
+      server.decide_streamid "good", true
+      server.decide_streamid "bad", SRT::Server::REJECT_FORBIDDEN
+
+      thread = Thread.new { server.start { |connection| accepted << connection.streamid; true } }
+
+      sleep 0.1
+
+      bad = SRT::Client.new
+      bad.streamid = "bad"
+
+      assert_raises(SRT::Error) { bad.connect "127.0.0.1", "6836" }
+      assert_equal SRT::Server::REJECT_FORBIDDEN, bad.reject_reason
+
+      good = SRT::Client.new
+      good.streamid = "good"
+      good.connect "127.0.0.1", "6836"
+
+      assert_equal "good", accepted.pop
+      assert_equal 0, calls
+    ensure
+      good.close if good
+      bad.close if bad
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+  end
+
+  describe "stop" do
+    it "returns from start and closes connections" do
+      closed = Queue.new
+
+      server, thread = start_server(6808, workers: 1) do |connection|
+        connection.at_close { closed << true }
+        true
+      end
+
+      client = connect_client(6808)
+
+      sleep 0.1
+
+      server.stop
+
+      refute_nil thread.join(1)
+      assert closed.pop
+      assert_equal 0, server.connection_count
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "does not accept a negative timeout" do
+      server = SRT::Server.new "127.0.0.1", "6809"
+
+      assert_raises(ArgumentError) { server.start(timeout: -2) { true } }
+    ensure
+      server.close if server
+    end
+  end
+
+  describe "binding" do
+    it "binds to a host name with a larger backlog" do
+      server = SRT::Server.new "localhost", "6810", backlog: 64
+
+      thread = Thread.new { server.start { true } }
+
+      sleep 0.1
+
+      client = SRT::Client.new
+      client.connect "localhost", "6810"
+
+      assert client.connected?
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "does not accept an empty backlog" do
+      assert_raises(ArgumentError) { SRT::Server.new "127.0.0.1", "6811", backlog: 0 }
+    end
+  end
+
+  describe "send queue" do
+    it "sends through the queue" do
+      server, thread = start_server(6812) do |connection|
+        connection.send_queue
+        connection.sendmsg "hello"
+        true
+      end
+
+      client = connect_client(6812)
+
+      assert_equal "hello", client.recvmsg
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "drops messages instead of failing when the peer can't keep up" do
+      connections = Queue.new
+
+      server, thread = start_server(6813) do |connection|
+        connection.send_queue max_bytes: 1316 * 10
+        connections << connection
+        true
+      end
+
+      client = connect_client(6813)
+      connection = connections.pop
+
+      20_000.times { assert_equal 1316, connection.sendmsg("x" * 1316) }
+
+      assert_operator connection.send_queue_size, :<=, 1316 * 10
+      assert_operator connection.dropped_messages, :>, 0
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "only accepts known policies" do
+      assert_raises(ArgumentError) { SRT::Connection.new.send_queue policy: :block }
+    end
+  end
+
+  describe "relay" do
+    def connect_stream(port, mode)
+      client = SRT::Client.new
+      client.streamid = SRT::StreamIDComponents.new(resource_name: "live", mode: mode).to_s
+      client.connect "127.0.0.1", port.to_s
+      client
+    end
+
+    it "forwards published messages to subscribers" do
+      server, thread = start_server(6815, relay: true) { true }
+
+      subscribers = 2.times.map { connect_stream(6815, :request) }
+      publisher = connect_stream(6815, :publish)
+
+      sleep 0.1
+
+      publisher.sendmsg "hello"
+
+      subscribers.each { |subscriber| assert_equal "hello", subscriber.recvmsg }
+
+      channel = server.relay_channels["live"]
+
+      assert channel[:publisher]
+      assert_equal 2, channel[:subscribers]
+      assert_equal 1, channel[:forwarded_messages]
+    ensure
+      subscribers.each(&:close) if subscribers
+      publisher.close if publisher
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "rejects a second publisher" do
+      server, thread = start_server(6816, relay: true) { true }
+
+      publisher = connect_stream(6816, :publish)
+      second = connect_stream(6816, :publish) rescue nil
+
+      sleep 0.2
+
+      assert_equal 1, server.connection_count
+    ensure
+      second.close if second
+      publisher.close if publisher
+      thread.kill.join if thread
+      server.close if server
+    end
+  end
+
+  describe "recording" do
+    it "writes received messages to a file" do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "recording.ts")
+        stats = Queue.new
+
+        server, thread = start_server(6817) do |connection|
+          connection.record_to path
+          connection.at_close { stats << connection.stop_recording }
+          true
+        end
+
+        client = connect_client(6817)
+
+        10.times { |i| client.sendmsg i.to_s * 1316 }
+
+        sleep 0.2
+
+        client.close
+
+        assert_equal 1316 * 10, stats.pop[:bytes]
+        assert_equal 10.times.map { |i| i.to_s * 1316 }.join, File.binread(path)
+      ensure
+        thread.kill.join if thread
+        server.close if server
+      end
+    end
+
+    it "rotates files by size" do
+      Dir.mktmpdir do |dir|
+        stats = Queue.new
+
+        server, thread = start_server(6818) do |connection|
+          connection.record_to File.join(dir, "recording.ts"), rotate_bytes: 1316
+          connection.at_close { stats << connection.stop_recording }
+          true
+        end
+
+        client = connect_client(6818)
+
+        3.times do
+          client.sendmsg "x" * 1316
+          sleep 0.2
+        end
+
+        client.close
+
+        assert_equal 3, stats.pop[:files]
+        assert_equal ["recording-1.ts", "recording-2.ts", "recording-3.ts"], Dir.children(dir).sort
+      ensure
+        thread.kill.join if thread
+        server.close if server
+      end
+    end
+
+    it "needs a path to rotate" do
+      assert_raises(ArgumentError) { SRT::Connection.new.record_to $stdout, rotate_bytes: 1316 }
+    end
+  end
+
+  describe "udp forwarding" do
+    it "forwards received messages to a udp destination" do
+      udp = UDPSocket.new
+      udp.bind "127.0.0.1", 0
+
+      server, thread = start_server(6819) do |connection|
+        connection.forward_udp "127.0.0.1", udp.addr[1], ttl: 1
+        true
+      end
+
+      client = connect_client(6819)
+
+      3.times { |i| client.sendmsg i.to_s * 1316 }
+
+      3.times { |i| assert_equal i.to_s * 1316, udp.recvfrom(2048).first }
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+      udp.close if udp
+    end
+
+    it "forwards from a client" do
+      udp = UDPSocket.new
+      udp.bind "127.0.0.1", 0
+
+      connections = Queue.new
+
+      server, thread = start_server(6820) do |connection|
+        connections << connection
+        true
+      end
+
+      client = connect_client(6820)
+      client.forward_udp "127.0.0.1", udp.addr[1]
+
+      connections.pop.sendmsg "hello"
+
+      assert_equal "hello", udp.recvfrom(2048).first
+      assert_equal 1, client.stop_forwarding[:datagrams]
+    ensure
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+      udp.close if udp
+    end
+
+    it "stops forwarding when the client is closed" do
+      udp = UDPSocket.new
+      udp.bind "127.0.0.1", 0
+
+      server, thread = start_server(6832) { true }
+
+      client = connect_client(6832)
+      client.forward_udp "127.0.0.1", udp.addr[1]
+      client.close
+
+      assert_nil client.stop_forwarding
+    ensure
+      thread.kill.join if thread
+      server.close if server
+      udp.close if udp
+    end
+  end
+
+  describe "udp ingest" do
+    it "sends received datagrams as payload sized messages" do
+      received = Queue.new
+
+      server, thread = start_server(6821) do |connection|
+        connection.at_data { |chunk| received << chunk }
+        true
+      end
+
+      client = connect_client(6821)
+      client.ingest_udp "127.0.0.1", "6822"
+
+      udp = UDPSocket.new
+      udp.connect "127.0.0.1", 6822
+
+      # two payloads worth of ts packets, sent as 10 datagrams of 2 packets
+
+      10.times { |i| udp.send(i.to_s * 188 * 2, 0) }
+
+      assert_equal 1316, received.pop.bytesize
+      assert_equal 1316, received.pop.bytesize
+      assert_equal 188 * 6, received.pop.bytesize
+
+      stats = client.stop_ingest
+
+      assert_equal 10, stats[:datagrams]
+      assert_equal 3, stats[:messages]
+    ensure
+      udp.close if udp
+      client.close if client
+      thread.kill.join if thread
+      server.close if server
+    end
+
+    it "stops ingesting when the client is closed" do
+      server, thread = start_server(6833) { true }
+
+      client = connect_client(6833)
+      client.ingest_udp "127.0.0.1", "6834"
+      client.close
+
+      assert_nil client.ingest_stats
+    ensure
+      thread.kill.join if thread
+      server.close if server
+    end
+  end
+
+  describe "handlers" do
+    it "keeps delivering data while a block of another connection is slow" do
+      gate = Queue.new
+      received = Queue.new
+      accepted = 0
+
+      server, thread = start_server(6823, handlers: 2) do |connection|
+        slow = (accepted += 1) == 1
+
+        connection.at_data do |chunk|
+          gate.pop if slow
+          received << chunk
+        end
+
+        true
+      end
+
+      slow_client = connect_client(6823)
+      sleep 0.1
+      fast_client = connect_client(6823)
+      sleep 0.2
+
+      slow_client.sendmsg "slow"
+      fast_client.sendmsg "fast"
+
+      assert_equal "fast", received.pop
+
+      gate << true
+
+      assert_equal "slow", received.pop
+    ensure
+      gate << true if gate
+      slow_client.close if slow_client
+      fast_client.close if fast_client
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+
+    it "counts data dropped while the handlers fall behind" do
+      gate = Queue.new
+      connections = Queue.new
+
+      server, thread = start_server(6824, handlers: 1, queue_size: 1, overflow: :drop) do |connection|
+        connection.at_data { |chunk| gate.pop }
+        connections << connection
+        true
+      end
+
+      client = connect_client(6824)
+      connection = connections.pop
+
+      client.sendmsg "taken by the handler"
+
+      sleep 0.1
+
+      # one message waits in the queue, the others are dropped
+
+      3.times { |i| client.sendmsg "message #{i}" }
+
+      sleep 0.2
+
+      assert_equal 2, connection.dropped_events
+      assert_equal 2, server.dropped_events
+    ensure
+      4.times { gate << true } if gate
+      client.close if client
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+
+    it "handles the queued events of a connection when stopped" do
+      gate = Queue.new
+      closed = Queue.new
+      received = 0
+
+      server, thread = start_server(6837, handlers: 1) do |connection|
+        connection.at_data { |chunk| gate.pop if (received += 1) == 1 }
+        connection.at_close { closed << true }
+        true
+      end
+
+      client = connect_client(6837)
+
+      sleep 0.1
+
+      100.times { |i| client.sendmsg "message #{i}" }
+
+      sleep 0.2
+
+      stopper = Thread.new { server.stop }
+
+      sleep 0.1
+
+      gate << true
+
+      stopper.join
+      thread.join
+
+      assert_equal 100, received
+      assert closed.pop
+    ensure
+      gate << true if gate
+      client.close if client
+      server.close if server
+    end
+
+    it "rejects an unknown overflow policy" do
+      server = SRT::Server.new "127.0.0.1", "6825"
+
+      assert_raises(ArgumentError) { server.start(handlers: 1, overflow: :wait) { true } }
+    ensure
+      server.close if server
+    end
+  end
+
+  describe "idle timeout" do
+    it "closes connections which stop sending data" do
+      closed = Queue.new
+      accepted = 0
+
+      server = SRT::Server.new "127.0.0.1", "6826"
+      server.idle_timeout = 300
+
+      thread = Thread.new do
+        server.start do |connection|
+          name = (accepted += 1) == 1 ? :idle : :kept
+          connection.idle_timeout = 0 if name == :kept
+          connection.at_close { closed << name }
+          true
+        end
+      end
+
+      sleep 0.1
+
+      idle_client = connect_client(6826)
+      kept_client = connect_client(6826)
+
+      assert_equal :idle, closed.pop
+      sleep 0.3
+      assert_equal 1, server.connection_count
+    ensure
+      idle_client.close if idle_client
+      kept_client.close if kept_client
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+
+    it "calls the on_tick block periodically" do
+      ticks = Queue.new
+
+      server = SRT::Server.new "127.0.0.1", "6827"
+      server.on_tick(50) { |s| ticks << s }
+
+      thread = Thread.new { server.start { true } }
+
+      3.times { assert_equal server, ticks.pop }
+    ensure
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+  end
+
+  describe "admission" do
+    it "rejects callers while the server has max_connections" do
+      server, thread = start_server(6828, max_connections: 1) { true }
+
+      first = connect_client(6828)
+
+      sleep 0.1
+
+      rejected = SRT::Client.new
+
+      assert_raises(SRT::Error) { rejected.connect "127.0.0.1", "6828" }
+      assert_equal SRT::Server::REJECT_UNAVAILABLE, rejected.reject_reason
+      assert_equal 1, server.rejected_connections[:max_connections]
+      assert_equal 1, server.connection_count
+
+      first.close
+
+      sleep 0.2
+
+      assert_equal 0, server.connection_count
+
+      second = connect_client(6828)
+
+      assert second.connected?
+    ensure
+      rejected.close if rejected
+      second.close if second
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+
+    it "rejects callers coming in faster than max_accept_rate" do
+      server, thread = start_server(6829, max_accept_rate: 1) { true }
+
+      first = connect_client(6829)
+      rejected = SRT::Client.new
+
+      assert_raises(SRT::Error) { rejected.connect "127.0.0.1", "6829" }
+      assert_equal SRT::Server::REJECT_OVERLOAD, rejected.reject_reason
+      assert_equal 1, server.rejected_connections[:max_accept_rate]
+    ensure
+      first.close if first
+      rejected.close if rejected
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+
+    it "frees the slot of a caller which fails after it was admitted" do
+      server = SRT::Server.new "127.0.0.1", "6835"
+      server.decide_streamid "secret", passphrase: "correct passphrase"
+
+      thread = Thread.new { server.start(max_connections: 1) { true } }
+
+      sleep 0.1
+
+      wrong = SRT::Client.new
+      wrong.streamid = "secret"
+      wrong.passphrase = "wrong passphrase"
+
+      assert_raises(SRT::Error) { wrong.connect "127.0.0.1", "6835" }
+
+      sleep 0.2
+
+      right = SRT::Client.new
+      right.streamid = "secret"
+      right.passphrase = "correct passphrase"
+      right.connect "127.0.0.1", "6835"
+
+      assert right.connected?
+      assert_equal 0, server.rejected_connections[:max_connections]
+    ensure
+      wrong.close if wrong
+      right.close if right
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+
+    it "does not count rejected connections" do
+      server, thread = start_server(6830) { false }
+
+      client = SRT::Client.new
+      client.connect "127.0.0.1", "6830" rescue nil
+
+      sleep 0.2
+
+      assert_equal 0, server.connection_count
+    ensure
+      client.close if client
+      server.stop if server
+      thread.join if thread
+      server.close if server
+    end
+  end
+end
@@ -0,0 +1,344 @@
+require 'minitest/spec'
+
+require "rbsrt"
+require "thread"
+require "timeout"
+require "tempfile"
+
+describe SRT::Socket do
+
+  before do
+    @server = SRT::Socket.new
+    @server.bind "127.0.0.1", "6790"
+    @server.listen 2
+
+    @client = SRT::Socket.new
+    @client.connect "127.0.0.1", "6790"
+
+    @remote_client = @server.accept
+  end
+
+  after do
+    @remote_client.close if @remote_client
+    @client.close if @client
+    @server.close if @server
+  end
+
+  describe "sendmsg" do
+    it "sends buffers larger than a single payload" do
+      payload = "x" * (1316 * 64 + 100)
+
+      received = String.new
+
+      reader = Thread.new do
+        while received.bytesize < payload.bytesize
+          received << @remote_client.recvmsg
+        end
+      end
+
+      assert_equal payload.bytesize, @client.sendmsg(payload)
+
+      reader.join 5
+
+      assert_equal payload.bytesize, received.bytesize
+    end
+
+    it "packs an array of strings into payload sized messages" do
+      parts = ["a" * 100, "b" * 200, "c" * 1316]
+
+      assert_equal 1616, @client.sendmsg(parts)
+
+      assert_equal ("a" * 100) + ("b" * 200) + ("c" * 1016), @remote_client.recvmsg
+      assert_equal "c" * 300, @remote_client.recvmsg
+    end
+
+    it "only accepts strings in an array" do
+      assert_raises(ArgumentError) { @client.sendmsg ["a", 1] }
+    end
+  end
+
+  describe "recvmsg" do
+    it "does not block other threads while waiting for data" do
+      reader = Thread.new { @remote_client.recvmsg }
+
+      sleep 0.1
+
+      assert_equal "sleep", reader.status
+
+      @client.sendmsg "hello"
+
+      assert_equal "hello", reader.value
+    end
+
+    it "can be interrupted by a timeout" do
+      assert_raises(Timeout::Error) do
+        Timeout.timeout(0.2) { @remote_client.recvmsg }
+      end
+    end
+
+    it "fills a caller supplied buffer" do
+      buffer = String.new("previous contents")
+
+      @client.sendmsg "hello"
+
+      assert_same buffer, @remote_client.recvmsg(buffer)
+      assert_equal "hello", buffer
+
+      @client.sendmsg "hi"
+
+      assert_same buffer, @remote_client.read_into(buffer)
+      assert_equal "hi", buffer
+    end
+
+    it "does not fill a frozen buffer" do
+      assert_raises(FrozenError) { @remote_client.recvmsg "".freeze }
+    end
+
+    it "can be killed" do
+      reader = Thread.new { @remote_client.recvmsg }
+
+      sleep 0.1
+
+      reader.kill
+
+      refute_nil reader.join(1)
+    end
+  end
+
+  describe "recvmsg_batch" do
+    it "reads all queued messages at once" do
+      3.times { |i| @client.sendmsg "message #{i}" }
+
+      sleep 0.1
+
+      assert_equal ["message 0", "message 1", "message 2"], @remote_client.recvmsg_batch(10)
+    end
+
+    it "stops at max_messages" do
+      3.times { |i| @client.sendmsg "message #{i}" }
+
+      sleep 0.1
+
+      assert_equal "message 0message 1", @remote_client.recvmsg_batch(2, join: true)
+      assert_equal ["message 2"], @remote_client.recvmsg_batch(2)
+    end
+
+    it "stops once max_bytes have been read" do
+      3.times { |i| @client.sendmsg "message #{i}" }
+
+      sleep 0.1
+
+      assert_equal ["message 0", "message 1"], @remote_client.recvmsg_batch(10, 10)
+      assert_equal ["message 2"], @remote_client.recvmsg_batch(10, 10)
+    end
+  end
+
+  describe "payload size" do
+    it "defaults to 7 mpeg-ts packets in live mode" do
+      assert_equal 1316, @client.payload_size
+    end
+
+    it "splits live mode sends at the configured payload size" do
+      server = SRT::Socket.new
+      server.payload_size = 188 * 5
+      server.bind "127.0.0.1", "6791"
+      server.listen 2
+
+      client = SRT::Socket.new
+      client.payload_size = 188 * 5
+      client.connect "127.0.0.1", "6791"
+
+      remote_client = server.accept
+
+      assert_equal 2000, client.sendmsg("x" * 2000)
+
+      assert_equal 940, remote_client.recvmsg.bytesize
+      assert_equal 940, remote_client.recvmsg.bytesize
+      assert_equal 120, remote_client.recvmsg.bytesize
+    ensure
+      remote_client.close if remote_client
+      client.close if client
+      server.close if server
+    end
+  end
+
+  describe "write coalescing" do
+    it "only sends full mpeg-ts aligned payloads" do
+      @client.coalesce_writes = true
+
+      10.times { @client.sendmsg "x" * 188 }
+
+      assert_equal 1316, @remote_client.recvmsg.bytesize
+    end
+
+    it "sends held back packets after the deadline" do
+      @client.coalesce_delay = 20
+      @client.coalesce_writes = true
+
+      @client.sendmsg "x" * 200
+
+      assert_equal 188, @remote_client.recvmsg.bytesize
+
+      @client.flush
+
+      assert_equal 12, @remote_client.recvmsg.bytesize
+    end
+  end
+
+  describe "nonblock" do
+    it "returns :wait_readable when no message is available" do
+      assert_equal :wait_readable, @remote_client.recvmsg_nonblock(exception: false)
+    end
+
+    it "raises when no message is available" do
+      assert_raises(SRT::Error::ASYNCRCV) { @remote_client.recvmsg_nonblock }
+    end
+
+    it "reads an available message" do
+      @client.sendmsg "hello"
+
+      sleep 0.1
+
+      assert_equal "hello", @remote_client.recvmsg_nonblock(exception: false)
+    end
+
+    it "returns the number of bytes sent" do
+      assert_equal 5, @client.sendmsg_nonblock("hello", exception: false)
+    end
+  end
+
+  describe "message api" do
+    it "receives messages larger than a single read" do
+      server = SRT::Socket.new
+      server.transmission_mode = :file
+      server.message_api = true
+      server.bind "127.0.0.1", "6793"
+      server.listen 2
+
+      client = SRT::Socket.new
+      client.transmission_mode = :file
+      client.message_api = true
+      client.connect "127.0.0.1", "6793"
+
+      remote_client = server.accept
+
+      message = Random.new(1).bytes(2 * 1024 * 1024)
+
+      receiver = Thread.new { remote_client.recvmsg }
+
+      assert_equal message.bytesize, client.sendmsg(message)
+
+      assert_equal message, receiver.value
+    ensure
+      remote_client.close if remote_client
+      client.close if client
+      server.close if server
+    end
+  end
+
+  describe "file transfer" do
+    it "sends and receives files" do
+      server = SRT::Socket.new
+      server.transmission_mode = :file
+      server.bind "127.0.0.1", "6792"
+      server.listen 2
+
+      client = SRT::Socket.new
+      client.transmission_mode = :file
+      client.connect "127.0.0.1", "6792"
+
+      remote_client = server.accept
+
+      source = Tempfile.new "rbsrt-sendfile"
+      source.write Random.new(1).bytes(1024 * 1024)
+      source.flush
+
+      destination = Tempfile.new "rbsrt-recvfile"
+
+      receiver = Thread.new { remote_client.recvfile destination.path, size: 1024 * 1024 - 100 }
+
+      assert_equal 1024 * 1024 - 100, client.sendfile(source, offset: 100)
+      assert_equal 1024 * 1024 - 100, receiver.value
+
+      assert_equal File.binread(source.path, nil, 100), File.binread(destination.path)
+    ensure
+      remote_client.close if remote_client
+      client.close if client
+      server.close if server
+      source.close! if source
+      destination.close! if destination
+    end
+
+    it "transfers from and to IOs at their position" do
+      server = SRT::Socket.new
+      server.transmission_mode = :file
+      server.bind "127.0.0.1", "6838"
+      server.listen 2
+
+      client = SRT::Socket.new
+      client.transmission_mode = :file
+      client.connect "127.0.0.1", "6838"
+
+      remote_client = server.accept
+
+      data = Random.new(2).bytes(64 * 1024)
+
+      source = Tempfile.new "rbsrt-sendfile"
+      source.write data
+      source.rewind
+      source.read 100
+
+      destination = Tempfile.new "rbsrt-recvfile"
+      destination.write "head"
+
+      receiver = Thread.new { remote_client.recvfile destination, size: data.bytesize - 100 }
+
+      assert_equal data.bytesize - 100, client.sendfile(source)
+      assert_equal data.bytesize - 100, receiver.value
+      assert_equal data.bytesize, source.pos
+
+      assert_equal "head" + data.byteslice(100..), File.binread(destination.path)
+    ensure
+      remote_client.close if remote_client
+      client.close if client
+      server.close if server
+      source.close! if source
+      destination.close! if destination
+    end
+
+    it "refuses live mode sockets before opening the file" do
+      destination = Tempfile.new "rbsrt-recvfile"
+      destination.write "keep"
+      destination.flush
+
+      assert_raises(ArgumentError) { @remote_client.recvfile destination.path, size: 1024 }
+      assert_equal "keep", File.binread(destination.path)
+    ensure
+      destination.close! if destination
+    end
+
+    it "can interrupt a file transfer" do
+      server = SRT::Socket.new
+      server.transmission_mode = :file
+      server.bind "127.0.0.1", "6831"
+      server.listen 2
+
+      client = SRT::Socket.new
+      client.transmission_mode = :file
+      client.connect "127.0.0.1", "6831"
+
+      remote_client = server.accept
+
+      destination = Tempfile.new "rbsrt-recvfile"
+
+      assert_raises(Timeout::Error) do
+        Timeout.timeout(0.2) { remote_client.recvfile destination.path, size: 1024 * 1024 }
+      end
+    ensure
+      remote_client.close if remote_client
+      client.close if client
+      server.close if server
+      destination.close! if destination
+    end
+  end
+end